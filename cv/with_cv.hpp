@@ -7,6 +7,11 @@
 
 #include "wrapper/box_image.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define TRACK_KALMAN_SSE
+#endif
+
 class track_kalman {
 public:
 	cv::KalmanFilter kf;
@@ -26,7 +31,7 @@ public:
 	}
 
 	void set(std::vector<bbox_t> result_vec) {
-		for (size_t i = 0; i < result_vec.size() && i < state_size*2; ++i) {
+		for (size_t i = 0; i < result_vec.size() && i * 2 + 1 < state_size; ++i) {
 			kf.statePost.at<float>(i * 2 + 0) = result_vec[i].x;
 			kf.statePost.at<float>(i * 2 + 1) = result_vec[i].y;
 		}
@@ -36,12 +41,12 @@ public:
 	// corrected state (x(k)): x(k)=x'(k)+K(k)*(z(k)-H*x'(k))
 	std::vector<bbox_t> correct(std::vector<bbox_t> result_vec) {
 		cv::Mat measurement(meas_size, 1, CV_32F);
-		for (size_t i = 0; i < result_vec.size() && i < meas_size * 2; ++i) {
+		for (size_t i = 0; i < result_vec.size() && i * 2 + 1 < meas_size; ++i) {
 			measurement.at<float>(i * 2 + 0) = result_vec[i].x;
 			measurement.at<float>(i * 2 + 1) = result_vec[i].y;
 		}
 		cv::Mat estimated = kf.correct(measurement);
-		for (size_t i = 0; i < result_vec.size() && i < meas_size * 2; ++i) {
+		for (size_t i = 0; i < result_vec.size() && i * 2 + 1 < meas_size; ++i) {
 			result_vec[i].x = estimated.at<float>(i * 2 + 0);
 			result_vec[i].y = estimated.at<float>(i * 2 + 1);
 		}
@@ -51,10 +56,10 @@ public:
 	// Kalman.predict() calculates: statePre = TransitionMatrix * statePost;
 	// predicted state (x'(k)): x(k)=A*x(k-1)+B*u(k)
 	std::vector<bbox_t> predict() {
-		std::vector<bbox_t> result_vec;
+		std::vector<bbox_t> result_vec(state_size / 2);
 		cv::Mat control;
 		cv::Mat prediction = kf.predict(control);
-		for (size_t i = 0; i < prediction.rows && i < state_size * 2; ++i) {
+		for (size_t i = 0; i < result_vec.size() && i * 2 + 1 < prediction.rows; ++i) {
 			result_vec[i].x = prediction.at<float>(i * 2 + 0);
 			result_vec[i].y = prediction.at<float>(i * 2 + 1);
 		}
@@ -64,6 +69,228 @@ public:
 };
 
 
+// Bank of independent constant-velocity Kalman filters - one filter per tracked object.
+// Each box coordinate (center x, center y, width, height) has its own 2-state model (position, velocity),
+// so the covariance is a 2x2 block per coordinate and the whole bank is kept as SoA arrays:
+// predict and correct update all tracks at once (4 tracks per SSE instruction).
+// Time is measured in the same units that are passed to correct()/predict() (frames in yolo_console_dll.cpp).
+class track_kalman_bank {
+	enum { coords = 4, simd_width = 4 };
+
+	std::vector<bbox_t> track_vec;		// obj_id, track_id, prob, frames_counter of each track
+	std::vector<int> misses_vec;		// how many corrections in a row the track got no measurement
+
+	// SoA arrays [coord][track], size is rounded up to simd_width
+	std::vector<float> pos[coords], vel[coords];				// state x = [pos, vel]
+	std::vector<float> p00[coords], p01[coords], p11[coords];	// covariance P = [p00 p01; p01 p11]
+	std::vector<float> meas[coords];							// measurement z
+	std::vector<float> mask;									// 1 - track is measured in this correction, 0 - not
+
+	float bank_time;
+	bool time_valid;
+
+public:
+	float const process_noise;		// white acceleration noise
+	float const measurement_noise;	// variance of detected box coordinates
+	float const init_vel_cov;		// velocity variance of a new track
+	int const max_misses;			// remove the track after this number of corrections without measurement
+
+	track_kalman_bank(float _process_noise = 1.0F, float _measurement_noise = 10.0F, float _init_vel_cov = 100.0F,
+		int _max_misses = 5) :
+		bank_time(0), time_valid(false), process_noise(_process_noise), measurement_noise(_measurement_noise),
+		init_vel_cov(_init_vel_cov), max_misses(_max_misses)
+	{}
+
+	size_t size() const { return track_vec.size(); }
+
+	void clear() {
+		track_vec.clear();
+		misses_vec.clear();
+		resize_lanes(0);
+		time_valid = false;
+	}
+
+	// time update of all tracks: x(k) = A*x(k-1), P(k) = A*P(k-1)*A' + Q
+	void predict_all(float dt)
+	{
+		float const q00 = process_noise * dt * dt * dt / 3, q01 = process_noise * dt * dt / 2, q11 = process_noise * dt;
+		size_t const lanes = mask.size();
+		for (int d = 0; d < coords; ++d) {
+			float *x = pos[d].data(), *v = vel[d].data(), *a = p00[d].data(), *b = p01[d].data(), *c = p11[d].data();
+			size_t i = 0;
+#ifdef TRACK_KALMAN_SSE
+			__m128 const dt128 = _mm_set1_ps(dt), two128 = _mm_set1_ps(2);
+			__m128 const q00_128 = _mm_set1_ps(q00), q01_128 = _mm_set1_ps(q01), q11_128 = _mm_set1_ps(q11);
+			for (; i + simd_width <= lanes; i += simd_width) {
+				__m128 x128 = _mm_loadu_ps(x + i), v128 = _mm_loadu_ps(v + i);
+				__m128 a128 = _mm_loadu_ps(a + i), b128 = _mm_loadu_ps(b + i), c128 = _mm_loadu_ps(c + i);
+				x128 = _mm_add_ps(x128, _mm_mul_ps(v128, dt128));
+				// p00 += dt*(2*p01 + dt*p11) + q00
+				__m128 t128 = _mm_add_ps(_mm_mul_ps(two128, b128), _mm_mul_ps(dt128, c128));
+				a128 = _mm_add_ps(_mm_add_ps(a128, _mm_mul_ps(dt128, t128)), q00_128);
+				// p01 += dt*p11 + q01,  p11 += q11
+				b128 = _mm_add_ps(_mm_add_ps(b128, _mm_mul_ps(dt128, c128)), q01_128);
+				c128 = _mm_add_ps(c128, q11_128);
+				_mm_storeu_ps(x + i, x128);
+				_mm_storeu_ps(a + i, a128);
+				_mm_storeu_ps(b + i, b128);
+				_mm_storeu_ps(c + i, c128);
+			}
+#endif
+			for (; i < lanes; ++i) {
+				x[i] += v[i] * dt;
+				a[i] += dt * (2 * b[i] + dt * c[i]) + q00;
+				b[i] += dt * c[i] + q01;
+				c[i] += q11;
+			}
+		}
+	}
+
+	// measurement update of the tracks with mask = 1: x += K*(z - H*x), P = (I - K*H)*P, where H = [1 0]
+	void correct_all()
+	{
+		float const r = measurement_noise;
+		size_t const lanes = mask.size();
+		float const *m = mask.data();
+		for (int d = 0; d < coords; ++d) {
+			float *x = pos[d].data(), *v = vel[d].data(), *a = p00[d].data(), *b = p01[d].data(), *c = p11[d].data();
+			float const *z = meas[d].data();
+			size_t i = 0;
+#ifdef TRACK_KALMAN_SSE
+			__m128 const r128 = _mm_set1_ps(r);
+			for (; i + simd_width <= lanes; i += simd_width) {
+				__m128 x128 = _mm_loadu_ps(x + i), v128 = _mm_loadu_ps(v + i);
+				__m128 a128 = _mm_loadu_ps(a + i), b128 = _mm_loadu_ps(b + i), c128 = _mm_loadu_ps(c + i);
+				__m128 const m128 = _mm_loadu_ps(m + i);
+				__m128 const inv_s128 = _mm_div_ps(m128, _mm_add_ps(a128, r128));	// mask / (p00 + r)
+				__m128 const k0_128 = _mm_mul_ps(a128, inv_s128), k1_128 = _mm_mul_ps(b128, inv_s128);
+				__m128 const y128 = _mm_sub_ps(_mm_loadu_ps(z + i), x128);
+				x128 = _mm_add_ps(x128, _mm_mul_ps(k0_128, y128));
+				v128 = _mm_add_ps(v128, _mm_mul_ps(k1_128, y128));
+				c128 = _mm_sub_ps(c128, _mm_mul_ps(k1_128, b128));
+				b128 = _mm_sub_ps(b128, _mm_mul_ps(k0_128, b128));
+				a128 = _mm_sub_ps(a128, _mm_mul_ps(k0_128, a128));
+				_mm_storeu_ps(x + i, x128);
+				_mm_storeu_ps(v + i, v128);
+				_mm_storeu_ps(a + i, a128);
+				_mm_storeu_ps(b + i, b128);
+				_mm_storeu_ps(c + i, c128);
+			}
+#endif
+			for (; i < lanes; ++i) {
+				float const inv_s = m[i] / (a[i] + r);
+				float const k0 = a[i] * inv_s, k1 = b[i] * inv_s;
+				float const y = z[i] - x[i];
+				x[i] += k0 * y;
+				v[i] += k1 * y;
+				c[i] -= k1 * b[i];
+				b[i] -= k0 * b[i];
+				a[i] -= k0 * a[i];
+			}
+		}
+	}
+
+	// moves the bank to cur_time and corrects it by the detected (or optical-flow tracked) boxes,
+	// boxes with new track_id start new tracks, boxes with track_id = 0 are ignored
+	void correct(std::vector<bbox_t> const& result_vec, float cur_time)
+	{
+		if (time_valid && cur_time > bank_time) predict_all(cur_time - bank_time);
+		if (!time_valid || cur_time > bank_time) bank_time = cur_time, time_valid = true;
+
+		std::fill(mask.begin(), mask.end(), 0.0F);
+		for (auto &i : misses_vec) ++i;
+
+		for (auto &b : result_vec) {
+			if (b.track_id == 0) continue;
+			size_t k = 0;
+			for (; k < track_vec.size(); ++k)
+				if (track_vec[k].track_id == b.track_id && track_vec[k].obj_id == b.obj_id) break;
+
+			float const z[coords] = { b.x + b.w / 2.0F, b.y + b.h / 2.0F, (float)b.w, (float)b.h };
+			if (k == track_vec.size()) {
+				add_track(b, z);
+				continue;
+			}
+			for (int d = 0; d < coords; ++d) meas[d][k] = z[d];
+			mask[k] = 1;
+			misses_vec[k] = 0;
+			track_vec[k] = b;
+		}
+
+		correct_all();
+
+		for (size_t k = 0; k < track_vec.size();) {
+			if (misses_vec[k] > max_misses) remove_track(k);
+			else ++k;
+		}
+	}
+
+	// extrapolated boxes at cur_time, the bank itself isn't changed
+	std::vector<bbox_t> predict(float cur_time) const
+	{
+		float const dt = (time_valid && cur_time > bank_time) ? (cur_time - bank_time) : 0;
+		std::vector<bbox_t> result_vec = track_vec;
+		for (size_t i = 0; i < result_vec.size(); ++i) {
+			float const cx = pos[0][i] + vel[0][i] * dt, cy = pos[1][i] + vel[1][i] * dt;
+			float const w = std::max(0.0F, pos[2][i] + vel[2][i] * dt), h = std::max(0.0F, pos[3][i] + vel[3][i] * dt);
+			auto &bbox = result_vec[i];
+			bbox.x = std::max(0.0F, cx - w / 2);
+			bbox.y = std::max(0.0F, cy - h / 2);
+			bbox.w = w;
+			bbox.h = h;
+		}
+		return result_vec;
+	}
+
+private:
+	void resize_lanes(size_t n)
+	{
+		size_t const lanes = (n + simd_width - 1) / simd_width * simd_width;
+		for (int d = 0; d < coords; ++d) {
+			pos[d].resize(lanes, 0);
+			vel[d].resize(lanes, 0);
+			p00[d].resize(lanes, 1);
+			p01[d].resize(lanes, 0);
+			p11[d].resize(lanes, 1);
+			meas[d].resize(lanes, 0);
+		}
+		mask.resize(lanes, 0);
+	}
+
+	void add_track(bbox_t const& b, float const *z)
+	{
+		size_t const k = track_vec.size();
+		track_vec.push_back(b);
+		misses_vec.push_back(0);
+		resize_lanes(k + 1);
+		for (int d = 0; d < coords; ++d) {
+			pos[d][k] = z[d];
+			vel[d][k] = 0;
+			p00[d][k] = measurement_noise;
+			p01[d][k] = 0;
+			p11[d][k] = init_vel_cov;
+		}
+		mask[k] = 0;
+	}
+
+	void remove_track(size_t k)
+	{
+		size_t const last = track_vec.size() - 1;
+		track_vec[k] = track_vec[last];
+		misses_vec[k] = misses_vec[last];
+		for (int d = 0; d < coords; ++d) {
+			pos[d][k] = pos[d][last];
+			vel[d][k] = vel[d][last];
+			p00[d][k] = p00[d][last];
+			p01[d][k] = p01[d][last];
+			p11[d][k] = p11[d][last];
+		}
+		track_vec.pop_back();
+		misses_vec.pop_back();
+		resize_lanes(last);
+	}
+};
+
 
 
 class extrapolate_coords_t {
@@ -71,8 +298,11 @@ public:
 	std::vector<bbox_t> old_result_vec;
 	std::vector<float> dx_vec, dy_vec, time_vec;
 	std::vector<float> old_dx_vec, old_dy_vec;
+	track_kalman_bank kalman;		// is updated by all results, used by predict() if use_kalman = true
+	bool use_kalman = false;
 
 	void new_result(std::vector<bbox_t> new_result_vec, float new_time) {
+		kalman.correct(new_result_vec, new_time);
 		old_dx_vec = dx_vec;
 		old_dy_vec = dy_vec;
 		if (old_dx_vec.size() != old_result_vec.size()) std::cout << "old_dx != old_res \n";
@@ -84,6 +314,7 @@ public:
 	}
 
 	void update_result(std::vector<bbox_t> new_result_vec, float new_time, bool update = true) {
+		if (update) kalman.correct(new_result_vec, new_time);
 		for (size_t i = 0; i < new_result_vec.size(); ++i) {
 			for (size_t k = 0; k < old_result_vec.size(); ++k) {
 				if (old_result_vec[k].track_id == new_result_vec[i].track_id && old_result_vec[k].obj_id == new_result_vec[i].obj_id) {
@@ -124,6 +355,7 @@ public:
 	}
 
 	std::vector<bbox_t> predict(float cur_time) {
+		if (use_kalman) return kalman.predict(cur_time);
 		std::vector<bbox_t> result_vec = old_result_vec;
 		for (size_t i = 0; i < old_result_vec.size(); ++i) {
 			float const delta_time = cur_time - time_vec[i];
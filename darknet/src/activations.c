@@ -100,6 +100,19 @@ void activate_array(float *x, const int n, const ACTIVATION a)
     }
 }
 
+// x = a2(a(x) + add), one pass of a convolution with a fused shortcut
+void activate_add_activate_array(float *x, const float *add, const int n, const ACTIVATION a, const ACTIVATION a2)
+{
+    int i;
+    if (a == LEAKY && a2 == LINEAR) {   // residual blocks of darknet-53
+        for (i = 0; i < n; ++i) x[i] = leaky_activate(x[i]) + add[i];
+        return;
+    }
+    for (i = 0; i < n; ++i) {
+        x[i] = activate(activate(x[i], a) + add[i], a2);
+    }
+}
+
 float gradient(float x, ACTIVATION a)
 {
     switch(a){
@@ -0,0 +1,331 @@
+#include "anchors.h"
+#include "data.h"
+#include "data_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define ANCHORS_BLOCK 4096	// boxes of a parallel task
+
+static int max_threads()
+{
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+static int thread_num()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+// xorshift32, the results don't depend on rand() of other threads
+static unsigned int anchors_rand(unsigned int *state)
+{
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static float box_size_iou(float w, float h, float area, float cw, float ch)
+{
+	float const inter = ((w < cw) ? w : cw) * ((h < ch) ? h : ch);
+	return inter / (area + cw*ch - inter);
+}
+
+box_sizes load_box_sizes(char **paths, int n, int width, int height)
+{
+	box_sizes b = { 0 };
+	box_label **labels = calloc(n, sizeof(box_label *));
+	int *counts = calloc(n + 1, sizeof(int));
+	int i;
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (i = 0; i < n; ++i) {
+		char labelpath[4096];
+		replace_image_to_label(paths[i], labelpath);
+		int num_labels = 0;
+		box_label *truth = read_boxes_cached(labelpath, &num_labels);
+		// boxes without area don't have IoU
+		int j, valid = 0;
+		for (j = 0; j < num_labels; ++j) {
+			if (truth[j].w > 0 && truth[j].h > 0) truth[valid++] = truth[j];
+		}
+		labels[i] = truth;
+		counts[i + 1] = valid;
+	}
+	for (i = 0; i < n; ++i) counts[i + 1] += counts[i];
+
+	b.n = counts[n];
+	b.w = calloc(b.n + 1, sizeof(float));
+	b.h = calloc(b.n + 1, sizeof(float));
+	b.area = calloc(b.n + 1, sizeof(float));
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (i = 0; i < n; ++i) {
+		int j;
+		for (j = counts[i]; j < counts[i + 1]; ++j) {
+			box_label const *l = labels[i] + j - counts[i];
+			b.w[j] = l->w * width;
+			b.h[j] = l->h * height;
+			b.area[j] = b.w[j] * b.h[j];
+		}
+		free(labels[i]);
+	}
+	free(counts);
+	free(labels);
+	return b;
+}
+
+void free_box_sizes(box_sizes b)
+{
+	free(b.w);
+	free(b.h);
+	free(b.area);
+}
+
+// closest centers (max IoU) of the boxes [i0, i1), returns the number of changed assignments
+static int assign_boxes(box_sizes b, int i0, int i1, float *centers, int k, int *assignments, float *best_iou)
+{
+	int changed = 0;
+	int i = i0, j, t;
+#ifdef __SSE__
+	for (; i + 4 <= i1; i += 4) {
+		__m128 const w = _mm_loadu_ps(b.w + i);
+		__m128 const h = _mm_loadu_ps(b.h + i);
+		__m128 const area = _mm_loadu_ps(b.area + i);
+		__m128 best = _mm_set1_ps(-1);
+		__m128 best_j = _mm_setzero_ps();
+		for (j = 0; j < k; ++j) {
+			__m128 const cw = _mm_set1_ps(centers[j*2]);
+			__m128 const ch = _mm_set1_ps(centers[j*2 + 1]);
+			__m128 const inter = _mm_mul_ps(_mm_min_ps(w, cw), _mm_min_ps(h, ch));
+			__m128 const iou = _mm_div_ps(inter, _mm_sub_ps(_mm_add_ps(area, _mm_mul_ps(cw, ch)), inter));
+			__m128 const better = _mm_cmpgt_ps(iou, best);
+			best = _mm_max_ps(best, iou);
+			best_j = _mm_or_ps(_mm_and_ps(better, _mm_set1_ps((float)j)), _mm_andnot_ps(better, best_j));
+		}
+		float index[4];
+		_mm_storeu_ps(index, best_j);
+		_mm_storeu_ps(best_iou + i, best);
+		for (t = 0; t < 4; ++t) {
+			if (assignments[i + t] != (int)index[t]) ++changed;
+			assignments[i + t] = (int)index[t];
+		}
+	}
+#endif
+	for (; i < i1; ++i) {
+		float best = -1;
+		int best_j = 0;
+		for (j = 0; j < k; ++j) {
+			float const iou = box_size_iou(b.w[i], b.h[i], b.area[i], centers[j*2], centers[j*2 + 1]);
+			if (iou > best) best = iou, best_j = j;
+		}
+		best_iou[i] = best;
+		if (assignments[i] != best_j) ++changed;
+		assignments[i] = best_j;
+	}
+	return changed;
+}
+
+// all boxes in parallel, returns the number of changed assignments; iou_sum - sum of the IoU with the closest
+// centers, sums - per thread k * (sum w, sum h, count) of the assigned boxes (can be 0)
+static int assign_all(box_sizes b, float *centers, int k, int *assignments, float *best_iou, double *sums,
+	double *iou_sum)
+{
+	int const blocks = (b.n + ANCHORS_BLOCK - 1) / ANCHORS_BLOCK;
+	int changed = 0;
+	double total = 0;
+	int i;
+	#pragma omp parallel for reduction(+:changed, total)
+	for (i = 0; i < blocks; ++i) {
+		int const i0 = i*ANCHORS_BLOCK;
+		int const i1 = (i0 + ANCHORS_BLOCK < b.n) ? i0 + ANCHORS_BLOCK : b.n;
+		int j;
+		changed += assign_boxes(b, i0, i1, centers, k, assignments, best_iou);
+		for (j = i0; j < i1; ++j) total += best_iou[j];
+		if (sums) {
+			double *s = sums + thread_num()*k*3;
+			for (j = i0; j < i1; ++j) {
+				double *c = s + assignments[j]*3;
+				c[0] += b.w[j];
+				c[1] += b.h[j];
+				c[2] += 1;
+			}
+		}
+	}
+	if (iou_sum) *iou_sum = total;
+	return changed;
+}
+
+// best_iou[i] = max(best_iou[i], IoU with the center)
+static void update_best_iou(box_sizes b, float cw, float ch, float *best_iou)
+{
+	int const blocks = (b.n + ANCHORS_BLOCK - 1) / ANCHORS_BLOCK;
+	int i;
+	#pragma omp parallel for
+	for (i = 0; i < blocks; ++i) {
+		int const i1 = (i*ANCHORS_BLOCK + ANCHORS_BLOCK < b.n) ? i*ANCHORS_BLOCK + ANCHORS_BLOCK : b.n;
+		int j = i*ANCHORS_BLOCK;
+#ifdef __SSE__
+		__m128 const cw4 = _mm_set1_ps(cw);
+		__m128 const ch4 = _mm_set1_ps(ch);
+		__m128 const carea4 = _mm_set1_ps(cw*ch);
+		for (; j + 4 <= i1; j += 4) {
+			__m128 const inter = _mm_mul_ps(_mm_min_ps(_mm_loadu_ps(b.w + j), cw4), _mm_min_ps(_mm_loadu_ps(b.h + j), ch4));
+			__m128 const iou = _mm_div_ps(inter, _mm_sub_ps(_mm_add_ps(_mm_loadu_ps(b.area + j), carea4), inter));
+			_mm_storeu_ps(best_iou + j, _mm_max_ps(_mm_loadu_ps(best_iou + j), iou));
+		}
+#endif
+		for (; j < i1; ++j) {
+			float const iou = box_size_iou(b.w[j], b.h[j], b.area[j], cw, ch);
+			if (iou > best_iou[j]) best_iou[j] = iou;
+		}
+	}
+}
+
+// k-means++: the next center is a box chosen with probability ~ (1 - IoU with the closest center)^2
+static void kmeans_pp_init(box_sizes b, int k, unsigned int *seed, float *centers, float *best_iou)
+{
+	int c, i;
+	for (i = 0; i < b.n; ++i) best_iou[i] = -1;
+	for (c = 0; c < k; ++c) {
+		int chosen = anchors_rand(seed) % b.n;
+		if (c > 0) {
+			double total = 0;
+			#pragma omp parallel for reduction(+:total)
+			for (i = 0; i < b.n; ++i) {
+				double const d = 1 - best_iou[i];
+				total += d*d;
+			}
+			if (total > 0) {
+				double const r = total * (anchors_rand(seed) / 4294967296.0);
+				double sum = 0;
+				for (i = 0; i < b.n - 1; ++i) {
+					double const d = 1 - best_iou[i];
+					sum += d*d;
+					if (sum > r) break;
+				}
+				chosen = i;
+			}
+		}
+		centers[c*2] = b.w[chosen];
+		centers[c*2 + 1] = b.h[chosen];
+		update_best_iou(b, centers[c*2], centers[c*2 + 1], best_iou);
+	}
+}
+
+// a center without boxes gets the box which is the farthest from its center
+static void reseed_center(box_sizes b, float *centers, int c, float *best_iou)
+{
+	int i, worst = 0;
+	for (i = 1; i < b.n; ++i) {
+		if (best_iou[i] < best_iou[worst]) worst = i;
+	}
+	centers[c*2] = b.w[worst];
+	centers[c*2 + 1] = b.h[worst];
+	best_iou[worst] = 1;
+}
+
+static void kmeans_lloyd(box_sizes b, int k, int max_iterations, float *centers, int *assignments, float *best_iou)
+{
+	int const threads = max_threads();
+	double *sums = calloc(threads*k*3, sizeof(double));
+	int iteration, c, t;
+	for (iteration = 0; iteration < max_iterations; ++iteration) {
+		memset(sums, 0, threads*k*3 * sizeof(double));
+		if (assign_all(b, centers, k, assignments, best_iou, sums, 0) == 0) break;
+		for (c = 0; c < k; ++c) {
+			double w = 0, h = 0, count = 0;
+			for (t = 0; t < threads; ++t) {
+				double const *s = sums + (t*k + c)*3;
+				w += s[0];
+				h += s[1];
+				count += s[2];
+			}
+			if (count > 0) {
+				centers[c*2] = w / count;
+				centers[c*2 + 1] = h / count;
+			}
+			else reseed_center(b, centers, c, best_iou);
+		}
+	}
+	free(sums);
+}
+
+// Sculley's mini-batch k-means: per-center learning rate 1 / (boxes assigned so far)
+static void kmeans_mini_batch(box_sizes b, int k, int max_iterations, int mini_batch, unsigned int *seed, float *centers)
+{
+	box_sizes batch;
+	batch.n = mini_batch;
+	batch.w = calloc(mini_batch, sizeof(float));
+	batch.h = calloc(mini_batch, sizeof(float));
+	batch.area = calloc(mini_batch, sizeof(float));
+	int *batch_assignments = calloc(mini_batch, sizeof(int));
+	float *batch_iou = calloc(mini_batch, sizeof(float));
+	int *counts = calloc(k, sizeof(int));
+	float *old_centers = calloc(k*2, sizeof(float));
+	int iteration, i, c;
+	for (iteration = 0; iteration < max_iterations; ++iteration) {
+		for (i = 0; i < mini_batch; ++i) {
+			int const r = anchors_rand(seed) % b.n;
+			batch.w[i] = b.w[r];
+			batch.h[i] = b.h[r];
+			batch.area[i] = b.area[r];
+		}
+		assign_all(batch, centers, k, batch_assignments, batch_iou, 0, 0);
+		memcpy(old_centers, centers, k*2 * sizeof(float));
+		for (i = 0; i < mini_batch; ++i) {
+			c = batch_assignments[i];
+			float const eta = 1.F / ++counts[c];
+			centers[c*2] += eta * (batch.w[i] - centers[c*2]);
+			centers[c*2 + 1] += eta * (batch.h[i] - centers[c*2 + 1]);
+		}
+		// converged: no center moves by more than 0.01 px
+		float max_shift = 0;
+		for (i = 0; i < k*2; ++i) {
+			float const shift = fabsf(centers[i] - old_centers[i]);
+			if (shift > max_shift) max_shift = shift;
+		}
+		if (max_shift < 0.01F) break;
+	}
+	free(old_centers);
+	free(counts);
+	free(batch_iou);
+	free(batch_assignments);
+	free_box_sizes(batch);
+}
+
+float kmeans_anchors(box_sizes b, int k, int max_iterations, int mini_batch, unsigned int seed, float *centers,
+	int *assignments)
+{
+	if (b.n == 0 || k < 1) return 0;
+	if (seed == 0) seed = 1;
+	int *assign = assignments ? assignments : calloc(b.n, sizeof(int));
+	float *best_iou = calloc(b.n + 1, sizeof(float));
+	int i;
+	for (i = 0; i < b.n; ++i) assign[i] = -1;
+
+	kmeans_pp_init(b, k, &seed, centers, best_iou);
+	if (mini_batch > 0 && mini_batch < b.n) kmeans_mini_batch(b, k, max_iterations, mini_batch, &seed, centers);
+	else kmeans_lloyd(b, k, max_iterations, centers, assign, best_iou);
+
+	double iou_sum = 0;
+	assign_all(b, centers, k, assign, best_iou, 0, &iou_sum);
+	free(best_iou);
+	if (!assignments) free(assign);
+	return iou_sum / b.n;
+}
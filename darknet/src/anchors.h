@@ -0,0 +1,21 @@
+#ifndef ANCHORS_H
+#define ANCHORS_H
+
+// Anchors: k-means of the label box sizes with the distance 1 - IoU (a box and a centroid share the top-left
+// corner). The sizes are kept as SoA arrays, IoU is computed for 4 boxes at once (SSE), all loops are OpenMP.
+typedef struct {
+	int n;
+	float *w, *h, *area;
+} box_sizes;
+
+// sizes of the label boxes of the images in pixels of width x height, the label files are read in parallel
+box_sizes load_box_sizes(char **paths, int n, int width, int height);
+void free_box_sizes(box_sizes b);
+
+// k-means++ initialization, then Lloyd iterations (mini_batch = 0) or mini-batch k-means with mini_batch random
+// boxes per iteration. centers - k * (w, h), assignments - b.n cluster indexes (can be 0).
+// Returns the average IoU of the boxes with their closest centers.
+float kmeans_anchors(box_sizes b, int k, int max_iterations, int mini_batch, unsigned int seed, float *centers,
+	int *assignments);
+
+#endif
@@ -2,6 +2,7 @@
 #include "utils.h"
 #include "parser.h"
 #include "option_list.h"
+#include "data_cache.h"
 #include "blas.h"
 #include "assert.h"
 #include "classifier.h"
@@ -104,17 +105,15 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
 
     data train;
     data buffer;
-    pthread_t load_thread;
     args.d = &buffer;
-    load_thread = load_data(args);
+    set_image_cache((size_t)option_find_int_quiet(options, "cache_mb", 0) * 1024 * 1024, option_find_int_quiet(options, "cache_side", 0));
+    data_loader *loader = make_data_loader(args, option_find_int_quiet(options, "prefetch", 2));
 
     int epoch = (*net.seen)/N;
     while(get_current_batch(net) < net.max_batches || net.max_batches == 0){
         time=clock();
 
-        pthread_join(load_thread, 0);
-        train = buffer;
-        load_thread = load_data(args);
+        train = data_loader_next(loader);
 
         printf("Loaded: %lf seconds\n", sec(clock()-time));
         time=clock();
@@ -145,6 +144,7 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
             save_weights(net, buff);
         }
     }
+    free_data_loader(loader);
     char buff[256];
     sprintf(buff, "%s/%s.weights", backup_directory, base);
     save_weights(net, buff);
@@ -476,6 +476,7 @@ void pull_convolutional_layer(convolutional_layer layer)
         cuda_pull_array(layer.m_gpu, layer.m, layer.c*layer.n*layer.size*layer.size);
         cuda_pull_array(layer.v_gpu, layer.v, layer.c*layer.n*layer.size*layer.size);
     }
+    pack_binary_weights(layer);
 }
 
 void push_convolutional_layer(convolutional_layer layer)
@@ -305,6 +305,9 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     if(xnor){
         l.binary_weights = calloc(c*n*size*size, sizeof(float));
         l.binary_input = calloc(l.inputs*l.batch, sizeof(float));
+        l.bit_weights = calloc((size_t)n*((c*size*size + 63)/64), sizeof(uint64_t));
+        l.bit_scales = calloc(n, sizeof(float));
+        pack_binary_weights(l);
     }
 
     if(batch_normalize){
@@ -458,6 +461,9 @@ void resize_convolutional_layer(convolutional_layer *l, int w, int h)
 
     l->output = realloc(l->output, l->batch*l->outputs*sizeof(float));
     l->delta  = realloc(l->delta,  l->batch*l->outputs*sizeof(float));
+    if(l->xnor){
+        l->binary_input = realloc(l->binary_input, l->batch*l->inputs*sizeof(float));
+    }
     if(l->batch_normalize){
         l->x = realloc(l->x, l->batch*l->outputs*sizeof(float));
         l->x_norm  = realloc(l->x_norm, l->batch*l->outputs*sizeof(float));
@@ -532,12 +538,125 @@ void backward_bias(float *bias_updates, float *delta, int batch, int n, int size
     }
 }
 
+// batchnorm, bias and activation (with the fused shortcut) of l.output
+static void forward_convolutional_epilogue(convolutional_layer l, network_state state)
+{
+    int size = l.out_h*l.out_w*l.n*l.batch;
+    if(l.batch_normalize){
+        forward_batchnorm_layer(l, state);
+    }
+    add_bias(l.output, l.biases, l.batch, l.n, l.out_h*l.out_w);
+
+    if (l.fused_shortcut) {
+        layer s = state.net.layers[state.index + 1];
+        activate_add_activate_array(l.output, state.net.layers[s.index].output, size, l.activation, s.activation);
+    }
+    else activate_array(l.output, size, l.activation);
+}
+
+// 1x1 convolution of upsample -> route (fuse_upsample_layers): the weights of each route input
+// are applied to it directly, for the upsample layer - to its low resolution input, then the result is upsampled
+static void forward_convolutional_upsample(convolutional_layer l, network_state state)
+{
+    layer route = state.net.layers[state.index - 1];
+    layer up = state.net.layers[state.index - 2];
+    float *up_input = state.net.layers[state.index - 3].output;
+    float *low = up.own_output ? up.own_output : up.output;     // the upsample layer doesn't use it
+    int n = l.out_h*l.out_w;
+    int low_n = up.w*up.h;
+    int s = up.stride;
+    int b, i, j, k, y, x;
+
+    fill_cpu(l.outputs*l.batch, 0, l.output, 1);
+    for(b = 0; b < l.batch; ++b){
+        float *out = l.output + b*l.outputs;
+        float *low_b = low + b*l.n*low_n;
+        int c_offset = 0;
+        for(i = 0; i < route.n; ++i){
+            int index = route.input_layers[i];
+            int c = route.input_sizes[i] / n;
+            if(index == state.index - 2){
+                fill_cpu(l.n*low_n, 0, low_b, 1);
+                if(l.weights_half) gemm_half(l.n,low_n,c,1,l.weights_half + c_offset,l.c,up_input + b*up.inputs,low_n,1,low_b,low_n);
+                else gemm(0,0,l.n,low_n,c,1,l.weights + c_offset,l.c,up_input + b*up.inputs,low_n,1,low_b,low_n);
+            }else{
+                float *in = state.net.layers[index].output + b*route.input_sizes[i];
+                if(l.weights_half) gemm_half(l.n,n,c,1,l.weights_half + c_offset,l.c,in,n,1,out,n);
+                else gemm(0,0,l.n,n,c,1,l.weights + c_offset,l.c,in,n,1,out,n);
+            }
+            c_offset += c;
+        }
+        for(k = 0; k < l.n; ++k){
+            for(y = 0; y < l.out_h; ++y){
+                const float *low_row = low_b + k*low_n + (y/s)*up.w;
+                float *out_row = out + k*n + y*l.out_w;
+                if(s == 2){
+                    for(x = 0; x < up.w; ++x){
+                        float v = up.scale*low_row[x];
+                        out_row[2*x] += v;
+                        out_row[2*x + 1] += v;
+                    }
+                }else{
+                    for(j = 0; j < l.out_w; ++j) out_row[j] += up.scale*low_row[j/s];
+                }
+            }
+        }
+    }
+    forward_convolutional_epilogue(l, state);
+}
+
+// sign bits and mean |weight| of each filter, the same binarization as binarize_weights()
+void pack_binary_weights(convolutional_layer l)
+{
+    if(!l.bit_weights) return;
+    int size = l.c*l.size*l.size;
+    int k_words = (size + 63) / 64;
+    int i, f;
+    for(f = 0; f < l.n; ++f){
+        float *w = l.weights + f*size;
+        uint64_t *bits = l.bit_weights + (size_t)f*k_words;
+        float mean = 0;
+        for(i = 0; i < size; ++i) mean += fabs(w[i]);
+        l.bit_scales[f] = mean / size;
+        for(i = 0; i < k_words; ++i) bits[i] = 0;
+        for(i = 0; i < size; ++i){
+            if(w[i] > 0) bits[i >> 6] |= (uint64_t)1 << (i & 63);
+        }
+    }
+}
+
+// xnor inference: inputs and weights are packed to sign bits, dot products are popcounts
+static void forward_convolutional_layer_xnor(convolutional_layer l, network_state state)
+{
+    int n = l.out_h*l.out_w;
+    int k_words = (l.c*l.size*l.size + 63) / 64;
+    uint64_t *bits = (uint64_t *)state.workspace;
+    uint64_t *mask = bits + (size_t)n*k_words;
+    int b;
+
+    for(b = 0; b < l.batch; ++b){
+        im2col_cpu_bits(state.input + b*l.inputs, l.c, l.h, l.w, l.size, l.stride, l.pad, bits, mask);
+        gemm_xnor_bits(l.n, n, k_words, l.bit_weights, bits, mask, l.bit_scales, l.output + b*l.outputs, n);
+    }
+    forward_convolutional_epilogue(l, state);
+}
+
 void forward_convolutional_layer(convolutional_layer l, network_state state)
 {
     int out_h = convolutional_out_height(l);
     int out_w = convolutional_out_width(l);
     int i;
 
+    if(l.fused_upsample){
+        forward_convolutional_upsample(l, state);
+        return;
+    }
+    // packed bits and masks take 16*ceil(K/64) bytes per column, the workspace has 4*K
+    if(l.xnor && !state.train && l.bit_weights && l.size*l.size*l.c >= 4){
+        forward_convolutional_layer_xnor(l, state);
+        return;
+    }
+
     fill_cpu(l.outputs*l.batch, 0, l.output, 1);
 
     if(l.xnor){
@@ -559,17 +678,13 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
     for(i = 0; i < l.batch; ++i){
         im2col_cpu(state.input, l.c, l.h, l.w, 
                 l.size, l.stride, l.pad, b);
-        gemm(0,0,m,n,k,1,a,k,b,n,1,c,n);
+        if(l.weights_half) gemm_half(m,n,k,1,l.weights_half,k,b,n,1,c,n);
+        else gemm(0,0,m,n,k,1,a,k,b,n,1,c,n);
         c += n*m;
         state.input += l.c*l.h*l.w;
     }
 
-    if(l.batch_normalize){
-        forward_batchnorm_layer(l, state);
-    }
-    add_bias(l.output, l.biases, l.batch, l.n, out_h*out_w);
-
-    activate_array(l.output, m*n*l.batch, l.activation);
+    forward_convolutional_epilogue(l, state);
     if(l.binary || l.xnor) swap_binary(&l);
 }
 
@@ -625,6 +740,7 @@ void update_convolutional_layer(convolutional_layer l, int batch, float learning
     axpy_cpu(size, -decay*batch, l.weights, 1, l.weight_updates, 1);
     axpy_cpu(size, learning_rate/batch, l.weight_updates, 1, l.weights, 1);
     scal_cpu(size, momentum, l.weight_updates, 1);
+    pack_binary_weights(l);
 }
 
 
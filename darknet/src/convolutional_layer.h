@@ -34,6 +34,8 @@ image *visualize_convolutional_layer(convolutional_layer layer, char *window, im
 void binarize_weights(float *weights, int n, int size, float *binary);
 void swap_binary(convolutional_layer *l);
 void binarize_weights2(float *weights, int n, int size, char *binary, float *scales);
+// xnor inference weights (bit_weights, bit_scales), call after l.weights are changed
+void pack_binary_weights(convolutional_layer l);
 
 void backward_convolutional_layer(convolutional_layer layer, network_state state);
 
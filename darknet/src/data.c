@@ -1,6 +1,8 @@
 #include "data.h"
 #include "utils.h"
 #include "image.h"
+#include "data_cache.h"
+#include "data_pack.h"
 #include "cuda.h"
 
 #include <stdio.h>
@@ -12,6 +14,7 @@ pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 list *get_paths(char *filename)
 {
     char *path;
+    if(is_data_pack(filename)) return open_data_pack(filename);
     FILE *file = fopen(filename, "r");
     if(!file) file_error(filename);
     list *lines = make_list();
@@ -113,7 +116,7 @@ matrix load_image_augment_paths(char **paths, int n, int use_flip, int min, int
     X.cols = 0;
 
     for(i = 0; i < n; ++i){
-        image im = load_image_color(paths[i], 0, 0);
+        image im = load_image_color_cached(paths[i]);
         image crop = random_augment_image(im, angle, aspect, min, max, size);
         int flip = use_flip ? random_gen() % 2 : 0;
         if (flip)
@@ -217,7 +220,7 @@ void fill_truth_swag(char *path, float *truth, int classes, int flip, float dx,
     find_replace(labelpath, ".JPEG", ".txt", labelpath);
 
     int count = 0;
-    box_label *boxes = read_boxes(labelpath, &count);
+    box_label *boxes = read_boxes_cached(labelpath, &count);
     randomize_boxes(boxes, count);
     correct_boxes(boxes, count, dx, dy, sx, sy, flip);
     float x,y,w,h;
@@ -256,7 +259,7 @@ void fill_truth_region(char *path, float *truth, int classes, int num_boxes, int
     find_replace(labelpath, ".JPG", ".txt", labelpath);
     find_replace(labelpath, ".JPEG", ".txt", labelpath);
     int count = 0;
-    box_label *boxes = read_boxes(labelpath, &count);
+    box_label *boxes = read_boxes_cached(labelpath, &count);
     randomize_boxes(boxes, count);
     correct_boxes(boxes, count, dx, dy, sx, sy, flip);
     float x,y,w,h;
@@ -293,10 +296,8 @@ void fill_truth_region(char *path, float *truth, int classes, int num_boxes, int
     free(boxes);
 }
 
-void fill_truth_detection(char *path, int num_boxes, float *truth, int classes, int flip, float dx, float dy, float sx, float sy, 
-	int small_object, int net_w, int net_h)
+void replace_image_to_label(char *path, char *labelpath)
 {
-    char labelpath[4096];
     find_replace(path, "images", "labels", labelpath);
     find_replace(labelpath, "JPEGImages", "labels", labelpath);
 
@@ -306,9 +307,16 @@ void fill_truth_detection(char *path, int num_boxes, float *truth, int classes,
 	find_replace(labelpath, ".bmp", ".txt", labelpath);
     find_replace(labelpath, ".JPG", ".txt", labelpath);
     find_replace(labelpath, ".JPEG", ".txt", labelpath);
+}
+
+void fill_truth_detection(char *path, int num_boxes, float *truth, int classes, int flip, float dx, float dy, float sx, float sy, 
+	int small_object, int net_w, int net_h)
+{
+    char labelpath[4096];
+    replace_image_to_label(path, labelpath);
     int count = 0;
 	int i;
-    box_label *boxes = read_boxes(labelpath, &count);
+    box_label *boxes = read_boxes_cached(labelpath, &count);
 	float lowest_w = 1.F / net_w;
 	float lowest_h = 1.F / net_h;
 	if (small_object == 1) {
@@ -519,7 +527,7 @@ data load_data_region(int n, char **paths, int m, int w, int h, int size, int cl
     int k = size*size*(5+classes);
     d.y = make_matrix(n, k);
     for(i = 0; i < n; ++i){
-        image orig = load_image_color(random_paths[i], 0, 0);
+        image orig = load_image_color_cached(random_paths[i]);
 
         int oh = orig.h;
         int ow = orig.w;
@@ -627,7 +635,7 @@ data load_data_swag(char **paths, int n, int classes, float jitter)
     int index = random_gen()%n;
     char *random_path = paths[index];
 
-    image orig = load_image_color(random_path, 0, 0);
+    image orig = load_image_color_cached(random_path);
     int h = orig.h;
     int w = orig.w;
 
@@ -701,9 +709,8 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, in
     for(i = 0; i < n; ++i){
 		const char *filename = random_paths[i];
 
-		int flag = 1;
 		IplImage *src;
-		if ((src = cvLoadImage(filename, flag)) == 0)
+		if ((src = load_ipl_image_cached(filename)) == 0)
 		{
 			fprintf(stderr, "Cannot load image \"%s\"\n", filename);
 			char buff[256];
@@ -766,7 +773,7 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, in
 
 	d.y = make_matrix(n, 5 * boxes);
 	for (i = 0; i < n; ++i) {
-		image orig = load_image_color(random_paths[i], 0, 0);
+		image orig = load_image_color_cached(random_paths[i]);
 
 		int oh = orig.h;
 		int ow = orig.w;
@@ -832,10 +839,10 @@ void *load_thread(void *ptr)
     } else if (a.type == COMPARE_DATA){
         *a.d = load_data_compare(a.n, a.paths, a.m, a.classes, a.w, a.h);
     } else if (a.type == IMAGE_DATA){
-        *(a.im) = load_image_color(a.path, 0, 0);
+        *(a.im) = load_image_color_cached(a.path);
         *(a.resized) = resize_image(*(a.im), a.w, a.h);
 	}else if (a.type == LETTERBOX_DATA) {
-		*(a.im) = load_image_color(a.path, 0, 0);
+		*(a.im) = load_image_color_cached(a.path);
 		*(a.resized) = letterbox_image(*(a.im), a.w, a.h);
     } else if (a.type == TAG_DATA){
         *a.d = load_data_tag(a.paths, a.n, a.m, a.classes, a.flip, a.min, a.max, a.size, a.angle, a.aspect, a.hue, a.saturation, a.exposure);
@@ -892,6 +899,157 @@ pthread_t load_data(load_args args)
     return thread;
 }
 
+// one batch of the loader: args.threads parts, loaded by any free worker
+typedef struct {
+    load_args args;
+    data *parts;
+    int next_part;      // the first part which isn't started
+    int parts_left;     // parts which aren't finished
+    int stale;          // started with old args
+} loader_batch;
+
+struct data_loader {
+    load_args args;
+    int prefetch;
+    int workers_n;
+    pthread_t *workers;
+    loader_batch *batches;  // ring, batches[head] is returned next
+    int head;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+};
+
+static void loader_schedule(data_loader *dl, loader_batch *b)
+{
+    b->args = dl->args;
+    b->next_part = 0;
+    b->parts_left = dl->workers_n;
+    b->stale = 0;
+    memset(b->parts, 0, dl->workers_n*sizeof(data));
+}
+
+static void *loader_worker(void *ptr)
+{
+    data_loader *dl = (data_loader *)ptr;
+    pthread_mutex_lock(&dl->mutex);
+    while(!dl->stop){
+        loader_batch *b = 0;
+        int i;
+        for(i = 0; i < dl->prefetch && !b; ++i){
+            loader_batch *c = dl->batches + (dl->head + i) % dl->prefetch;
+            if(c->next_part < dl->workers_n) b = c;
+        }
+        if(!b){
+            pthread_cond_wait(&dl->work_cond, &dl->mutex);
+            continue;
+        }
+        int const k = b->next_part++;
+        load_args *a = calloc(1, sizeof(load_args));
+        *a = b->args;
+        a->n = (k+1) * b->args.n/dl->workers_n - k * b->args.n/dl->workers_n;
+        a->d = b->parts + k;
+        pthread_mutex_unlock(&dl->mutex);
+        load_thread(a);
+        pthread_mutex_lock(&dl->mutex);
+        if(--b->parts_left == 0) pthread_cond_broadcast(&dl->done_cond);
+    }
+    pthread_mutex_unlock(&dl->mutex);
+    return 0;
+}
+
+static void free_loader_parts(data_loader *dl, loader_batch *b)
+{
+    int i;
+    for(i = 0; i < dl->workers_n; ++i) free_data(b->parts[i]);
+}
+
+data_loader *make_data_loader(load_args args, int prefetch)
+{
+    int i;
+    data_loader *dl = calloc(1, sizeof(data_loader));
+    dl->args = args;
+    dl->prefetch = (prefetch > 0) ? prefetch : 1;
+    dl->workers_n = (args.threads > 0) ? args.threads : 1;
+    pthread_mutex_init(&dl->mutex, 0);
+    pthread_cond_init(&dl->work_cond, 0);
+    pthread_cond_init(&dl->done_cond, 0);
+    dl->batches = calloc(dl->prefetch, sizeof(loader_batch));
+    for(i = 0; i < dl->prefetch; ++i){
+        dl->batches[i].parts = calloc(dl->workers_n, sizeof(data));
+        loader_schedule(dl, dl->batches + i);
+    }
+    dl->workers = calloc(dl->workers_n, sizeof(pthread_t));
+    for(i = 0; i < dl->workers_n; ++i){
+        if(pthread_create(dl->workers + i, 0, loader_worker, dl)) error("Thread creation failed");
+    }
+    return dl;
+}
+
+data data_loader_next(data_loader *dl)
+{
+    pthread_mutex_lock(&dl->mutex);
+    for(;;){
+        loader_batch *b = dl->batches + dl->head;
+        while(b->parts_left > 0) pthread_cond_wait(&dl->done_cond, &dl->mutex);
+        data out = {0};
+        int const stale = b->stale;
+        if(stale) free_loader_parts(dl, b);
+        else {
+            int i;
+            out = concat_datas(b->parts, dl->workers_n);
+            out.shallow = 0;
+            for(i = 0; i < dl->workers_n; ++i){
+                b->parts[i].shallow = 1;
+                free_data(b->parts[i]);
+            }
+        }
+        loader_schedule(dl, b);
+        dl->head = (dl->head + 1) % dl->prefetch;
+        pthread_cond_broadcast(&dl->work_cond);
+        if(!stale){
+            pthread_mutex_unlock(&dl->mutex);
+            return out;
+        }
+    }
+}
+
+void data_loader_set_args(data_loader *dl, load_args args)
+{
+    int i;
+    pthread_mutex_lock(&dl->mutex);
+    args.d = dl->args.d;
+    args.threads = dl->args.threads;
+    dl->args = args;
+    for(i = 0; i < dl->prefetch; ++i){
+        loader_batch *b = dl->batches + i;
+        if(b->next_part == 0) b->args = args;
+        else b->stale = 1;
+    }
+    pthread_mutex_unlock(&dl->mutex);
+}
+
+void free_data_loader(data_loader *dl)
+{
+    int i;
+    pthread_mutex_lock(&dl->mutex);
+    dl->stop = 1;
+    pthread_cond_broadcast(&dl->work_cond);
+    pthread_mutex_unlock(&dl->mutex);
+    for(i = 0; i < dl->workers_n; ++i) pthread_join(dl->workers[i], 0);
+    for(i = 0; i < dl->prefetch; ++i){
+        free_loader_parts(dl, dl->batches + i);
+        free(dl->batches[i].parts);
+    }
+    pthread_mutex_destroy(&dl->mutex);
+    pthread_cond_destroy(&dl->work_cond);
+    pthread_cond_destroy(&dl->done_cond);
+    free(dl->batches);
+    free(dl->workers);
+    free(dl);
+}
+
 data load_data_writing(char **paths, int n, int m, int w, int h, int out_w, int out_h)
 {
     if(m) paths = get_random_paths(paths, n, m);
@@ -948,7 +1106,7 @@ data load_data_super(char **paths, int n, int m, int w, int h, int scale)
     d.y.cols = w*scale * h*scale * 3;
 
     for(i = 0; i < n; ++i){
-        image im = load_image_color(paths[i], 0, 0);
+        image im = load_image_color_cached(paths[i]);
         image crop = random_crop_image(im, w*scale, h*scale);
         int flip = random_gen()%2;
         if (flip) flip_image(crop);
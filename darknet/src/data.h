@@ -80,6 +80,15 @@ pthread_t load_data(load_args args);
 
 pthread_t load_data_in_thread(load_args args);
 
+// Persistent loader for training: args.threads workers live for the whole training and load parts of
+// the next `prefetch` batches, so the loading of batch N+1.. overlaps with training on batch N.
+typedef struct data_loader data_loader;
+data_loader *make_data_loader(load_args args, int prefetch);
+data data_loader_next(data_loader *dl);
+// new size/augmentation (random resize), batches which are already started with old args are dropped
+void data_loader_set_args(data_loader *dl, load_args args);
+void free_data_loader(data_loader *dl);
+
 void print_letters(float *pred, int n);
 data load_data_captcha(char **paths, int n, int m, int k, int w, int h);
 data load_data_captcha_encode(char **paths, int n, int m, int w, int h);
@@ -92,6 +101,7 @@ data load_data_augment(char **paths, int n, int m, char **labels, int k, tree *h
 data load_go(char *filename);
 
 box_label *read_boxes(char *filename, int *n);
+void replace_image_to_label(char *path, char *labelpath);
 data load_cifar10_data(char *filename);
 data load_all_cifar10();
 
@@ -0,0 +1,313 @@
+#include "data_cache.h"
+#include "data_pack.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef OPENCV
+#include "opencv2/highgui/highgui_c.h"
+#include "opencv2/core/version.hpp"
+#ifndef CV_VERSION_EPOCH
+#include "opencv2/imgcodecs/imgcodecs_c.h"
+#endif
+#else
+#include "stb_image.h"
+#endif
+
+#define CACHE_BUCKETS (1 << 16)
+
+typedef struct cache_entry {
+    struct cache_entry *next;               // in the hash bucket
+    struct cache_entry *lru_prev, *lru_next;
+    char *key;
+    unsigned int hash;
+    void *data;
+    int w, h;                               // image size, or w - number of boxes
+    size_t bytes;
+} cache_entry;
+
+typedef struct {
+    int enabled;
+    cache_entry **buckets;
+    cache_entry lru;                        // list head: lru.lru_next - the most recently used
+    size_t bytes, max_bytes;                // max_bytes == 0 - no limit
+    size_t count, hits, misses;
+    pthread_mutex_t mutex;
+} data_cache;
+
+static data_cache image_cache;
+static data_cache label_cache;
+static int image_cache_side;
+
+static void init_cache(data_cache *c, size_t max_bytes)
+{
+    if (!c->buckets) {
+        c->buckets = calloc(CACHE_BUCKETS, sizeof(cache_entry *));
+        c->lru.lru_prev = c->lru.lru_next = &c->lru;
+        pthread_mutex_init(&c->mutex, 0);
+    }
+    c->max_bytes = max_bytes;
+    c->enabled = 1;
+}
+
+static unsigned int hash_str(const char *s)
+{
+    unsigned int hash = 2166136261u;
+    for (; *s; ++s) hash = (hash ^ (unsigned char)*s) * 16777619u;
+    return hash;
+}
+
+static void lru_unlink(cache_entry *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push_front(data_cache *c, cache_entry *e)
+{
+    e->lru_prev = &c->lru;
+    e->lru_next = c->lru.lru_next;
+    c->lru.lru_next->lru_prev = e;
+    c->lru.lru_next = e;
+}
+
+// under the mutex
+static cache_entry *cache_find(data_cache *c, const char *key, unsigned int hash)
+{
+    cache_entry *e = c->buckets[hash % CACHE_BUCKETS];
+    for (; e; e = e->next) {
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            lru_unlink(e);
+            lru_push_front(c, e);
+            ++c->hits;
+            return e;
+        }
+    }
+    ++c->misses;
+    return 0;
+}
+
+static void cache_remove(data_cache *c, cache_entry *e)
+{
+    cache_entry **p = &c->buckets[e->hash % CACHE_BUCKETS];
+    while (*p != e) p = &(*p)->next;
+    *p = e->next;
+    lru_unlink(e);
+    c->bytes -= e->bytes;
+    --c->count;
+    free(e->key);
+    free(e->data);
+    free(e);
+}
+
+// under the mutex, takes ownership of data
+static void cache_insert(data_cache *c, const char *key, unsigned int hash, void *data, int w, int h, size_t bytes)
+{
+    cache_entry *e = c->buckets[hash % CACHE_BUCKETS];
+    for (; e; e = e->next) {
+        if (e->hash == hash && strcmp(e->key, key) == 0) break;    // loaded by another thread
+    }
+    if (e || (c->max_bytes && bytes > c->max_bytes)) {
+        free(data);
+        return;
+    }
+    while (c->max_bytes && c->bytes + bytes > c->max_bytes) cache_remove(c, c->lru.lru_prev);
+
+    e = calloc(1, sizeof(cache_entry));
+    e->key = copy_string((char *)key);
+    e->hash = hash;
+    e->data = data;
+    e->w = w;
+    e->h = h;
+    e->bytes = bytes;
+    e->next = c->buckets[hash % CACHE_BUCKETS];
+    c->buckets[hash % CACHE_BUCKETS] = e;
+    lru_push_front(c, e);
+    c->bytes += bytes;
+    ++c->count;
+}
+
+void set_image_cache(size_t max_bytes, int max_side)
+{
+    if (!max_bytes) {
+        image_cache.enabled = 0;
+        return;
+    }
+    init_cache(&image_cache, max_bytes);
+    image_cache_side = max_side;
+}
+
+void set_label_cache(int enabled)
+{
+    if (enabled) init_cache(&label_cache, 0);
+    else label_cache.enabled = 0;
+}
+
+void print_data_cache_stats()
+{
+    if (image_cache.enabled) {
+        pthread_mutex_lock(&image_cache.mutex);
+        fprintf(stderr, "Image cache: %zu images, %zu MB, %zu hits, %zu misses\n", image_cache.count,
+            image_cache.bytes / (1024 * 1024), image_cache.hits, image_cache.misses);
+        pthread_mutex_unlock(&image_cache.mutex);
+    }
+    if (label_cache.enabled) {
+        pthread_mutex_lock(&label_cache.mutex);
+        fprintf(stderr, "Label cache: %zu files, %zu hits, %zu misses\n", label_cache.count,
+            label_cache.hits, label_cache.misses);
+        pthread_mutex_unlock(&label_cache.mutex);
+    }
+}
+
+// decoded RGB pixels (interleaved), 0 - can't be loaded
+static unsigned char *decode_rgb(const char *filename, int *w, int *h)
+{
+    unsigned char *packed = load_packed_rgb(filename, w, h);
+    if (packed) return packed;
+#ifdef OPENCV
+    IplImage *src = cvLoadImage(filename, 1);
+    if (!src) return 0;
+    *w = src->width;
+    *h = src->height;
+    unsigned char *pixels = malloc((size_t)*w * *h * 3);
+    int x, y;
+    for (y = 0; y < *h; ++y) {
+        unsigned char *row = (unsigned char *)src->imageData + y*src->widthStep;
+        unsigned char *dst = pixels + (size_t)y * *w * 3;
+        for (x = 0; x < *w; ++x) {
+            dst[x*3 + 0] = row[x*3 + 2];
+            dst[x*3 + 1] = row[x*3 + 1];
+            dst[x*3 + 2] = row[x*3 + 0];
+        }
+    }
+    cvReleaseImage(&src);
+    return pixels;
+#else
+    int c;
+    return stbi_load(filename, w, h, &c, 3);
+#endif
+}
+
+static image rgb_to_image(unsigned char *pixels, int w, int h)
+{
+    image im = make_image(w, h, 3);
+    int i, k;
+    for (k = 0; k < 3; ++k) {
+        float *dst = im.data + (size_t)k*w*h;
+        for (i = 0; i < w*h; ++i) dst[i] = pixels[i*3 + k] / 255.f;
+    }
+    return im;
+}
+
+static unsigned char *downscale_rgb(unsigned char *pixels, int *w, int *h, int max_side)
+{
+    int const side = (*w > *h) ? *w : *h;
+    if (side <= max_side) return pixels;
+    int const new_w = (*w * max_side / side > 0) ? (*w * max_side / side) : 1;
+    int const new_h = (*h * max_side / side > 0) ? (*h * max_side / side) : 1;
+
+    image im = rgb_to_image(pixels, *w, *h);
+    image small = resize_image(im, new_w, new_h);
+    free_image(im);
+    pixels = realloc(pixels, (size_t)new_w*new_h*3);
+    int i, k;
+    for (k = 0; k < 3; ++k) {
+        float *src = small.data + (size_t)k*new_w*new_h;
+        for (i = 0; i < new_w*new_h; ++i) {
+            float const v = src[i] * 255 + .5f;
+            pixels[i*3 + k] = (v <= 0) ? 0 : (v >= 255) ? 255 : (unsigned char)v;
+        }
+    }
+    free_image(small);
+    *w = new_w;
+    *h = new_h;
+    return pixels;
+}
+
+// copy of the cached pixels, the image is decoded and cached on a miss
+static unsigned char *load_rgb_cached(const char *filename, int *w, int *h)
+{
+    unsigned int const hash = hash_str(filename);
+    unsigned char *pixels = 0;
+    pthread_mutex_lock(&image_cache.mutex);
+    cache_entry *e = cache_find(&image_cache, filename, hash);
+    if (e) {
+        *w = e->w;
+        *h = e->h;
+        pixels = malloc(e->bytes);
+        memcpy(pixels, e->data, e->bytes);
+    }
+    pthread_mutex_unlock(&image_cache.mutex);
+    if (pixels) return pixels;
+
+    pixels = decode_rgb(filename, w, h);
+    if (!pixels) return 0;
+    if (image_cache_side > 0) pixels = downscale_rgb(pixels, w, h, image_cache_side);
+    size_t const bytes = (size_t)*w * *h * 3;
+    unsigned char *copy = malloc(bytes);
+    memcpy(copy, pixels, bytes);
+    pthread_mutex_lock(&image_cache.mutex);
+    cache_insert(&image_cache, filename, hash, copy, *w, *h, bytes);
+    pthread_mutex_unlock(&image_cache.mutex);
+    return pixels;
+}
+
+image load_image_color_cached(char *filename)
+{
+    int w, h;
+    unsigned char *pixels = image_cache.enabled ? load_rgb_cached(filename, &w, &h) : load_packed_rgb(filename, &w, &h);
+    if (!pixels) return load_image_color(filename, 0, 0);  // reports the error
+    image im = rgb_to_image(pixels, w, h);
+    free(pixels);
+    return im;
+}
+
+#ifdef OPENCV
+IplImage *load_ipl_image_cached(const char *filename)
+{
+    int w, h;
+    unsigned char *pixels = image_cache.enabled ? load_rgb_cached(filename, &w, &h) : load_packed_rgb(filename, &w, &h);
+    if (!pixels) return image_cache.enabled ? 0 : cvLoadImage(filename, 1);
+    IplImage *dst = cvCreateImage(cvSize(w, h), IPL_DEPTH_8U, 3);
+    int x, y;
+    for (y = 0; y < h; ++y) {
+        unsigned char *row = (unsigned char *)dst->imageData + y*dst->widthStep;
+        unsigned char *src = pixels + (size_t)y*w*3;
+        for (x = 0; x < w; ++x) {
+            row[x*3 + 0] = src[x*3 + 2];
+            row[x*3 + 1] = src[x*3 + 1];
+            row[x*3 + 2] = src[x*3 + 0];
+        }
+    }
+    free(pixels);
+    return dst;
+}
+#endif
+
+box_label *read_boxes_cached(char *filename, int *n)
+{
+    box_label *boxes = read_packed_boxes(filename, n);
+    if (boxes) return boxes;
+    if (!label_cache.enabled) return read_boxes(filename, n);
+    unsigned int const hash = hash_str(filename);
+    pthread_mutex_lock(&label_cache.mutex);
+    cache_entry *e = cache_find(&label_cache, filename, hash);
+    if (e) {
+        *n = e->w;
+        boxes = calloc(e->w ? e->w : 1, sizeof(box_label));
+        memcpy(boxes, e->data, e->bytes);
+    }
+    pthread_mutex_unlock(&label_cache.mutex);
+    if (boxes) return boxes;
+
+    boxes = read_boxes(filename, n);
+    size_t const bytes = *n * sizeof(box_label);
+    box_label *copy = calloc(*n ? *n : 1, sizeof(box_label));
+    memcpy(copy, boxes, bytes);
+    pthread_mutex_lock(&label_cache.mutex);
+    cache_insert(&label_cache, filename, hash, copy, *n, 0, bytes);
+    pthread_mutex_unlock(&label_cache.mutex);
+    return boxes;
+}
@@ -0,0 +1,30 @@
+#ifndef DATA_CACHE_H
+#define DATA_CACHE_H
+
+#include <stddef.h>
+#include "image.h"
+#include "data.h"
+
+#ifdef OPENCV
+#include "opencv2/core/types_c.h"
+#endif
+
+// Caches of the training data loaders, shared by all loader threads.
+// Images: LRU cache of decoded 8-bit pixels (1/4 of the float image), max_bytes - memory limit (0 - disabled),
+// max_side - images are downscaled to this size of the longest side before they are cached (0 - full size).
+// Labels: parsed label files (read_boxes), no limit.
+void set_image_cache(size_t max_bytes, int max_side);
+void set_label_cache(int enabled);
+void print_data_cache_stats();
+
+// Same as load_image_color(filename, 0, 0) / read_boxes(), the result is a copy owned by the caller.
+// Paths of opened data packs (data_pack.h) are read from the pack.
+image load_image_color_cached(char *filename);
+box_label *read_boxes_cached(char *filename, int *n);
+
+#ifdef OPENCV
+// BGR image as cvLoadImage(filename, 1), 0 - can't be loaded
+IplImage *load_ipl_image_cached(const char *filename);
+#endif
+
+#endif
@@ -0,0 +1,442 @@
+#include "data_pack.h"
+#include "utils.h"
+#include "image.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef OPENCV
+#include "opencv2/highgui/highgui_c.h"
+#include "opencv2/core/version.hpp"
+#ifndef CV_VERSION_EPOCH
+#include "opencv2/imgcodecs/imgcodecs_c.h"
+#endif
+#else
+#include "stb_image.h"
+#endif
+
+#define PACK_MAGIC "DKPACK01"
+
+// all fields are little-endian (the byte order of the machine that packed it)
+typedef struct {
+    char magic[8];
+    uint32_t shards;
+    uint32_t reserved;
+    uint64_t records;
+    uint64_t strings_size;      // the string table follows the records
+} pack_header;
+
+typedef struct {
+    uint64_t offset;            // in the shard, 8-byte aligned
+    uint64_t image_path;        // offsets in the string table
+    uint64_t label_path;
+    uint32_t shard;
+    uint32_t size;              // image bytes, the boxes follow them (4-byte aligned)
+    int32_t w, h;               // RGB pixels w*h*3, 0 - original encoded file
+    uint32_t boxes;
+    uint32_t reserved;
+} pack_record;
+
+typedef struct {
+    int32_t id;
+    float x, y, w, h;
+} pack_box;
+
+typedef struct {
+    char *filename;
+    pack_header *header;
+    pack_record *records;
+    char *strings;
+    unsigned char **shards;
+} data_pack;
+
+// image and label paths of all opened packs -> record
+typedef struct {
+    unsigned int hash;
+    int pack;                   // 0 - empty slot, else pack index + 1
+    int record;
+    int is_label;
+} pack_slot;
+
+static data_pack *packs;
+static int packs_n;
+static pack_slot *slots;
+static size_t slots_n, slots_used;
+static pthread_mutex_t pack_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_path(const char *s)
+{
+    unsigned int hash = 2166136261u;
+    for (; *s; ++s) hash = (hash ^ (unsigned char)*s) * 16777619u;
+    return hash;
+}
+
+static void *map_file(char *filename, size_t *size)
+{
+#ifdef _WIN32
+    HANDLE f = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0);
+    if (f == INVALID_HANDLE_VALUE) file_error(filename);
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(f, &file_size);
+    *size = (size_t)file_size.QuadPart;
+    HANDLE m = CreateFileMappingA(f, 0, PAGE_READONLY, 0, 0, 0);
+    void *p = m ? MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0) : 0;
+    if (m) CloseHandle(m);
+    CloseHandle(f);
+    if (!p) file_error(filename);
+    return p;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) file_error(filename);
+    struct stat st;
+    fstat(fd, &st);
+    *size = (size_t)st.st_size;
+    void *p = mmap(0, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) file_error(filename);
+    madvise(p, *size, MADV_RANDOM);     // shuffled access, no read-ahead
+    return p;
+#endif
+}
+
+static char *slot_key(pack_slot *s)
+{
+    data_pack *p = packs + s->pack - 1;
+    pack_record *r = p->records + s->record;
+    return p->strings + (s->is_label ? r->label_path : r->image_path);
+}
+
+static void insert_slot(pack_slot s)
+{
+    size_t i = s.hash & (slots_n - 1);
+    while (slots[i].pack) {
+        if (slots[i].hash == s.hash && strcmp(slot_key(slots + i), slot_key(&s)) == 0) return;    // the first pack wins
+        i = (i + 1) & (slots_n - 1);
+    }
+    slots[i] = s;
+    ++slots_used;
+}
+
+static void grow_slots(size_t needed)
+{
+    if ((slots_used + needed) * 2 <= slots_n) return;
+    pack_slot *old = slots;
+    size_t old_n = slots_n, i;
+    while ((slots_used + needed) * 2 > slots_n) slots_n = slots_n ? slots_n * 2 : 1024;
+    slots = calloc(slots_n, sizeof(pack_slot));
+    slots_used = 0;
+    for (i = 0; i < old_n; ++i) if (old[i].pack) insert_slot(old[i]);
+    free(old);
+}
+
+// under pack_mutex
+static pack_record *find_record(const char *path, int is_label, data_pack **pack)
+{
+    if (!slots_n) return 0;
+    unsigned int const hash = hash_path(path);
+    size_t i = hash & (slots_n - 1);
+    for (; slots[i].pack; i = (i + 1) & (slots_n - 1)) {
+        if (slots[i].hash == hash && slots[i].is_label == is_label && strcmp(slot_key(slots + i), path) == 0) {
+            *pack = packs + slots[i].pack - 1;
+            return (*pack)->records + slots[i].record;
+        }
+    }
+    return 0;
+}
+
+int is_data_pack(char *filename)
+{
+    char magic[8] = { 0 };
+    FILE *file = fopen(filename, "rb");
+    if (!file) return 0;
+    size_t const read = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+    return read == sizeof(magic) && memcmp(magic, PACK_MAGIC, sizeof(magic)) == 0;
+}
+
+list *open_data_pack(char *filename)
+{
+    int i;
+    size_t k;
+    pthread_mutex_lock(&pack_mutex);
+    data_pack *p = 0;
+    for (i = 0; i < packs_n && !p; ++i) {
+        if (strcmp(packs[i].filename, filename) == 0) p = packs + i;
+    }
+    if (!p) {
+        size_t index_size;
+        unsigned char *index = map_file(filename, &index_size);
+        pack_header *header = (pack_header *)index;
+        if (index_size < sizeof(pack_header) || memcmp(header->magic, PACK_MAGIC, 8) != 0 ||
+            index_size < sizeof(pack_header) + header->records * sizeof(pack_record) + header->strings_size)
+        {
+            fprintf(stderr, "Broken data pack: %s\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        packs = realloc(packs, (packs_n + 1) * sizeof(data_pack));
+        p = packs + packs_n++;
+        p->filename = copy_string(filename);
+        p->header = header;
+        p->records = (pack_record *)(index + sizeof(pack_header));
+        p->strings = (char *)(p->records + header->records);
+        p->shards = calloc(header->shards, sizeof(unsigned char *));
+        for (k = 0; k < header->shards; ++k) {
+            char buff[4096];
+            size_t shard_size;
+            sprintf(buff, "%s.%d", filename, (int)k);
+            p->shards[k] = map_file(buff, &shard_size);
+        }
+
+        grow_slots(2 * header->records);
+        for (k = 0; k < header->records; ++k) {
+            pack_slot s;
+            s.pack = (int)(p - packs) + 1;
+            s.record = (int)k;
+            s.is_label = 0;
+            s.hash = hash_path(p->strings + p->records[k].image_path);
+            insert_slot(s);
+            s.is_label = 1;
+            s.hash = hash_path(p->strings + p->records[k].label_path);
+            insert_slot(s);
+        }
+        fprintf(stderr, "Data pack %s: %d images, %d shards\n", filename, (int)header->records, (int)header->shards);
+    }
+
+    list *paths = make_list();
+    for (k = 0; k < p->header->records; ++k) list_insert(paths, copy_string(p->strings + p->records[k].image_path));
+    pthread_mutex_unlock(&pack_mutex);
+    return paths;
+}
+
+static unsigned char *decode_rgb_memory(unsigned char *bytes, size_t size, int *w, int *h)
+{
+#ifdef OPENCV
+    CvMat buf = cvMat(1, (int)size, CV_8UC1, bytes);
+    IplImage *src = cvDecodeImage(&buf, CV_LOAD_IMAGE_COLOR);
+    if (!src) return 0;
+    *w = src->width;
+    *h = src->height;
+    unsigned char *pixels = malloc((size_t)*w * *h * 3);
+    int x, y;
+    for (y = 0; y < *h; ++y) {
+        unsigned char *row = (unsigned char *)src->imageData + y*src->widthStep;
+        unsigned char *dst = pixels + (size_t)y * *w * 3;
+        for (x = 0; x < *w; ++x) {
+            dst[x*3 + 0] = row[x*3 + 2];
+            dst[x*3 + 1] = row[x*3 + 1];
+            dst[x*3 + 2] = row[x*3 + 0];
+        }
+    }
+    cvReleaseImage(&src);
+    return pixels;
+#else
+    int c;
+    return stbi_load_from_memory(bytes, (int)size, w, h, &c, 3);
+#endif
+}
+
+unsigned char *load_packed_rgb(const char *path, int *w, int *h)
+{
+    data_pack *p;
+    pthread_mutex_lock(&pack_mutex);
+    pack_record *r = find_record(path, 0, &p);
+    unsigned char *bytes = r ? p->shards[r->shard] + r->offset : 0;
+    pthread_mutex_unlock(&pack_mutex);
+    if (!r) return 0;
+
+    if (r->w > 0) {
+        size_t const size = (size_t)r->w * r->h * 3;
+        unsigned char *pixels = malloc(size);
+        memcpy(pixels, bytes, size);
+        *w = r->w;
+        *h = r->h;
+        return pixels;
+    }
+    unsigned char *pixels = decode_rgb_memory(bytes, r->size, w, h);
+    if (!pixels) fprintf(stderr, "Cannot decode packed image \"%s\"\n", path);
+    return pixels;
+}
+
+box_label *read_packed_boxes(const char *path, int *n)
+{
+    data_pack *p;
+    pthread_mutex_lock(&pack_mutex);
+    pack_record *r = find_record(path, 1, &p);
+    pack_box *src = r ? (pack_box *)(p->shards[r->shard] + r->offset + ((r->size + 3) & ~3u)) : 0;
+    pthread_mutex_unlock(&pack_mutex);
+    if (!r) return 0;
+
+    int i;
+    box_label *boxes = calloc(r->boxes ? r->boxes : 1, sizeof(box_label));
+    for (i = 0; i < (int)r->boxes; ++i) {
+        float const x = src[i].x, y = src[i].y, w = src[i].w, h = src[i].h;
+        boxes[i].id = src[i].id;
+        boxes[i].x = x;
+        boxes[i].y = y;
+        boxes[i].w = w;
+        boxes[i].h = h;
+        boxes[i].left   = x - w/2;
+        boxes[i].right  = x + w/2;
+        boxes[i].top    = y - h/2;
+        boxes[i].bottom = y + h/2;
+    }
+    *n = r->boxes;
+    return boxes;
+}
+
+static unsigned char *read_file_bytes(char *filename, size_t *size)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file) file_error(filename);
+    fseek(file, 0, SEEK_END);
+    *size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *bytes = malloc(*size ? *size : 1);
+    if (fread(bytes, 1, *size, file) != *size) file_error(filename);
+    fclose(file);
+    return bytes;
+}
+
+static unsigned char *resized_rgb(char *filename, int raw_side, int *w, int *h)
+{
+    image im = load_image_color(filename, 0, 0);
+    int const side = (im.w > im.h) ? im.w : im.h;
+    if (side > raw_side) {
+        int const new_w = (im.w * raw_side / side > 0) ? (im.w * raw_side / side) : 1;
+        int const new_h = (im.h * raw_side / side > 0) ? (im.h * raw_side / side) : 1;
+        image resized = resize_image(im, new_w, new_h);
+        free_image(im);
+        im = resized;
+    }
+    unsigned char *pixels = malloc((size_t)im.w*im.h*3);
+    int i, k;
+    for (k = 0; k < 3; ++k) {
+        for (i = 0; i < im.w*im.h; ++i) {
+            float const v = im.data[k*im.w*im.h + i] * 255 + .5f;
+            pixels[i*3 + k] = (v <= 0) ? 0 : (v >= 255) ? 255 : (unsigned char)v;
+        }
+    }
+    *w = im.w;
+    *h = im.h;
+    free_image(im);
+    return pixels;
+}
+
+static uint64_t append_string(char **strings, uint64_t *strings_size, char *s)
+{
+    uint64_t const offset = *strings_size;
+    size_t const len = strlen(s) + 1;
+    *strings = realloc(*strings, *strings_size + len);
+    memcpy(*strings + offset, s, len);
+    *strings_size += len;
+    return offset;
+}
+
+void pack_dataset(char *list_file, char *out_file, int raw_side, int shard_mb)
+{
+    list *plist = get_paths(list_file);
+    char **paths = (char **)list_to_array(plist);
+    int const n = plist->size;
+    uint64_t const shard_bytes = (uint64_t)((shard_mb > 0) ? shard_mb : 1024) << 20;
+    pack_record *records = calloc(n ? n : 1, sizeof(pack_record));
+    char *strings = 0;
+    uint64_t strings_size = 0;
+    FILE *shard = 0;
+    uint32_t shard_i = 0;
+    uint64_t shard_pos = 0;
+    static const unsigned char zeros[8] = { 0 };
+    int i, j;
+
+    for (i = 0; i < n; ++i) {
+        char labelpath[4096];
+        replace_image_to_label(paths[i], labelpath);
+
+        size_t size;
+        int w = 0, h = 0;
+        unsigned char *bytes = (raw_side > 0) ? resized_rgb(paths[i], raw_side, &w, &h) : read_file_bytes(paths[i], &size);
+        if (raw_side > 0) size = (size_t)w*h*3;
+        if (size > 0xffffffffu) {
+            fprintf(stderr, "Image is too large: %s\n", paths[i]);
+            exit(EXIT_FAILURE);
+        }
+
+        int count = 0;
+        box_label *boxes = 0;
+        FILE *label_file = fopen(labelpath, "r");
+        if (label_file) {
+            fclose(label_file);
+            boxes = read_boxes(labelpath, &count);
+        }
+
+        uint64_t const record_size = ((size + 3) & ~(uint64_t)3) + count * sizeof(pack_box);
+        if (!shard || (shard_pos > 0 && shard_pos + record_size > shard_bytes)) {
+            char buff[4096];
+            if (shard) {
+                fclose(shard);
+                ++shard_i;
+            }
+            sprintf(buff, "%s.%d", out_file, (int)shard_i);
+            shard = fopen(buff, "wb");
+            if (!shard) file_error(buff);
+            shard_pos = 0;
+        }
+
+        pack_record *r = records + i;
+        r->offset = shard_pos;
+        r->image_path = append_string(&strings, &strings_size, paths[i]);
+        r->label_path = append_string(&strings, &strings_size, labelpath);
+        r->shard = shard_i;
+        r->size = (uint32_t)size;
+        r->w = w;
+        r->h = h;
+        r->boxes = count;
+        fwrite(bytes, 1, size, shard);
+        fwrite(zeros, 1, ((size + 3) & ~(size_t)3) - size, shard);
+        for (j = 0; j < count; ++j) {
+            pack_box b;
+            b.id = boxes[j].id;
+            b.x = boxes[j].x;
+            b.y = boxes[j].y;
+            b.w = boxes[j].w;
+            b.h = boxes[j].h;
+            fwrite(&b, sizeof(b), 1, shard);
+        }
+        shard_pos += record_size;
+        fwrite(zeros, 1, ((shard_pos + 7) & ~(uint64_t)7) - shard_pos, shard);
+        shard_pos = (shard_pos + 7) & ~(uint64_t)7;
+
+        free(bytes);
+        free(boxes);
+        if (i % 1000 == 0) fprintf(stderr, "\r%d / %d", i, n);
+    }
+    if (shard) fclose(shard);
+
+    pack_header header = { { 0 } };
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.shards = n ? shard_i + 1 : 0;
+    header.records = n;
+    header.strings_size = strings_size;
+    FILE *index = fopen(out_file, "wb");
+    if (!index) file_error(out_file);
+    fwrite(&header, sizeof(header), 1, index);
+    fwrite(records, sizeof(pack_record), n, index);
+    if (strings_size) fwrite(strings, 1, strings_size, index);
+    fclose(index);
+    fprintf(stderr, "\rPacked %d images into %s, %d shards\n", n, out_file, (int)header.shards);
+
+    free(records);
+    free(strings);
+    free_ptrs((void **)paths, n);
+    free_list(plist);
+}
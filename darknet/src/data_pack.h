@@ -0,0 +1,25 @@
+#ifndef DATA_PACK_H
+#define DATA_PACK_H
+
+#include "list.h"
+#include "data.h"
+
+// Packed dataset: an index file and shards "<index>.0", "<index>.1", ... with the records:
+// the image (original encoded file, or RGB pixels resized by the converter) followed by its boxes.
+// Opened packs are memory-mapped, images and labels are looked up by the original image / label path,
+// so a .pack file can be used everywhere instead of a text list of images (train=, valid=).
+
+// 1 - the file is a pack index
+int is_data_pack(char *filename);
+// maps the pack and returns the list of its image paths (like get_paths)
+list *open_data_pack(char *filename);
+
+// decoded RGB pixels (interleaved, malloc) of a packed image, 0 - the path isn't packed
+unsigned char *load_packed_rgb(const char *path, int *w, int *h);
+// boxes of a packed label file (copy), 0 - the path isn't packed
+box_label *read_packed_boxes(const char *path, int *n);
+
+// converter: images of the list + their label files, raw_side > 0 - store pixels resized to this longest side
+void pack_dataset(char *list_file, char *out_file, int raw_side, int shard_mb);
+
+#endif
@@ -145,6 +145,9 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
     }
     //set_batch_network(&net, 1);
 	fuse_conv_batchnorm(net);
+	alias_route_layers(&net);
+	fuse_shortcut_layers(&net);
+	fuse_upsample_layers(&net);
     srand(2222222);
 
     if(filename){
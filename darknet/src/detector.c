@@ -11,6 +11,13 @@
 #include "box.h"
 #include "demo.h"
 #include "option_list.h"
+#include "data_cache.h"
+#include "data_pack.h"
+#include "anchors.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #ifdef OPENCV
 #include "opencv2/highgui/highgui_c.h"
@@ -114,7 +121,9 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 		img = draw_train_chart(max_img_loss, net.max_batches, number_of_lines, img_size);
 #endif	//OPENCV
 
-    pthread_t load_thread = load_data(args);
+    set_label_cache(1);
+    set_image_cache((size_t)option_find_int_quiet(options, "cache_mb", 0) * 1024 * 1024, option_find_int_quiet(options, "cache_side", 0));
+    data_loader *loader = make_data_loader(args, option_find_int_quiet(options, "prefetch", 2));
     double time;
     int count = 0;
     //while(i*imgs < N*120){
@@ -128,10 +137,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             args.w = dim;
             args.h = dim;
 
-            pthread_join(load_thread, 0);
-            train = buffer;
-            free_data(train);
-            load_thread = load_data(args);
+            data_loader_set_args(loader, args);
 
             for(i = 0; i < ngpus; ++i){
                 resize_network(nets + i, dim, dim);
@@ -139,9 +145,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             net = nets[0];
         }
         time=what_time_is_it_now();
-        pthread_join(load_thread, 0);
-        train = buffer;
-        load_thread = load_data(args);
+        train = data_loader_next(loader);
 
         /*
            int k;
@@ -196,7 +200,9 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 			save_weights(net, buff);
 		}
         free_data(train);
+        if(i % 1000 == 0) print_data_cache_stats();
     }
+    free_data_loader(loader);
 #ifdef GPU
     if(ngpus != 1) sync_nets(nets, ngpus, 0);
 #endif
@@ -427,6 +433,9 @@ void validate_detector_recall(char *datacfg, char *cfgfile, char *weightfile)
 	}
 	//set_batch_network(&net, 1);
 	fuse_conv_batchnorm(net);
+	alias_route_layers(&net);
+	fuse_shortcut_layers(&net);
+	fuse_upsample_layers(&net);
 	srand(time(0));
 
 	//list *plist = get_paths("data/coco_val_5k.list");
@@ -517,27 +526,331 @@ int detections_comparator(const void *pa, const void *pb)
 	float diff = a.p - b.p;
 	if (diff < 0) return 1;
 	else if (diff > 0) return -1;
+	// equal probs - the order of the images, it doesn't depend on the threads which matched them
+	if (a.image_index != b.image_index) return a.image_index - b.image_index;
+	return a.class_id - b.class_id;
+}
+
+// mAP validation: a pool of decoder threads fills a ring of batches (images are resized straight into the
+// batch input, label files are parsed), the main thread runs one forward pass per batch for each checkpoint,
+// the detections of the batch images are matched to the truth in parallel (OpenMP) into an accumulator
+// per thread. The accumulators are merged at the end and the AP of the classes is computed in parallel.
+typedef struct {
+	float *X;				// batch of network-size images
+	int start, count;		// images [start, start + count) of the list
+	int next;				// the first image which isn't started
+	int left;				// images which aren't decoded yet
+	box_label **truth, **truth_dif;
+	int *num_truth, *num_truth_dif;
+} map_batch;
+
+typedef struct {
+	char **paths, **paths_dif;
+	int m;
+	int w, h;
+	int batch;
+	int prefetch;
+	map_batch *batches;		// ring, batches[head] is returned next
+	int head;
+	int next_image;			// the first image which isn't in a batch
+	int stop;
+	int workers_n;
+	pthread_t *workers;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+} map_loader;
+
+static void map_loader_schedule(map_loader *ml, map_batch *b)
+{
+	b->start = ml->next_image;
+	b->count = (ml->m - b->start < ml->batch) ? ml->m - b->start : ml->batch;
+	b->next = 0;
+	b->left = b->count;
+	ml->next_image += b->count;
+}
+
+static void *map_loader_worker(void *ptr)
+{
+	map_loader *ml = (map_loader *)ptr;
+	pthread_mutex_lock(&ml->mutex);
+	while (!ml->stop) {
+		map_batch *b = 0;
+		int i;
+		for (i = 0; i < ml->prefetch && !b; ++i) {
+			map_batch *c = ml->batches + (ml->head + i) % ml->prefetch;
+			if (c->next < c->count) b = c;
+		}
+		if (!b) {
+			pthread_cond_wait(&ml->work_cond, &ml->mutex);
+			continue;
+		}
+		int const k = b->next++;
+		char *path = ml->paths[b->start + k];
+		pthread_mutex_unlock(&ml->mutex);
+
+		image im = load_image_color_cached(path);
+		image sized = { ml->w, ml->h, 3, b->X + (size_t)k*ml->w*ml->h*3 };
+		resize_image_into(im, sized);
+		free_image(im);
+
+		char labelpath[4096];
+		replace_image_to_label(path, labelpath);
+		b->num_truth[k] = 0;
+		b->truth[k] = read_boxes_cached(labelpath, &b->num_truth[k]);
+
+		// difficult
+		b->num_truth_dif[k] = 0;
+		b->truth_dif[k] = 0;
+		if (ml->paths_dif) {
+			char *path_dif = ml->paths_dif[b->start + k];
+			char labelpath_dif[4096];
+			find_replace(path_dif, "images", "labels", labelpath_dif);
+			find_replace(labelpath_dif, "JPEGImages", "labels", labelpath_dif);
+			find_replace(labelpath_dif, ".jpg", ".txt", labelpath_dif);
+			find_replace(labelpath_dif, ".JPEG", ".txt", labelpath_dif);
+			find_replace(labelpath_dif, ".png", ".txt", labelpath_dif);
+			b->truth_dif[k] = read_boxes(labelpath_dif, &b->num_truth_dif[k]);
+		}
+
+		pthread_mutex_lock(&ml->mutex);
+		if (--b->left == 0) pthread_cond_broadcast(&ml->done_cond);
+	}
+	pthread_mutex_unlock(&ml->mutex);
 	return 0;
 }
 
-void validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, float thresh_calc_avg_iou)
+static map_loader *make_map_loader(char **paths, char **paths_dif, int m, int w, int h, int batch, int threads)
 {
-	int j;
+	int i;
+	map_loader *ml = calloc(1, sizeof(map_loader));
+	ml->paths = paths;
+	ml->paths_dif = paths_dif;
+	ml->m = m;
+	ml->w = w;
+	ml->h = h;
+	ml->batch = batch;
+	ml->prefetch = 3;
+	pthread_mutex_init(&ml->mutex, 0);
+	pthread_cond_init(&ml->work_cond, 0);
+	pthread_cond_init(&ml->done_cond, 0);
+	ml->batches = calloc(ml->prefetch, sizeof(map_batch));
+	for (i = 0; i < ml->prefetch; ++i) {
+		map_batch *b = ml->batches + i;
+		b->X = calloc((size_t)batch*w*h*3, sizeof(float));
+		b->truth = calloc(batch, sizeof(box_label *));
+		b->truth_dif = calloc(batch, sizeof(box_label *));
+		b->num_truth = calloc(batch, sizeof(int));
+		b->num_truth_dif = calloc(batch, sizeof(int));
+		map_loader_schedule(ml, b);
+	}
+	ml->workers_n = (threads > 0) ? threads : 1;
+	ml->workers = calloc(ml->workers_n, sizeof(pthread_t));
+	for (i = 0; i < ml->workers_n; ++i) {
+		if (pthread_create(ml->workers + i, 0, map_loader_worker, ml)) error("Thread creation failed");
+	}
+	return ml;
+}
+
+// the next decoded batch (valid until map_loader_release), 0 - all images are returned
+static map_batch *map_loader_next(map_loader *ml)
+{
+	map_batch *b = ml->batches + ml->head;
+	pthread_mutex_lock(&ml->mutex);
+	while (b->left > 0) pthread_cond_wait(&ml->done_cond, &ml->mutex);
+	pthread_mutex_unlock(&ml->mutex);
+	return b->count ? b : 0;
+}
+
+static void map_loader_release(map_loader *ml)
+{
+	map_batch *b = ml->batches + ml->head;
+	int k;
+	for (k = 0; k < b->count; ++k) {
+		free(b->truth[k]);
+		free(b->truth_dif[k]);
+	}
+	pthread_mutex_lock(&ml->mutex);
+	map_loader_schedule(ml, b);
+	ml->head = (ml->head + 1) % ml->prefetch;
+	pthread_cond_broadcast(&ml->work_cond);
+	pthread_mutex_unlock(&ml->mutex);
+}
+
+static void free_map_loader(map_loader *ml)
+{
+	int i;
+	pthread_mutex_lock(&ml->mutex);
+	ml->stop = 1;
+	pthread_cond_broadcast(&ml->work_cond);
+	pthread_mutex_unlock(&ml->mutex);
+	for (i = 0; i < ml->workers_n; ++i) pthread_join(ml->workers[i], 0);
+	for (i = 0; i < ml->prefetch; ++i) {
+		map_batch *b = ml->batches + i;
+		free(b->X);
+		free(b->truth);
+		free(b->truth_dif);
+		free(b->num_truth);
+		free(b->num_truth_dif);
+	}
+	pthread_mutex_destroy(&ml->mutex);
+	pthread_cond_destroy(&ml->work_cond);
+	pthread_cond_destroy(&ml->done_cond);
+	free(ml->batches);
+	free(ml->workers);
+	free(ml);
+}
+
+// detections of one thread and one checkpoint
+typedef struct {
+	box_prob *detections;
+	int count, size;
+	float avg_iou;
+	int tp_for_thresh, fp_for_thresh;
+} map_accumulator;
+
+// the detections of an image which are matched to its truth, truth_offset - unique index of its first truth box
+static void map_match_image(map_accumulator *acc, detection *dets, int nboxes, int classes, int image_index,
+	box_label *truth, int num_labels, int truth_offset, box_label *truth_dif, int num_labels_dif,
+	float iou_thresh, float thresh_calc_avg_iou)
+{
+	const int checkpoint_detections_count = acc->count;
+	int i, j;
+	for (i = 0; i < nboxes; ++i) {
+
+		int class_id;
+		for (class_id = 0; class_id < classes; ++class_id) {
+			float prob = dets[i].prob[class_id];
+			if (prob > 0) {
+				if (acc->count == acc->size) {
+					acc->size = acc->size ? 2 * acc->size : 1024;
+					acc->detections = realloc(acc->detections, acc->size * sizeof(box_prob));
+				}
+				box_prob *d = acc->detections + acc->count++;
+				d->b = dets[i].bbox;
+				d->p = prob;
+				d->image_index = image_index;
+				d->class_id = class_id;
+				d->truth_flag = 0;
+				d->unique_truth_index = -1;
+
+				int truth_index = -1;
+				float max_iou = 0;
+				for (j = 0; j < num_labels; ++j)
+				{
+					box t = { truth[j].x, truth[j].y, truth[j].w, truth[j].h };
+					float current_iou = box_iou(dets[i].bbox, t);
+					if (current_iou > iou_thresh && class_id == truth[j].id) {
+						if (current_iou > max_iou) {
+							max_iou = current_iou;
+							truth_index = truth_offset + j;
+						}
+					}
+				}
+
+				// best IoU
+				if (truth_index > -1) {
+					d->truth_flag = 1;
+					d->unique_truth_index = truth_index;
+				}
+				else {
+					// if object is difficult then remove detection
+					for (j = 0; j < num_labels_dif; ++j) {
+						box t = { truth_dif[j].x, truth_dif[j].y, truth_dif[j].w, truth_dif[j].h };
+						float current_iou = box_iou(dets[i].bbox, t);
+						if (current_iou > iou_thresh && class_id == truth_dif[j].id) {
+							--acc->count;
+							break;
+						}
+					}
+				}
+
+				// calc avg IoU, true-positives, false-positives for required Threshold
+				if (prob > thresh_calc_avg_iou) {
+					int z, found = 0;
+					for (z = checkpoint_detections_count; z < acc->count - 1; ++z)
+						if (acc->detections[z].unique_truth_index == truth_index) {
+							found = 1; break;
+						}
+
+					if (truth_index > -1 && found == 0) {
+						acc->avg_iou += max_iou;
+						++acc->tp_for_thresh;
+					}
+					else
+						acc->fp_for_thresh++;
+				}
+			}
+		}
+	}
+}
+
+// 11-point interpolated AP of a class, detections - of this class sorted by prob
+static double map_class_ap(box_prob *detections, int detections_count, int truth_count, int *truth_flags)
+{
+	double max_precision[11] = { 0 };
+	int tp = 0, fp = 0;
+	int rank, point;
+	for (rank = 0; rank < detections_count; ++rank) {
+		box_prob d = detections[rank];
+		// if (detected && isn't detected before)
+		if (d.truth_flag == 1) {
+			if (truth_flags[d.unique_truth_index] == 0)
+			{
+				truth_flags[d.unique_truth_index] = 1;
+				++tp;	// true-positive
+			}
+		}
+		else {
+			++fp;	// false-positive
+		}
+
+		const int fn = truth_count - tp;	// false-negative = objects - true-positive
+		const double precision = ((tp + fp) > 0) ? (double)tp / (double)(tp + fp) : 0;
+		const double recall = ((tp + fn) > 0) ? (double)tp / (double)(tp + fn) : 0;
+		for (point = 0; point < 11; ++point) {
+			if (recall >= point * 0.1 && precision > max_precision[point]) {	// > or >=
+				max_precision[point] = precision;
+			}
+		}
+	}
+	double avg_precision = 0;
+	for (point = 0; point < 11; ++point) avg_precision += max_precision[point];
+	return avg_precision / 11;
+}
+
+// batch - images of a forward pass, threads - decoder threads,
+// weightfile - several checkpoints separated by ',' are evaluated in one pass over the decoded images
+void validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, float thresh_calc_avg_iou, int batch, int threads)
+{
+	int i, j, k, n;
 	list *options = read_data_cfg(datacfg);
 	char *valid_images = option_find_str(options, "valid", "data/train.txt");
 	char *difficult_valid_images = option_find_str(options, "difficult", NULL);
 	char *name_list = option_find_str(options, "names", "data/names.list");
 	char **names = get_labels(name_list);
-	char *mapf = option_find_str(options, "map", 0);
-	int *map = 0;
-	if (mapf) map = read_map(mapf);
 
-	network net = parse_network_cfg_custom(cfgfile, 1);	// set batch=1
-	if (weightfile) {
-		load_weights(&net, weightfile);
+	if (batch < 1) batch = 1;
+	int nets_n = 1;
+	char *weights_list = weightfile ? copy_string(weightfile) : 0;
+	if (weights_list) {
+		for (i = 0; weights_list[i]; ++i) {
+			if (weights_list[i] == ',') ++nets_n;
+		}
+	}
+	char **weights = calloc(nets_n, sizeof(char *));
+	network *nets = calloc(nets_n, sizeof(network));
+	for (n = 0; n < nets_n; ++n) {
+		weights[n] = weights_list ? strtok(n ? 0 : weights_list, ",") : 0;
+		nets[n] = parse_network_cfg_custom(cfgfile, batch);	// layers for batch images
+		if (weights[n]) {
+			load_weights(&nets[n], weights[n]);
+		}
+		fuse_conv_batchnorm(nets[n]);
+		alias_route_layers(&nets[n]);
+		fuse_shortcut_layers(&nets[n]);
+		fuse_upsample_layers(&nets[n]);
 	}
-	//set_batch_network(&net, 1);
-	fuse_conv_batchnorm(net);
 	srand(time(0));
 
 	list *plist = get_paths(valid_images);
@@ -548,302 +861,148 @@ void validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, float
 		list *plist_dif = get_paths(difficult_valid_images);
 		paths_dif = (char **)list_to_array(plist_dif);
 	}
-	
 
-	layer l = net.layers[net.n - 1];
+	layer l = nets[0].layers[nets[0].n - 1];
 	int classes = l.classes;
 
 	int m = plist->size;
-	int i = 0;
-	int t;
 
 	const float thresh = .005;
 	const float nms = .45;
 	const float iou_thresh = 0.5;
 
-	int nthreads = 4;
-	image *val = calloc(nthreads, sizeof(image));
-	image *val_resized = calloc(nthreads, sizeof(image));
-	image *buf = calloc(nthreads, sizeof(image));
-	image *buf_resized = calloc(nthreads, sizeof(image));
-	pthread_t *thr = calloc(nthreads, sizeof(pthread_t));
-
-	load_args args = { 0 };
-	args.w = net.w;
-	args.h = net.h;
-	args.type = IMAGE_DATA;
-	//args.type = LETTERBOX_DATA;
-
-	//const float thresh_calc_avg_iou = 0.24;
-	float avg_iou = 0;
-	int tp_for_thresh = 0;
-	int fp_for_thresh = 0;
-
-	box_prob *detections = calloc(1, sizeof(box_prob));
-	int detections_count = 0;
+	int nthreads = 1;
+#ifdef _OPENMP
+	nthreads = omp_get_max_threads();
+#endif
+	map_accumulator *accs = calloc(nets_n*nthreads, sizeof(map_accumulator));
 	int unique_truth_count = 0;
-
 	int *truth_classes_count = calloc(classes, sizeof(int));
+	int *truth_offset = calloc(batch, sizeof(int));
 
-	for (t = 0; t < nthreads; ++t) {
-		args.path = paths[i + t];
-		args.im = &buf[t];
-		args.resized = &buf_resized[t];
-		thr[t] = load_data_in_thread(args);
-	}
+	map_loader *ml = make_map_loader(paths, paths_dif, m, nets[0].w, nets[0].h, batch, threads);
 	time_t start = time(0);
-	for (i = nthreads; i < m + nthreads; i += nthreads) {
-		fprintf(stderr, "%d\n", i);
-		for (t = 0; t < nthreads && i + t - nthreads < m; ++t) {
-			pthread_join(thr[t], 0);
-			val[t] = buf[t];
-			val_resized[t] = buf_resized[t];
-		}
-		for (t = 0; t < nthreads && i + t < m; ++t) {
-			args.path = paths[i + t];
-			args.im = &buf[t];
-			args.resized = &buf_resized[t];
-			thr[t] = load_data_in_thread(args);
-		}
-		for (t = 0; t < nthreads && i + t - nthreads < m; ++t) {
-			const int image_index = i + t - nthreads;
-			char *path = paths[image_index];
-			char *id = basecfg(path);
-			float *X = val_resized[t].data;
-			network_predict(net, X);
-
-			int nboxes = 0;
-			int letterbox = (args.type == LETTERBOX_DATA);
-			float hier_thresh = 0;
-			detection *dets = get_network_boxes(&net, 1, 1, thresh, hier_thresh, 0, 0, &nboxes, letterbox);
-			//detection *dets = get_network_boxes(&net, val[t].w, val[t].h, thresh, hier_thresh, 0, 1, &nboxes, letterbox); // for letterbox=1
-			if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
-
-			char labelpath[4096];
-			find_replace(path, "images", "labels", labelpath);
-			find_replace(labelpath, "JPEGImages", "labels", labelpath);
-			find_replace(labelpath, ".jpg", ".txt", labelpath);
-			find_replace(labelpath, ".png", ".txt", labelpath);
-			find_replace(labelpath, ".bmp", ".txt", labelpath);
-			find_replace(labelpath, ".JPG", ".txt", labelpath);
-			find_replace(labelpath, ".JPEG", ".txt", labelpath);
-			int num_labels = 0;
-			box_label *truth = read_boxes(labelpath, &num_labels);
-			int i, j;
-			for (j = 0; j < num_labels; ++j) {
-				truth_classes_count[truth[j].id]++;
+	map_batch *b;
+	while ((b = map_loader_next(ml))) {
+		fprintf(stderr, "%d\n", b->start + b->count);
+		for (k = 0; k < b->count; ++k) {
+			truth_offset[k] = unique_truth_count;
+			unique_truth_count += b->num_truth[k];
+			for (j = 0; j < b->num_truth[k]; ++j) {
+				truth_classes_count[b->truth[k][j].id]++;
 			}
-
-			// difficult
-			box_label *truth_dif = NULL;
-			int num_labels_dif = 0;
-			if (paths_dif)
-			{
-				char *path_dif = paths_dif[image_index];
-
-				char labelpath_dif[4096];
-				find_replace(path_dif, "images", "labels", labelpath_dif);
-				find_replace(labelpath_dif, "JPEGImages", "labels", labelpath_dif);
-				find_replace(labelpath_dif, ".jpg", ".txt", labelpath_dif);
-				find_replace(labelpath_dif, ".JPEG", ".txt", labelpath_dif);
-				find_replace(labelpath_dif, ".png", ".txt", labelpath_dif);				
-				truth_dif = read_boxes(labelpath_dif, &num_labels_dif);
-			}
-
-			const int checkpoint_detections_count = detections_count;
-
-			for (i = 0; i < nboxes; ++i) {
-
-				int class_id;
-				for (class_id = 0; class_id < classes; ++class_id) {
-					float prob = dets[i].prob[class_id];
-					if (prob > 0) {
-						detections_count++;
-						detections = realloc(detections, detections_count * sizeof(box_prob));
-						detections[detections_count - 1].b = dets[i].bbox;
-						detections[detections_count - 1].p = prob;
-						detections[detections_count - 1].image_index = image_index;
-						detections[detections_count - 1].class_id = class_id;
-						detections[detections_count - 1].truth_flag = 0;
-						detections[detections_count - 1].unique_truth_index = -1;
-
-						int truth_index = -1;
-						float max_iou = 0;
-						for (j = 0; j < num_labels; ++j)
-						{
-							box t = { truth[j].x, truth[j].y, truth[j].w, truth[j].h };
-							//printf(" IoU = %f, prob = %f, class_id = %d, truth[j].id = %d \n", 
-							//	box_iou(dets[i].bbox, t), prob, class_id, truth[j].id);
-							float current_iou = box_iou(dets[i].bbox, t);
-							if (current_iou > iou_thresh && class_id == truth[j].id) {
-								if (current_iou > max_iou) {
-									max_iou = current_iou;
-									truth_index = unique_truth_count + j;
-								}
-							}
-						}
-
-						// best IoU
-						if (truth_index > -1) {
-							detections[detections_count - 1].truth_flag = 1;
-							detections[detections_count - 1].unique_truth_index = truth_index;
-						}
-						else {
-							// if object is difficult then remove detection
-							for (j = 0; j < num_labels_dif; ++j) {
-								box t = { truth_dif[j].x, truth_dif[j].y, truth_dif[j].w, truth_dif[j].h };
-								float current_iou = box_iou(dets[i].bbox, t);
-								if (current_iou > iou_thresh && class_id == truth_dif[j].id) {
-									--detections_count;
-									break;
-								}
-							}
-						}
-
-						// calc avg IoU, true-positives, false-positives for required Threshold
-						if (prob > thresh_calc_avg_iou) {
-							int z, found = 0;
-							for (z = checkpoint_detections_count; z < detections_count-1; ++z)
-								if (detections[z].unique_truth_index == truth_index) {
-									found = 1; break;
-								}
-
-							if(truth_index > -1 && found == 0) {
-								avg_iou += max_iou;
-								++tp_for_thresh;
-							}
-							else
-								fp_for_thresh++;
-						}
-					}
-				}
+		}
+		for (n = 0; n < nets_n; ++n) {
+			network *net = nets + n;
+			set_batch_network(net, b->count);
+			network_predict(*net, b->X);
+
+			#pragma omp parallel for
+			for (k = 0; k < b->count; ++k) {
+				int t = 0;
+#ifdef _OPENMP
+				t = omp_get_thread_num();
+#endif
+				int nboxes = 0;
+				int letterbox = 0;
+				float hier_thresh = 0;
+				detection *dets = get_network_boxes_batch(net, k, 1, 1, thresh, hier_thresh, 0, 0, &nboxes, letterbox);
+				if (nms) do_nms_sort(dets, nboxes, classes, nms);
+				map_match_image(accs + n*nthreads + t, dets, nboxes, classes, b->start + k, b->truth[k], b->num_truth[k],
+					truth_offset[k], b->truth_dif[k], b->num_truth_dif[k], iou_thresh, thresh_calc_avg_iou);
+				free_detections(dets, nboxes);
 			}
-			
-			unique_truth_count += num_labels;
-
-			free_detections(dets, nboxes);
-			free(id);
-			free_image(val[t]);
-			free_image(val_resized[t]);
 		}
+		map_loader_release(ml);
 	}
+	free_map_loader(ml);
 
-	if((tp_for_thresh + fp_for_thresh) > 0)
-		avg_iou = avg_iou / (tp_for_thresh + fp_for_thresh);
-
-	
-	// SORT(detections)
-	qsort(detections, detections_count, sizeof(box_prob), detections_comparator);
-	
-	typedef struct {
-		double precision;
-		double recall;
-		int tp, fp, fn;
-	} pr_t;
-
-	// for PR-curve
-	pr_t **pr = calloc(classes, sizeof(pr_t*));
-	for (i = 0; i < classes; ++i) {
-		pr[i] = calloc(detections_count, sizeof(pr_t));
-	}
-	printf("detections_count = %d, unique_truth_count = %d  \n", detections_count, unique_truth_count);
-
-
+	int *class_start = calloc(classes + 1, sizeof(int));
 	int *truth_flags = calloc(unique_truth_count, sizeof(int));
-
-	int rank;
-	for (rank = 0; rank < detections_count; ++rank) {
-		if(rank % 100 == 0)
-			printf(" rank = %d of ranks = %d \r", rank, detections_count);
-
-		if (rank > 0) {
-			int class_id;
-			for (class_id = 0; class_id < classes; ++class_id) {
-				pr[class_id][rank].tp = pr[class_id][rank - 1].tp;
-				pr[class_id][rank].fp = pr[class_id][rank - 1].fp;
-			}
+	double *class_ap = calloc(classes, sizeof(double));
+	for (n = 0; n < nets_n; ++n) {
+		if (nets_n > 1) printf("\n checkpoint %s \n", weights[n]);
+
+		// merge the accumulators of the threads
+		map_accumulator *a = accs + n*nthreads;
+		int detections_count = 0;
+		int tp_for_thresh = 0;
+		int fp_for_thresh = 0;
+		float avg_iou = 0;
+		for (i = 0; i < nthreads; ++i) {
+			detections_count += a[i].count;
+			tp_for_thresh += a[i].tp_for_thresh;
+			fp_for_thresh += a[i].fp_for_thresh;
+			avg_iou += a[i].avg_iou;
 		}
-
-		box_prob d = detections[rank];
-		// if (detected && isn't detected before)
-		if (d.truth_flag == 1) {
-			if (truth_flags[d.unique_truth_index] == 0) 
-			{
-				truth_flags[d.unique_truth_index] = 1;
-				pr[d.class_id][rank].tp++;	// true-positive
-			}
+		box_prob *detections = calloc(detections_count + 1, sizeof(box_prob));
+		for (i = 0, j = 0; i < nthreads; ++i) {
+			if (a[i].count) memcpy(detections + j, a[i].detections, a[i].count * sizeof(box_prob));
+			j += a[i].count;
+			free(a[i].detections);
 		}
-		else {
-			pr[d.class_id][rank].fp++;	// false-positive
-		}
-
-		for (i = 0; i < classes; ++i) 
-		{
-			const int tp = pr[i][rank].tp;
-			const int fp = pr[i][rank].fp;
-			const int fn = truth_classes_count[i] - tp;	// false-negative = objects - true-positive
-			pr[i][rank].fn = fn;
-
-			if ((tp + fp) > 0) pr[i][rank].precision = (double)tp / (double)(tp + fp);
-			else pr[i][rank].precision = 0;
 
-			if ((tp + fn) > 0) pr[i][rank].recall = (double)tp / (double)(tp + fn);
-			else pr[i][rank].recall = 0;
+		if ((tp_for_thresh + fp_for_thresh) > 0)
+			avg_iou = avg_iou / (tp_for_thresh + fp_for_thresh);
+
+		// SORT(detections)
+		qsort(detections, detections_count, sizeof(box_prob), detections_comparator);
+		printf("detections_count = %d, unique_truth_count = %d  \n", detections_count, unique_truth_count);
+
+		// group by class keeping the order of prob (stable counting sort)
+		box_prob *class_detections = calloc(detections_count + 1, sizeof(box_prob));
+		memset(class_start, 0, (classes + 1) * sizeof(int));
+		for (i = 0; i < detections_count; ++i) class_start[detections[i].class_id + 1]++;
+		for (i = 0; i < classes; ++i) class_start[i + 1] += class_start[i];
+		int *class_next = calloc(classes, sizeof(int));
+		memcpy(class_next, class_start, classes * sizeof(int));
+		for (i = 0; i < detections_count; ++i) class_detections[class_next[detections[i].class_id]++] = detections[i];
+		free(class_next);
+		free(detections);
+
+		// truth boxes belong to one class - the classes don't share truth_flags entries
+		memset(truth_flags, 0, unique_truth_count * sizeof(int));
+		#pragma omp parallel for schedule(dynamic)
+		for (i = 0; i < classes; ++i) {
+			class_ap[i] = map_class_ap(class_detections + class_start[i], class_start[i + 1] - class_start[i],
+				truth_classes_count[i], truth_flags);
 		}
-	}
-
-	free(truth_flags);
-	
-	
-	double mean_average_precision = 0;
+		free(class_detections);
 
-	for (i = 0; i < classes; ++i) {
-		double avg_precision = 0;
-		int point;
-		for (point = 0; point < 11; ++point) {
-			double cur_recall = point * 0.1;
-			double cur_precision = 0;
-			for (rank = 0; rank < detections_count; ++rank)
-			{
-				if (pr[i][rank].recall >= cur_recall) {	// > or >=
-					if (pr[i][rank].precision > cur_precision) {
-						cur_precision = pr[i][rank].precision;
-					}
-				}
-			}
-			//printf("class_id = %d, point = %d, cur_recall = %.4f, cur_precision = %.4f \n", i, point, cur_recall, cur_precision);
-
-			avg_precision += cur_precision;
+		double mean_average_precision = 0;
+		for (i = 0; i < classes; ++i) {
+			printf("class_id = %d, name = %s, \t ap = %2.2f %% \n", i, names[i], class_ap[i] * 100);
+			mean_average_precision += class_ap[i];
 		}
-		avg_precision = avg_precision / 11;
-		printf("class_id = %d, name = %s, \t ap = %2.2f %% \n", i, names[i], avg_precision*100);
-		mean_average_precision += avg_precision;
-	}
-	
-	const float cur_precision = (float)tp_for_thresh / ((float)tp_for_thresh + (float)fp_for_thresh);
-	const float cur_recall = (float)tp_for_thresh / ((float)tp_for_thresh + (float)(unique_truth_count - tp_for_thresh));
-	const float f1_score = 2.F * cur_precision * cur_recall / (cur_precision + cur_recall);
-	printf(" for thresh = %1.2f, precision = %1.2f, recall = %1.2f, F1-score = %1.2f \n",
-		thresh_calc_avg_iou, cur_precision, cur_recall, f1_score);
 
-	printf(" for thresh = %0.2f, TP = %d, FP = %d, FN = %d, average IoU = %2.2f %% \n", 
-		thresh_calc_avg_iou, tp_for_thresh, fp_for_thresh, unique_truth_count - tp_for_thresh, avg_iou * 100);
+		const float cur_precision = (float)tp_for_thresh / ((float)tp_for_thresh + (float)fp_for_thresh);
+		const float cur_recall = (float)tp_for_thresh / ((float)tp_for_thresh + (float)(unique_truth_count - tp_for_thresh));
+		const float f1_score = 2.F * cur_precision * cur_recall / (cur_precision + cur_recall);
+		printf(" for thresh = %1.2f, precision = %1.2f, recall = %1.2f, F1-score = %1.2f \n",
+			thresh_calc_avg_iou, cur_precision, cur_recall, f1_score);
 
-	mean_average_precision = mean_average_precision / classes;
-	printf("\n mean average precision (mAP) = %f, or %2.2f %% \n", mean_average_precision, mean_average_precision*100);
+		printf(" for thresh = %0.2f, TP = %d, FP = %d, FN = %d, average IoU = %2.2f %% \n",
+			thresh_calc_avg_iou, tp_for_thresh, fp_for_thresh, unique_truth_count - tp_for_thresh, avg_iou * 100);
 
+		mean_average_precision = mean_average_precision / classes;
+		printf("\n mean average precision (mAP) = %f, or %2.2f %% \n", mean_average_precision, mean_average_precision*100);
 
-	for (i = 0; i < classes; ++i) {
-		free(pr[i]);
+		free_network(nets[n]);
 	}
-	free(pr);
-	free(detections);
+
+	free(class_ap);
+	free(truth_flags);
+	free(class_start);
+	free(truth_offset);
 	free(truth_classes_count);
+	free(accs);
+	free(nets);
+	free(weights);
+	free(weights_list);
 
 	fprintf(stderr, "Total Detection Time: %f Seconds\n", (double)(time(0) - start));
 }
 
-#ifdef OPENCV
 typedef struct {
 	float w, h;
 } anchors_t;
@@ -858,7 +1017,9 @@ int anchors_comparator(const void *pa, const void *pb)
 	return 0;
 }
 
-void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int show)
+// k-means++ with the distance 1 - IoU (anchors.h), avg IoU is reported for each k in [min_clusters, num_of_clusters],
+// mini_batch > 0 - mini-batch k-means with mini_batch random boxes per iteration (for huge datasets)
+void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int show, int min_clusters, int mini_batch)
 {
 	printf("\n num_of_clusters = %d, width = %d, height = %d \n", num_of_clusters, width, height);
 	if (width < 0 || height < 0) {
@@ -866,9 +1027,7 @@ void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int
 		printf("Error: set width and height \n");
 		return;
 	}
-
-	//float pointsdata[] = { 1,1, 2,2, 6,6, 5,5, 10,10 };
-	float *rel_width_height_array = calloc(1000, sizeof(float));
+	if (min_clusters < 1 || min_clusters > num_of_clusters) min_clusters = num_of_clusters;
 
 	list *options = read_data_cfg(datacfg);
 	char *train_images = option_find_str(options, "train", "data/train.list");
@@ -876,113 +1035,41 @@ void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int
 	int number_of_images = plist->size;
 	char **paths = (char **)list_to_array(plist);
 
-	int number_of_boxes = 0;
 	printf(" read labels from %d images \n", number_of_images);
-
-	int i, j;
-	for (i = 0; i < number_of_images; ++i) {
-		char *path = paths[i];
-		char labelpath[4096];
-		find_replace(path, "images", "labels", labelpath);
-		find_replace(labelpath, "JPEGImages", "labels", labelpath);
-		find_replace(labelpath, ".jpg", ".txt", labelpath);
-		find_replace(labelpath, ".png", ".txt", labelpath);
-		find_replace(labelpath, ".bmp", ".txt", labelpath);
-		find_replace(labelpath, ".JPG", ".txt", labelpath);
-		find_replace(labelpath, ".JPEG", ".txt", labelpath);
-		int num_labels = 0;
-		box_label *truth = read_boxes(labelpath, &num_labels);
-		//printf(" new path: %s \n", labelpath);
-		for (j = 0; j < num_labels; ++j)
-		{
-			number_of_boxes++;
-			rel_width_height_array = realloc(rel_width_height_array, 2 * number_of_boxes * sizeof(float));
-			rel_width_height_array[number_of_boxes * 2 - 2] = truth[j].w * width;
-			rel_width_height_array[number_of_boxes * 2 - 1] = truth[j].h * height;
-			printf("\r loaded \t image: %d \t box: %d", i+1, number_of_boxes);
-		}
-	}
-	printf("\n all loaded. \n");
-
-	CvMat* points = cvCreateMat(number_of_boxes, 2, CV_32FC1);
-	CvMat* centers = cvCreateMat(num_of_clusters, 2, CV_32FC1);
-	CvMat* labels = cvCreateMat(number_of_boxes, 1, CV_32SC1);
-
-	for (i = 0; i < number_of_boxes; ++i) {
-		points->data.fl[i * 2] = rel_width_height_array[i * 2];
-		points->data.fl[i * 2 + 1] = rel_width_height_array[i * 2 + 1];
-		//cvSet1D(points, i * 2, cvScalar(rel_width_height_array[i * 2], 0, 0, 0));
-		//cvSet1D(points, i * 2 + 1, cvScalar(rel_width_height_array[i * 2 + 1], 0, 0, 0));
+	box_sizes boxes = load_box_sizes(paths, number_of_images, width, height);
+	int number_of_boxes = boxes.n;
+	printf(" all loaded: %d boxes \n", number_of_boxes);
+	if (number_of_boxes == 0) {
+		free(paths);
+		return;
 	}
 
-
-	const int attemps = 10;
-	double compactness;
-
-	enum {
-		KMEANS_RANDOM_CENTERS = 0,
-		KMEANS_USE_INITIAL_LABELS = 1,
-		KMEANS_PP_CENTERS = 2
-	};
-	
-	printf("\n calculating k-means++ ...");
-	// Should be used: distance(box, centroid) = 1 - IoU(box, centroid)
-	cvKMeans2(points, num_of_clusters, labels, 
-		cvTermCriteria(CV_TERMCRIT_EPS+CV_TERMCRIT_ITER, 10000, 0), attemps, 
-		0, KMEANS_PP_CENTERS,
-		centers, &compactness);
-
-	// sort anchors
-	qsort(centers->data.fl, num_of_clusters, 2*sizeof(float), anchors_comparator);
-
-	//orig 2.0 anchors = 1.08,1.19,  3.42,4.41,  6.63,11.38,  9.42,5.11,  16.62,10.52
-	//float orig_anch[] = { 1.08,1.19,  3.42,4.41,  6.63,11.38,  9.42,5.11,  16.62,10.52 };
-	// worse than ours (even for 19x19 final size - for input size 608x608)
-
-	//orig anchors = 1.3221,1.73145, 3.19275,4.00944, 5.05587,8.09892, 9.47112,4.84053, 11.2364,10.0071
-	//float orig_anch[] = { 1.3221,1.73145, 3.19275,4.00944, 5.05587,8.09892, 9.47112,4.84053, 11.2364,10.0071 };
-	// orig (IoU=59.90%) better than ours (59.75%)
-
-	//gen_anchors.py = 1.19, 1.99, 2.79, 4.60, 4.53, 8.92, 8.06, 5.29, 10.32, 10.66
-	//float orig_anch[] = { 1.19, 1.99, 2.79, 4.60, 4.53, 8.92, 8.06, 5.29, 10.32, 10.66 };
-
-	// ours: anchors = 9.3813,6.0095, 3.3999,5.3505, 10.9476,11.1992, 5.0161,9.8314, 1.5003,2.1595
-	//float orig_anch[] = { 9.3813,6.0095, 3.3999,5.3505, 10.9476,11.1992, 5.0161,9.8314, 1.5003,2.1595 };
-	//for (i = 0; i < num_of_clusters * 2; ++i) centers->data.fl[i] = orig_anch[i];
-	
-	//for (i = 0; i < number_of_boxes; ++i)
-	//	printf("%2.2f,%2.2f, ", points->data.fl[i * 2], points->data.fl[i * 2 + 1]);
-
+	const int attemps = (mini_batch > 0) ? 1 : 3;
+	const int max_iterations = (mini_batch > 0) ? 1000 : 10000;
+	float *centers = calloc(num_of_clusters * 2, sizeof(float));
+	float *best_centers = calloc(num_of_clusters * 2, sizeof(float));
+	int *labels = show ? calloc(number_of_boxes, sizeof(int)) : 0;
+	int *best_labels = show ? calloc(number_of_boxes, sizeof(int)) : 0;
 	float avg_iou = 0;
-	for (i = 0; i < number_of_boxes; ++i) {
-		float box_w = points->data.fl[i * 2];
-		float box_h = points->data.fl[i * 2 + 1];
-		//int cluster_idx = labels->data.i[i];		
-		int cluster_idx = 0;
-		float min_dist = FLT_MAX;
-		for (j = 0; j < num_of_clusters; ++j) {
-			float anchor_w = centers->data.fl[j * 2];
-			float anchor_h = centers->data.fl[j * 2 + 1];
-			float w_diff = anchor_w - box_w;
-			float h_diff = anchor_h - box_h;
-			float distance = sqrt(w_diff*w_diff + h_diff*h_diff);
-			if (distance < min_dist) min_dist = distance, cluster_idx = j;
-		}
-		
-		float anchor_w = centers->data.fl[cluster_idx * 2];
-		float anchor_h = centers->data.fl[cluster_idx * 2 + 1];
-		float min_w = (box_w < anchor_w) ? box_w : anchor_w;
-		float min_h = (box_h < anchor_h) ? box_h : anchor_h;
-		float box_intersect = min_w*min_h;
-		float box_union = box_w*box_h + anchor_w*anchor_h - box_intersect;
-		float iou = box_intersect / box_union;
-		if (iou > 1 || iou < 0) {
-			printf(" i = %d, box_w = %d, box_h = %d, anchor_w = %d, anchor_h = %d, iou = %f \n",
-				i, box_w, box_h, anchor_w, anchor_h, iou);
+	int i, k;
+
+	printf("\n calculating k-means++ ...\n");
+	for (k = min_clusters; k <= num_of_clusters; ++k) {
+		float best_iou = -1;
+		for (i = 0; i < attemps; ++i) {
+			float iou = kmeans_anchors(boxes, k, max_iterations, mini_batch, i + 1, centers, labels);
+			if (iou > best_iou) {
+				best_iou = iou;
+				memcpy(best_centers, centers, k * 2 * sizeof(float));
+				if (labels) memcpy(best_labels, labels, number_of_boxes * sizeof(int));
+			}
 		}
-		else avg_iou += iou;
+		printf(" k = %d, avg IoU = %2.2f %% \n", k, best_iou * 100);
+		avg_iou = best_iou * 100;
 	}
-	avg_iou = 100 * avg_iou / number_of_boxes;
+
+	// sort anchors
+	qsort(best_centers, num_of_clusters, 2*sizeof(float), anchors_comparator);
 	printf("\n avg IoU = %2.2f %% \n", avg_iou);
 
 	char buff[1024];
@@ -990,7 +1077,7 @@ void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int
 	printf("\nSaving anchors to the file: anchors.txt \n");
 	printf("anchors = ");
 	for (i = 0; i < num_of_clusters; ++i) {
-		sprintf(buff, "%2.4f,%2.4f", centers->data.fl[i * 2], centers->data.fl[i * 2 + 1]);
+		sprintf(buff, "%2.4f,%2.4f", best_centers[i * 2], best_centers[i * 2 + 1]);
 		printf("%s", buff);
 		fwrite(buff, sizeof(char), strlen(buff), fw);
 		if (i + 1 < num_of_clusters) {
@@ -1001,23 +1088,25 @@ void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int
 	printf("\n");
 	fclose(fw);
 
+#ifdef OPENCV
 	if (show) {
+		int j;
 		size_t img_size = 700;
 		IplImage* img = cvCreateImage(cvSize(img_size, img_size), 8, 3);
 		cvZero(img);
 		for (j = 0; j < num_of_clusters; ++j) {
 			CvPoint pt1, pt2;
 			pt1.x = pt1.y = 0;
-			pt2.x = centers->data.fl[j * 2] * img_size / width;
-			pt2.y = centers->data.fl[j * 2 + 1] * img_size / height;
+			pt2.x = best_centers[j * 2] * img_size / width;
+			pt2.y = best_centers[j * 2 + 1] * img_size / height;
 			cvRectangle(img, pt1, pt2, CV_RGB(255, 255, 255), 1, 8, 0);
 		}
 
 		for (i = 0; i < number_of_boxes; ++i) {
 			CvPoint pt;
-			pt.x = points->data.fl[i * 2] * img_size / width;
-			pt.y = points->data.fl[i * 2 + 1] * img_size / height;
-			int cluster_idx = labels->data.i[i];
+			pt.x = boxes.w[i] * img_size / width;
+			pt.y = boxes.h[i] * img_size / height;
+			int cluster_idx = best_labels[i];
 			int red_id = (cluster_idx * (uint64_t)123 + 55) % 255;
 			int green_id = (cluster_idx * (uint64_t)321 + 33) % 255;
 			int blue_id = (cluster_idx * (uint64_t)11 + 99) % 255;
@@ -1029,17 +1118,15 @@ void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int
 		cvReleaseImage(&img);
 		cvDestroyAllWindows();
 	}
+#endif // OPENCV
 
-	free(rel_width_height_array);
-	cvReleaseMat(&points);
-	cvReleaseMat(&centers);
-	cvReleaseMat(&labels);
+	free(labels);
+	free(best_labels);
+	free(centers);
+	free(best_centers);
+	free_box_sizes(boxes);
+	free(paths);
 }
-#else
-void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int show) {
-	printf(" k-means++ can't be used without OpenCV, because there is used cvKMeans2 implementation \n");
-}
-#endif // OPENCV
 
 void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, int dont_show)
 {
@@ -1054,6 +1141,9 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     }
     //set_batch_network(&net, 1);
 	fuse_conv_batchnorm(net);
+	alias_route_layers(&net);
+	fuse_shortcut_layers(&net);
+	fuse_upsample_layers(&net);
     srand(2222222);
     double time;
     char buff[256];
@@ -1143,8 +1233,14 @@ void run_detector(int argc, char **argv)
     int cam_index = find_int_arg(argc, argv, "-c", 0);
     int frame_skip = find_int_arg(argc, argv, "-s", 0);
 	int num_of_clusters = find_int_arg(argc, argv, "-num_of_clusters", 5);
+	int min_clusters = find_int_arg(argc, argv, "-min_clusters", 0);	// calc_anchors: avg IoU for each k from it
+	int mini_batch = find_int_arg(argc, argv, "-mini_batch", 0);	// calc_anchors: mini-batch k-means
 	int width = find_int_arg(argc, argv, "-width", -1);
 	int height = find_int_arg(argc, argv, "-height", -1);
+	int raw_side = find_int_arg(argc, argv, "-raw_side", 0);
+	int shard_mb = find_int_arg(argc, argv, "-shard_mb", 1024);
+	int map_batch_size = find_int_arg(argc, argv, "-batch", 4);	// map: images of a forward pass
+	int map_threads = find_int_arg(argc, argv, "-threads", 4);	// map: decoder threads
     if(argc < 4){
         fprintf(stderr, "usage: %s %s [train/test/valid] [cfg] [weights (optional)]\n", argv[0], argv[1]);
         return;
@@ -1185,8 +1281,9 @@ void run_detector(int argc, char **argv)
     else if(0==strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear, dont_show);
     else if(0==strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "recall")) validate_detector_recall(datacfg, cfg, weights);
-	else if(0==strcmp(argv[2], "map")) validate_detector_map(datacfg, cfg, weights, thresh);
-	else if(0==strcmp(argv[2], "calc_anchors")) calc_anchors(datacfg, num_of_clusters, width, height, show);
+	else if(0==strcmp(argv[2], "map")) validate_detector_map(datacfg, cfg, weights, thresh, map_batch_size, map_threads);
+	else if(0==strcmp(argv[2], "calc_anchors")) calc_anchors(datacfg, num_of_clusters, width, height, show, min_clusters, mini_batch);
+	else if(0==strcmp(argv[2], "pack")) pack_dataset(datacfg, cfg, raw_side, shard_mb);	// list, output
     else if(0==strcmp(argv[2], "demo")) {
         list *options = read_data_cfg(datacfg);
         int classes = option_find_int(options, "classes", 20);
@@ -4,6 +4,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#if defined(__F16C__) || (defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__))
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER) && defined(_WIN64)
+#include <intrin.h>
+#endif
 
 void gemm_bin(int M, int N, int K, float ALPHA, 
         char  *A, int lda, 
@@ -294,6 +300,148 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
 	}
 }
 
+static inline int popcnt64(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+	return (int)__popcnt64(x);
+#elif defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	int count = 0;
+	for (; x; x &= x - 1) ++count;
+	return count;
+#endif
+}
+
+// popcount((a ^ b) & mask) over n words
+static inline int popcnt_xor_mask(uint64_t *a, uint64_t *b, uint64_t *mask, int n)
+{
+	int i = 0, count = 0;
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+	__m512i sum512 = _mm512_setzero_si512();
+	for (; i + 8 <= n; i += 8) {
+		__m512i x512 = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+		x512 = _mm512_and_si512(x512, _mm512_loadu_si512(mask + i));
+		sum512 = _mm512_add_epi64(sum512, _mm512_popcnt_epi64(x512));
+	}
+	count = (int)_mm512_reduce_add_epi64(sum512);
+#endif
+	for (; i < n; ++i) count += popcnt64((a[i] ^ b[i]) & mask[i]);
+	return count;
+}
+
+// xnor inference: A - sign bits of M filters, B - sign bits of N columns (im2col_cpu_bits), K_words per row.
+// C[i*ldc + j] = scales[i] * sum_k(sign(A_ik) * sign(B_kj)) over the taps of the mask:
+// matching bits give +1, different bits give -1.
+void gemm_xnor_bits(int M, int N, int K_words,
+	uint64_t *A, uint64_t *B, uint64_t *B_mask,
+	float *scales, float *C, int ldc)
+{
+	int j;
+	#pragma omp parallel for
+	for (j = 0; j < N; ++j) {
+		uint64_t *b = B + (size_t)j*K_words;
+		uint64_t *mask = B_mask + (size_t)j*K_words;
+		int i, k, valid = 0;
+		for (k = 0; k < K_words; ++k) valid += popcnt64(mask[k]);
+		for (i = 0; i < M; ++i) {
+			int diff = popcnt_xor_mask(A + (size_t)i*K_words, b, mask, K_words);
+			C[i*ldc + j] = scales[i] * (valid - 2*diff);
+		}
+	}
+}
+
+// IEEE half precision, round to nearest even
+unsigned short float_to_half(float f)
+{
+	union { float f; unsigned int u; } v;
+	v.f = f;
+	unsigned int sign = (v.u >> 16) & 0x8000;
+	unsigned int e = (v.u >> 23) & 0xff;
+	unsigned int m = v.u & 0x7fffff;
+	if (e == 0xff) return sign | 0x7c00 | (m ? 0x200 : 0);	// inf, nan
+	int he = (int)e - 127 + 15;
+	if (he >= 0x1f) return sign | 0x7c00;					// overflow
+	if (he <= 0) {											// denormal
+		if (he < -10) return sign;
+		m |= 0x800000;
+		int shift = 14 - he;
+		unsigned int hm = m >> shift;
+		unsigned int rem = m & ((1u << shift) - 1), half = 1u << (shift - 1);
+		if (rem > half || (rem == half && (hm & 1))) ++hm;
+		return sign | hm;
+	}
+	unsigned int h = sign | (he << 10) | (m >> 13);
+	unsigned int rem = m & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;	// a carry goes into the exponent
+	return h;
+}
+
+float half_to_float(unsigned short h)
+{
+	union { float f; unsigned int u; } v;
+	unsigned int sign = (h & 0x8000) << 16;
+	unsigned int e = (h >> 10) & 0x1f;
+	unsigned int m = h & 0x3ff;
+	if (e == 0x1f) v.u = sign | 0x7f800000 | (m << 13);
+	else if (e == 0) {
+		v.f = m * (1.0f / 16777216);	// denormal: m * 2^-24
+		v.u |= sign;
+	}
+	else v.u = sign | ((e + 112) << 23) | (m << 13);
+	return v.f;
+}
+
+void float_to_half_array(float *src, unsigned short *dst, size_t n)
+{
+	size_t i = 0;
+#ifdef __F16C__
+	for (; i + 8 <= n; i += 8) {
+		_mm_storeu_si128((__m128i *)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), 0));
+	}
+#endif
+	for (; i < n; ++i) dst[i] = float_to_half(src[i]);
+}
+
+void half_to_float_array(unsigned short *src, float *dst, size_t n)
+{
+	size_t i = 0;
+#ifdef __F16C__
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((__m128i *)(src + i))));
+	}
+#endif
+	for (; i < n; ++i) dst[i] = half_to_float(src[i]);
+}
+
+// C = ALPHA * A * B + BETA * C, A - fp16 (weights), not transposed.
+// Each row of A is widened to fp32 by chunks which stay in L1, then gemm_nn() runs on them.
+void gemm_half(int M, int N, int K, float ALPHA,
+	unsigned short *A, int lda,
+	float *B, int ldb,
+	float BETA,
+	float *C, int ldc)
+{
+	int i, j;
+	for (i = 0; i < M; ++i) {
+		for (j = 0; j < N; ++j) {
+			C[i*ldc + j] *= BETA;
+		}
+	}
+
+	int t;
+	#pragma omp parallel for
+	for (t = 0; t < M; ++t) {
+		float a_row[512];
+		int k;
+		for (k = 0; k < K; k += 512) {
+			int size = (K - k < 512) ? (K - k) : 512;
+			half_to_float_array(A + t*lda + k, a_row, size);
+			gemm_nn(1, N, size, ALPHA, a_row, size, B + k*ldb, ldb, C + t*ldc, ldc);
+		}
+	}
+}
+
 #ifdef GPU
 
 #include <math.h>
@@ -1,5 +1,7 @@
 #ifndef GEMM_H
 #define GEMM_H
+#include <stddef.h>
+#include <stdint.h>
 
 void gemm_bin(int M, int N, int K, float ALPHA, 
         char  *A, int lda, 
@@ -18,6 +20,20 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
         float BETA,
         float *C, int ldc);
 
+void gemm_xnor_bits(int M, int N, int K_words,
+        uint64_t *A, uint64_t *B, uint64_t *B_mask,
+        float *scales, float *C, int ldc);
+
+unsigned short float_to_half(float f);
+float half_to_float(unsigned short h);
+void float_to_half_array(float *src, unsigned short *dst, size_t n);
+void half_to_float_array(unsigned short *src, float *dst, size_t n);
+void gemm_half(int M, int N, int K, float ALPHA,
+        unsigned short *A, int lda,
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc);
+
 #ifdef GPU
 void gemm_ongpu(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A_gpu, int lda, 
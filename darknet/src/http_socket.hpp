@@ -0,0 +1,149 @@
+#ifndef HTTP_SOCKET_HPP
+#define HTTP_SOCKET_HPP
+
+// Non-blocking socket layer of the HTTP servers (http_stream.cpp, wrapper/detect_server.hpp).
+//  on win, _WIN32 has to be defined, must link against ws2_32.lib (socks on linux are for free)
+
+//
+// socket related abstractions:
+//
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#include <winsock.h>
+#include <windows.h>
+#include <time.h>
+#define PORT        unsigned long
+#define ADDRPOINTER   int*
+#define MSG_NOSIGNAL 0
+struct _INIT_W32DATA
+{
+	WSADATA w;
+	_INIT_W32DATA() { WSAStartup(MAKEWORD(2, 1), &w); }
+};
+static _INIT_W32DATA _init_once;
+static inline void set_nonblocking(SOCKET s) { u_long on = 1; ioctlsocket(s, FIONBIO, &on); }
+static inline bool would_block() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+static inline void close_socket(SOCKET s) { ::closesocket(s); }
+#else       /* ! win32 */
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#define PORT        unsigned short
+#define SOCKET    int
+#define HOSTENT  struct hostent
+#define SOCKADDR    struct sockaddr
+#define SOCKADDR_IN  struct sockaddr_in
+#define ADDRPOINTER  unsigned int*
+#define INVALID_SOCKET -1
+#define SOCKET_ERROR   -1
+static inline void set_nonblocking(SOCKET s) { fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK); }
+static inline bool would_block() { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR; }
+static inline void close_socket(SOCKET s) { ::close(s); }
+#endif /* _WIN32 */
+
+#include <cstring>
+#include <map>
+#include <vector>
+#include <iostream>
+
+// non-blocking listening socket on all interfaces or on loopback only, INVALID_SOCKET on error
+static inline SOCKET open_listen_socket(int port, bool loopback_only)
+{
+	SOCKET sock = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock == INVALID_SOCKET) return sock;
+	int reuse = 1;
+	::setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char const*)&reuse, sizeof(reuse));
+
+	SOCKADDR_IN address;
+	memset(&address, 0, sizeof(address));
+	address.sin_addr.s_addr = htonl(loopback_only ? INADDR_LOOPBACK : INADDR_ANY);
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);	// ::htons(port);
+	if (::bind(sock, (SOCKADDR*)&address, sizeof(SOCKADDR_IN)) == SOCKET_ERROR)
+	{
+		std::cerr << "error : couldn't bind sock " << sock << " to port " << port << "!" << std::endl;
+		close_socket(sock);
+		return INVALID_SOCKET;
+	}
+	if (::listen(sock, 64) == SOCKET_ERROR)
+	{
+		std::cerr << "error : couldn't listen on sock " << sock << " on port " << port << " !" << std::endl;
+		close_socket(sock);
+		return INVALID_SOCKET;
+	}
+	set_nonblocking(sock);
+	return sock;
+}
+
+// readiness of the server sockets: epoll on Linux, select elsewhere
+class socket_poller_t
+{
+#ifdef __linux__
+	int epfd;
+#else
+	std::map<SOCKET, bool> socks;	// socket -> wants write
+#endif
+public:
+	struct event_t { SOCKET sock; bool readable, writable; };
+
+#ifdef __linux__
+	socket_poller_t() : epfd(::epoll_create1(0)) {}
+	~socket_poller_t() { ::close(epfd); }
+	void add(SOCKET s, bool want_write) { ctl(EPOLL_CTL_ADD, s, want_write); }
+	void modify(SOCKET s, bool want_write) { ctl(EPOLL_CTL_MOD, s, want_write); }
+	void remove(SOCKET s) { struct epoll_event ev = {}; ::epoll_ctl(epfd, EPOLL_CTL_DEL, s, &ev); }
+	void wait(std::vector<event_t> &events, int timeout_ms)
+	{
+		struct epoll_event ev[64];
+		int const n = ::epoll_wait(epfd, ev, 64, timeout_ms);
+		events.clear();
+		for (int i = 0; i < n; ++i) {
+			event_t e = { ev[i].data.fd, (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0, (ev[i].events & EPOLLOUT) != 0 };
+			events.push_back(e);
+		}
+	}
+private:
+	void ctl(int op, SOCKET s, bool want_write)
+	{
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+		ev.data.fd = s;
+		::epoll_ctl(epfd, op, s, &ev);
+	}
+#else
+	void add(SOCKET s, bool want_write) { socks[s] = want_write; }
+	void modify(SOCKET s, bool want_write) { socks[s] = want_write; }
+	void remove(SOCKET s) { socks.erase(s); }
+	void wait(std::vector<event_t> &events, int timeout_ms)
+	{
+		fd_set rset, wset;
+		FD_ZERO(&rset);
+		FD_ZERO(&wset);
+		SOCKET maxfd = 0;
+		for (auto &i : socks) {
+			FD_SET(i.first, &rset);
+			if (i.second) FD_SET(i.first, &wset);
+			maxfd = (maxfd > i.first) ? maxfd : i.first;
+		}
+		struct timeval to = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+		events.clear();
+		if (::select((int)maxfd + 1, &rset, &wset, NULL, &to) <= 0) return;
+		for (auto &i : socks) {
+			event_t e = { i.first, FD_ISSET(i.first, &rset) != 0, FD_ISSET(i.first, &wset) != 0 };
+			if (e.readable || e.writable) events.push_back(e);
+		}
+	}
+#endif
+};
+
+#endif // HTTP_SOCKET_HPP
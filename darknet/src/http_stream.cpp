@@ -1,203 +1,349 @@
-#ifdef OPENCV
 //
-// a single-threaded, multi client(using select), debug webserver - streaming out mjpg.
-//  on win, _WIN32 has to be defined, must link against ws2_32.lib (socks on linux are for free)
+// MJPEG streaming server: one thread per port serves any number of clients over non-blocking sockets
+// (epoll on Linux, select elsewhere). A frame is encoded once into a ref-counted buffer which is shared
+// by all clients of its stream, a client which is slower than the stream skips frames instead of
+// stalling the detection thread.
 //
 
-//
-// socket related abstractions:
-//
-#ifdef _WIN32  
-#pragma comment(lib, "ws2_32.lib")
-#include <winsock.h>
-#include <windows.h>
-#include <time.h>
-#define PORT        unsigned long
-#define ADDRPOINTER   int*
-struct _INIT_W32DATA
-{
-	WSADATA w;
-	_INIT_W32DATA() { WSAStartup(MAKEWORD(2, 1), &w); }
-} _init_once;
-#else       /* ! win32 */
-#include <unistd.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#define PORT        unsigned short
-#define SOCKET    int
-#define HOSTENT  struct hostent
-#define SOCKADDR    struct sockaddr
-#define SOCKADDR_IN  struct sockaddr_in
-#define ADDRPOINTER  unsigned int*
-#define INVALID_SOCKET -1
-#define SOCKET_ERROR   -1
-#endif /* _WIN32 */
+#include "http_socket.hpp"
 
 #include <cstdio>
+#include <cstring>
 #include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
 #include <iostream>
 using std::cerr;
 using std::endl;
 
-#include "opencv2/opencv.hpp"
-#include "opencv2/highgui.hpp"
-#include "opencv2/highgui/highgui_c.h"
-#include "opencv2/imgproc/imgproc_c.h"
-#ifndef CV_VERSION_EPOCH
-#include "opencv2/videoio/videoio.hpp"
-#endif
-using namespace cv;
-
 #include "http_stream.h"
-#include "image.h"
 
+typedef std::shared_ptr<std::vector<unsigned char> const> jpeg_buf_t;
 
-class MJPGWriter
+class mjpeg_server_t
 {
+	struct client_t {
+		std::string request;	// until the end of the HTTP headers
+		std::string stream;
+		bool streaming;
+		std::string head;		// HTTP response or part headers, sent before the frame
+		jpeg_buf_t frame;		// part which is being sent
+		size_t sent;			// bytes of head + frame
+		jpeg_buf_t next;		// the newest frame which isn't started, older ones are dropped
+		bool want_write;
+	};
+
 	SOCKET sock;
-	SOCKET maxfd;
-	fd_set master;
-	int timeout; // master sock timeout, shutdown after timeout millis.
-	int quality; // jpeg compression [1..100]
+	socket_poller_t poller;
+	std::map<SOCKET, client_t> clients;
+	std::map<std::string, jpeg_buf_t> last_frames;		// for new clients
+	std::map<std::string, jpeg_buf_t> published;		// under mutex, not delivered yet
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > buf_pool;
+	std::mutex mutex;
+	std::atomic<int> streaming_clients;
+	std::atomic<bool> stop;
+	std::thread loop_thread;
+#ifdef __linux__
+	int wake_pipe[2];
+#endif
+
+public:
+	std::atomic<unsigned long long> frames_sent, frames_dropped;
 
-	int _write(int sock, char const*const s, int len)
+	mjpeg_server_t(int port) : streaming_clients(0), stop(false), frames_sent(0), frames_dropped(0)
 	{
-		if (len < 1) { len = strlen(s); }
-		return ::send(sock, s, len, 0);
+#ifdef __linux__
+		wake_pipe[0] = wake_pipe[1] = -1;
+#endif
+		sock = open_listen_socket(port, false);
+		if (sock == INVALID_SOCKET) return;
+		poller.add(sock, false);
+#ifdef __linux__
+		if (::pipe(wake_pipe) == 0) {
+			set_nonblocking(wake_pipe[0]);
+			set_nonblocking(wake_pipe[1]);
+			poller.add(wake_pipe[0], false);
+		}
+		else wake_pipe[0] = wake_pipe[1] = -1;
+#endif
+		loop_thread = std::thread(&mjpeg_server_t::loop, this);
 	}
 
-public:
+	~mjpeg_server_t()
+	{
+		stop = true;
+		wake();
+		if (loop_thread.joinable()) loop_thread.join();
+		for (auto &i : clients) close_socket(i.first);
+		if (sock != INVALID_SOCKET) close_socket(sock);
+#ifdef __linux__
+		if (wake_pipe[0] >= 0) {
+			::close(wake_pipe[0]);
+			::close(wake_pipe[1]);
+		}
+#endif
+	}
 
-	MJPGWriter(int port = 0, int _timeout = 200000, int _quality = 30)
-		: sock(INVALID_SOCKET)
-		, timeout(_timeout)
-		, quality(_quality)
+	bool is_opened() const { return sock != INVALID_SOCKET; }
+
+	// clients which receive frames, the caller can skip encoding if there are none
+	int get_clients() const { return streaming_clients; }
+
+	// buffer for the next frame, it's reused after all clients have sent it (any publishing thread)
+	std::shared_ptr<std::vector<unsigned char> > get_buffer()
 	{
-		FD_ZERO(&master);
-		if (port)
-			open(port);
+		std::lock_guard<std::mutex> lock(mutex);	// the returned copy holds the buffer before the unlock
+		for (auto &b : buf_pool)
+			if (b.use_count() == 1) return b;
+		buf_pool.push_back(std::make_shared<std::vector<unsigned char> >());
+		return buf_pool.back();
 	}
 
-	~MJPGWriter()
+	// hands the frame to the server thread, doesn't wait for the clients
+	void publish(std::string const& stream, jpeg_buf_t frame)
 	{
-		release();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			published[stream] = frame;
+		}
+		wake();
 	}
 
-	bool release()
+private:
+	void wake()
 	{
-		if (sock != INVALID_SOCKET)
-			::shutdown(sock, 2);
-		sock = (INVALID_SOCKET);
-		return false;
+#ifdef __linux__
+		if (wake_pipe[1] >= 0) {
+			char c = 0;
+			if (::write(wake_pipe[1], &c, 1) < 0) {}	// full pipe - the loop is woken anyway
+		}
+#endif
 	}
 
-	bool open(int port)
+	void loop()
 	{
-		sock = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		std::vector<socket_poller_t::event_t> events;
+		while (!stop) {
+#ifdef __linux__
+			poller.wait(events, 1000);
+#else
+			poller.wait(events, 10);	// no wake-up socket, published frames are polled
+#endif
+			for (auto &e : events) {
+				if (e.sock == sock) accept_clients();
+#ifdef __linux__
+				else if (e.sock == wake_pipe[0]) {
+					char buf[256];
+					while (::read(wake_pipe[0], buf, sizeof(buf)) > 0) {}
+				}
+#endif
+				else if (clients.count(e.sock)) {
+					if (e.readable && !on_readable(e.sock)) continue;
+					if (e.writable) flush(e.sock);
+				}
+			}
+			deliver_published();
+		}
+	}
 
-		SOCKADDR_IN address;
-		address.sin_addr.s_addr = INADDR_ANY;
-		address.sin_family = AF_INET;
-		address.sin_port = htons(port);	// ::htons(port);
-		if (::bind(sock, (SOCKADDR*)&address, sizeof(SOCKADDR_IN)) == SOCKET_ERROR)
-		{
-			cerr << "error : couldn't bind sock " << sock << " to port " << port << "!" << endl;
-			return release();
+	void accept_clients()
+	{
+		for (;;) {
+			SOCKADDR_IN address;
+#ifdef _WIN32
+			int addrlen = sizeof(SOCKADDR);
+#else
+			socklen_t addrlen = sizeof(SOCKADDR);
+#endif
+			SOCKET client = ::accept(sock, (SOCKADDR*)&address, &addrlen);
+			if (client == INVALID_SOCKET) return;
+			set_nonblocking(client);
+			int one = 1;
+			::setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (char const*)&one, sizeof(one));
+			client_t &c = clients[client];
+			c.streaming = false;
+			c.sent = 0;
+			c.want_write = false;
+			poller.add(client, false);
 		}
-		if (::listen(sock, 10) == SOCKET_ERROR)
-		{
-			cerr << "error : couldn't listen on sock " << sock << " on port " << port << " !" << endl;
-			return release();
+	}
+
+	void close_client(SOCKET s)
+	{
+		if (clients[s].streaming) --streaming_clients;
+		poller.remove(s);
+		close_socket(s);
+		clients.erase(s);
+	}
+
+	// false - the client is closed
+	bool on_readable(SOCKET s)
+	{
+		client_t &c = clients[s];
+		char buf[1024];
+		for (;;) {
+			int const n = ::recv(s, buf, sizeof(buf), 0);
+			if (n == 0 || (n < 0 && !would_block())) {
+				close_client(s);
+				return false;
+			}
+			if (n < 0) break;
+			if (c.streaming) continue;	// anything after the request is ignored
+			c.request.append(buf, n);
+			if (c.request.size() > 8192) {
+				close_client(s);
+				return false;
+			}
+		}
+		if (!c.streaming && c.request.find("\r\n\r\n") != std::string::npos) {
+			// "GET /name HTTP/1.1" - stream "name", "GET / HTTP/1.1" - the default stream ""
+			size_t const path = c.request.find(' ');
+			size_t const path_end = (path == std::string::npos) ? path : c.request.find_first_of(" ?\r", path + 1);
+			if (path_end != std::string::npos && c.request[path + 1] == '/')
+				c.stream = c.request.substr(path + 2, path_end - path - 2);
+			c.request.clear();
+			c.streaming = true;
+			++streaming_clients;
+			c.head =
+				"HTTP/1.0 200 OK\r\n"
+				"Server: Mozarella/2.2\r\n"
+				"Accept-Range: bytes\r\n"
+				"Connection: close\r\n"
+				"Max-Age: 0\r\n"
+				"Expires: 0\r\n"
+				"Cache-Control: no-cache, private\r\n"
+				"Pragma: no-cache\r\n"
+				"Content-Type: multipart/x-mixed-replace; boundary=mjpegstream\r\n"
+				"\r\n";
+			c.sent = 0;
+			auto last = last_frames.find(c.stream);
+			if (last != last_frames.end()) c.next = last->second;
+			return flush(s);
 		}
-		FD_ZERO(&master);
-		FD_SET(sock, &master);
-		maxfd = sock;
 		return true;
 	}
 
-	bool isOpened()
+	void deliver_published()
 	{
-		return sock != INVALID_SOCKET;
+		std::map<std::string, jpeg_buf_t> frames;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			frames.swap(published);
+		}
+		if (frames.empty()) return;
+		for (auto &f : frames) last_frames[f.first] = f.second;
+
+		std::vector<SOCKET> socks;
+		for (auto &i : clients) {
+			client_t &c = i.second;
+			if (!c.streaming) continue;
+			auto f = frames.find(c.stream);
+			if (f == frames.end()) continue;
+			if (c.next) ++frames_dropped;
+			c.next = f->second;
+			socks.push_back(i.first);
+		}
+		for (SOCKET s : socks) flush(s);
 	}
 
-	bool write(const Mat & frame)
+	// sends until the socket would block, false - the client is closed
+	bool flush(SOCKET s)
 	{
-		fd_set rread = master;
-		struct timeval to = { 0,timeout };
-		if (::select(maxfd+1, &rread, NULL, NULL, &to) <= 0)
-			return true; // nothing broken, there's just noone listening
-
-		std::vector<uchar> outbuf;
-		std::vector<int> params;
-		params.push_back(IMWRITE_JPEG_QUALITY);
-		params.push_back(quality);
-		cv::imencode(".jpg", frame, outbuf, params);
-		size_t outlen = outbuf.size();
-
-#ifdef _WIN32 
-		for (unsigned i = 0; i<rread.fd_count; i++)
-		{
-			int addrlen = sizeof(SOCKADDR);
-			SOCKET s = rread.fd_array[i];    // fd_set on win is an array, while ...
-#else         
-		for (int s = 0; s<=maxfd; s++)
-		{
-			socklen_t addrlen = sizeof(SOCKADDR);
-			if (!FD_ISSET(s, &rread))      // ... on linux it's a bitmask ;)
-				continue;
-#endif                   
-			if (s == sock) // request on master socket, accept and send main header.
-			{
-				SOCKADDR_IN address = { 0 };
-				SOCKET      client = ::accept(sock, (SOCKADDR*)&address, &addrlen);
-				if (client == SOCKET_ERROR)
-				{
-					cerr << "error : couldn't accept connection on sock " << sock << " !" << endl;
-					return false;
-				}
-				maxfd = (maxfd>client ? maxfd : client);
-				FD_SET(client, &master);
-				_write(client, "HTTP/1.0 200 OK\r\n", 0);
-				_write(client,
-					"Server: Mozarella/2.2\r\n"
-					"Accept-Range: bytes\r\n"
-					"Connection: close\r\n"
-					"Max-Age: 0\r\n"
-					"Expires: 0\r\n"
-					"Cache-Control: no-cache, private\r\n"
-					"Pragma: no-cache\r\n"
-					"Content-Type: multipart/x-mixed-replace; boundary=mjpegstream\r\n"
-					"\r\n", 0);
-				cerr << "new client " << client << endl;
+		client_t &c = clients[s];
+		for (;;) {
+			if (c.sent >= c.head.size() + (c.frame ? c.frame->size() : 0)) {
+				if (c.frame) ++frames_sent;
+				c.frame.reset();
+				c.head.clear();
+				c.sent = 0;
+				if (!c.next) break;
+				c.frame = c.next;
+				c.next.reset();
+				char head[128];
+				sprintf(head, "--mjpegstream\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", c.frame->size());
+				c.head = head;
 			}
-			else // existing client, just stream pix
-			{
-				char head[400];
-				sprintf(head, "--mjpegstream\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", outlen);
-				_write(s, head, 0);
-				int n = _write(s, (char*)(&outbuf[0]), outlen);
-				//cerr << "known client " << s << " " << n << endl;
-				if (n < outlen)
-				{
-					cerr << "kill client " << s << endl;
-					::shutdown(s, 2);
-					FD_CLR(s, &master);
-				}
+			char const *data;
+			size_t len;
+			if (c.sent < c.head.size()) data = c.head.data() + c.sent, len = c.head.size() - c.sent;
+			else data = (char const*)c.frame->data() + (c.sent - c.head.size()), len = c.frame->size() - (c.sent - c.head.size());
+			int const n = ::send(s, data, (int)len, MSG_NOSIGNAL);
+			if (n < 0 && would_block()) break;
+			if (n <= 0) {
+				close_client(s);
+				return false;
 			}
+			c.sent += n;
+		}
+		bool const want_write = !c.head.empty();
+		if (want_write != c.want_write) {
+			c.want_write = want_write;
+			poller.modify(s, want_write);
 		}
 		return true;
 	}
 };
-// ----------------------------------------
 
+static std::mutex mjpeg_servers_mutex;
+static std::map<int, std::unique_ptr<mjpeg_server_t> > mjpeg_servers;
+
+static mjpeg_server_t *get_mjpeg_server(int port)
+{
+	std::lock_guard<std::mutex> lock(mjpeg_servers_mutex);
+	std::unique_ptr<mjpeg_server_t> &server = mjpeg_servers[port];
+	if (!server) server.reset(new mjpeg_server_t(port));
+	return server->is_opened() ? server.get() : NULL;
+}
+
+void send_mjpeg_buffer(int port, char const* stream, unsigned char const* jpeg, size_t size)
+{
+	mjpeg_server_t *server = get_mjpeg_server(port);
+	if (!server || server->get_clients() == 0) return;
+	std::shared_ptr<std::vector<unsigned char> > buf = server->get_buffer();
+	buf->assign(jpeg, jpeg + size);
+	server->publish(stream ? stream : "", buf);
+}
+
+void get_mjpeg_stats(int port, int *clients, unsigned long long *frames_sent, unsigned long long *frames_dropped)
+{
+	mjpeg_server_t *server = get_mjpeg_server(port);
+	*clients = server ? server->get_clients() : 0;
+	*frames_sent = server ? server->frames_sent.load() : 0;
+	*frames_dropped = server ? server->frames_dropped.load() : 0;
+}
+
+#ifdef OPENCV
+
+#include "opencv2/opencv.hpp"
+#include "opencv2/highgui.hpp"
+#include "opencv2/highgui/highgui_c.h"
+#include "opencv2/imgproc/imgproc_c.h"
+#ifndef CV_VERSION_EPOCH
+#include "opencv2/videoio/videoio.hpp"
+#endif
+using namespace cv;
+
+#include "image.h"
+
+void send_mjpeg_stream(IplImage* ipl, int port, char const* stream, int quality)
+{
+	mjpeg_server_t *server = get_mjpeg_server(port);
+	if (!server || server->get_clients() == 0) return;	// nobody to encode for
+	std::vector<int> params;
+	params.push_back(IMWRITE_JPEG_QUALITY);
+	params.push_back(quality);
+	std::shared_ptr<std::vector<unsigned char> > buf = server->get_buffer();
+	cv::imencode(".jpg", cv::cvarrToMat(ipl), *buf, params);
+	server->publish(stream ? stream : "", buf);
+}
+
+// timeout isn't used: the clients are served by the server thread
 void send_mjpeg(IplImage* ipl, int port, int timeout, int quality) {
-	static MJPGWriter wri(port, timeout, quality);
-	cv::Mat mat = cv::cvarrToMat(ipl);
-	wri.write(mat);
+	send_mjpeg_stream(ipl, port, "", quality);
 	std::cout << " MJPEG-stream sent. \n";
 }
 // ----------------------------------------
@@ -5,9 +5,17 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+#include <stddef.h>
 #include "image.h"
 
+// MJPEG server on the port (started on the first frame), clients open http://host:port/<stream>,
+// "/" is the stream "". Frames are skipped if nobody is connected or a client is slower than the stream.
+void send_mjpeg_buffer(int port, char const* stream, unsigned char const* jpeg, size_t size);
+void get_mjpeg_stats(int port, int *clients, unsigned long long *frames_sent, unsigned long long *frames_dropped);
+
+#ifdef OPENCV
 void send_mjpeg(IplImage* ipl, int port, int timeout, int quality);
+void send_mjpeg_stream(IplImage* ipl, int port, char const* stream, int quality);
 CvCapture* get_capture_webcam(int index);
 CvCapture* get_capture_video_stream(char *path);
 IplImage* get_webcam_frame(CvCapture *cap);
@@ -15,6 +23,7 @@ IplImage* get_webcam_frame(CvCapture *cap);
 image image_data_augmentation(IplImage* ipl, int w, int h,
 	int pleft, int ptop, int swidth, int sheight, int flip,
 	float jitter, float dhue, float dsat, float dexp);
+#endif
 
 #ifdef __cplusplus
 }
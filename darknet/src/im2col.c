@@ -38,3 +38,72 @@ void im2col_cpu(float* data_im,
     }
 }
 
+
+// xnor inference: im2col of the signs of the input (bit = input > 0), packed 64 per word along
+// K = channels*ksize*ksize, one row of (K+63)/64 words per output pixel.
+// mask marks the taps inside of the image - padding gives 0 like in im2col_cpu().
+void im2col_cpu_bits(float* data_im,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad, uint64_t *bits, uint64_t *mask)
+{
+    int height_col = (height + 2*pad - ksize) / stride + 1;
+    int width_col = (width + 2*pad - ksize) / stride + 1;
+    int k_size = channels*ksize*ksize;
+    int k_words = (k_size + 63) / 64;
+    int h;
+
+    #pragma omp parallel for
+    for (h = 0; h < height_col; ++h) {
+        int w, c, kh, kw, i;
+        int im_row0 = h*stride - pad;
+        for (w = 0; w < width_col; ++w) {
+            uint64_t *row_bits = bits + (size_t)(h*width_col + w)*k_words;
+            uint64_t *row_mask = mask + (size_t)(h*width_col + w)*k_words;
+            int im_col0 = w*stride - pad;
+            int k = 0;
+            uint64_t word = 0, word_mask = 0;
+            if (im_row0 >= 0 && im_col0 >= 0 && im_row0 + ksize <= height && im_col0 + ksize <= width) {
+                // interior: all taps are inside
+                for (c = 0; c < channels; ++c) {
+                    const float *im = data_im + (c*height + im_row0)*width + im_col0;
+                    for (kh = 0; kh < ksize; ++kh) {
+                        for (kw = 0; kw < ksize; ++kw, ++k) {
+                            word |= (uint64_t)(im[kh*width + kw] > 0) << (k & 63);
+                            if ((k & 63) == 63) {
+                                row_bits[k >> 6] = word;
+                                word = 0;
+                            }
+                        }
+                    }
+                }
+                for (i = 0; i < k_size / 64; ++i) row_mask[i] = ~(uint64_t)0;
+                if (k_size & 63) {
+                    row_bits[k_words - 1] = word;
+                    row_mask[k_words - 1] = ((uint64_t)1 << (k_size & 63)) - 1;
+                }
+                continue;
+            }
+            for (c = 0; c < channels; ++c) {
+                for (kh = 0; kh < ksize; ++kh) {
+                    int im_row = im_row0 + kh;
+                    for (kw = 0; kw < ksize; ++kw, ++k) {
+                        int im_col = im_col0 + kw;
+                        if (im_row >= 0 && im_col >= 0 && im_row < height && im_col < width) {
+                            word_mask |= (uint64_t)1 << (k & 63);
+                            word |= (uint64_t)(data_im[im_col + width*(im_row + height*c)] > 0) << (k & 63);
+                        }
+                        if ((k & 63) == 63) {
+                            row_bits[k >> 6] = word;
+                            row_mask[k >> 6] = word_mask;
+                            word = word_mask = 0;
+                        }
+                    }
+                }
+            }
+            if (k_size & 63) {
+                row_bits[k_words - 1] = word;
+                row_mask[k_words - 1] = word_mask;
+            }
+        }
+    }
+}
@@ -1,10 +1,15 @@
 #ifndef IM2COL_H
 #define IM2COL_H
+#include <stdint.h>
 
 void im2col_cpu(float* data_im,
         int channels, int height, int width,
         int ksize, int stride, int pad, float* data_col);
 
+void im2col_cpu_bits(float* data_im,
+        int channels, int height, int width,
+        int ksize, int stride, int pad, uint64_t *bits, uint64_t *mask);
+
 #ifdef GPU
 
 void im2col_ongpu(float *im,
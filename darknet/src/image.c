@@ -4,6 +4,13 @@
 #include "cuda.h"
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -23,6 +30,8 @@
 #include "http_stream.h"
 #endif
 
+static void resize_image_region(image im, image dst, int dx, int dy, int w, int h);
+
 int windows = 0;
 
 float colors[6][3] = { {1,0,1}, {0,0,1},{0,1,1},{0,1,0},{1,1,0},{1,0,0} };
@@ -61,11 +70,6 @@ static void set_pixel(image m, int x, int y, int c, float val)
 	assert(x < m.w && y < m.h && c < m.c);
 	m.data[c*m.h*m.w + y*m.w + x] = val;
 }
-static void add_pixel(image m, int x, int y, int c, float val)
-{
-	assert(x < m.w && y < m.h && c < m.c);
-	m.data[c*m.h*m.w + y*m.w + x] += val;
-}
 
 void composite_image(image source, image dest, int dx, int dy)
 {
@@ -1197,9 +1201,7 @@ void letterbox_image_into(image im, int w, int h, image boxed)
 		new_h = h;
 		new_w = (im.w * h) / im.h;
 	}
-	image resized = resize_image(im, new_w, new_h);
-	embed_image(resized, boxed, (w - new_w) / 2, (h - new_h) / 2);
-	free_image(resized);
+	resize_image_region(im, boxed, (w - new_w) / 2, (h - new_h) / 2, new_w, new_h);
 }
 
 image letterbox_image(image im, int w, int h)
@@ -1214,13 +1216,11 @@ image letterbox_image(image im, int w, int h)
 		new_h = h;
 		new_w = (im.w * h) / im.h;
 	}
-	image resized = resize_image(im, new_w, new_h);
 	image boxed = make_image(w, h, im.c);
 	fill_image(boxed, .5);
 	//int i;
 	//for(i = 0; i < boxed.w*boxed.h*boxed.c; ++i) boxed.data[i] = 0;
-	embed_image(resized, boxed, (w - new_w) / 2, (h - new_h) / 2);
-	free_image(resized);
+	resize_image_region(im, boxed, (w - new_w) / 2, (h - new_h) / 2, new_w, new_h);
 	return boxed;
 }
 
@@ -1296,81 +1296,146 @@ float three_way_min(float a, float b, float c)
 }
 
 // http://www.cs.rit.edu/~ncs/color/t_convert.html
+// gray pixels (delta == 0) get h = 0, their hue is ignored by hsv_to_rgb
+static inline void rgb_to_hsv_pixel(float r, float g, float b, float *h, float *s, float *v)
+{
+    float max = three_way_max(r,g,b);
+    float min = three_way_min(r,g,b);
+    float delta = max - min;
+    *v = max;
+    if(max == 0 || delta == 0){
+        *s = 0;
+        *h = 0;
+    }else{
+        float hh;
+        *s = delta/max;
+        if(r == max){
+            hh = (g - b) / delta;
+        } else if (g == max) {
+            hh = 2 + (b - r) / delta;
+        } else {
+            hh = 4 + (r - g) / delta;
+        }
+        if (hh < 0) hh += 6;
+        *h = hh/6;
+    }
+}
+
+static inline void hsv_to_rgb_pixel(float h, float s, float v, float *r, float *g, float *b)
+{
+    if (s == 0) {
+        *r = *g = *b = v;
+    } else {
+        h = 6 * h;
+        int index = floorf(h);
+        float f = h - index;
+        float p = v*(1-s);
+        float q = v*(1-s*f);
+        float t = v*(1-s*(1-f));
+        if(index == 0){
+            *r = v; *g = t; *b = p;
+        } else if(index == 1){
+            *r = q; *g = v; *b = p;
+        } else if(index == 2){
+            *r = p; *g = v; *b = t;
+        } else if(index == 3){
+            *r = p; *g = q; *b = v;
+        } else if(index == 4){
+            *r = t; *g = p; *b = v;
+        } else {
+            *r = v; *g = p; *b = q;
+        }
+    }
+}
+
+#ifdef __SSE2__
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// 4 pixels, the same branches as rgb_to_hsv_pixel() as masks
+static inline void rgb_to_hsv_sse(__m128 r, __m128 g, __m128 b, __m128 *h, __m128 *s, __m128 *v)
+{
+    __m128 const zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+    __m128 max = _mm_max_ps(r, _mm_max_ps(g, b));
+    __m128 min = _mm_min_ps(r, _mm_min_ps(g, b));
+    __m128 delta = _mm_sub_ps(max, min);
+    __m128 color = _mm_and_ps(_mm_cmpneq_ps(max, zero), _mm_cmpneq_ps(delta, zero));
+    __m128 safe_max = select_ps(color, max, one), safe_delta = select_ps(color, delta, one);
+    __m128 r_max = _mm_cmpeq_ps(r, max), g_max = _mm_cmpeq_ps(g, max);
+    __m128 num = select_ps(r_max, _mm_sub_ps(g, b), select_ps(g_max, _mm_sub_ps(b, r), _mm_sub_ps(r, g)));
+    __m128 off = select_ps(r_max, zero, select_ps(g_max, _mm_set1_ps(2), _mm_set1_ps(4)));
+    __m128 hh = _mm_add_ps(off, _mm_div_ps(num, safe_delta));
+    hh = _mm_add_ps(hh, _mm_and_ps(_mm_cmplt_ps(hh, zero), _mm_set1_ps(6)));
+    *h = _mm_and_ps(color, _mm_div_ps(hh, _mm_set1_ps(6)));
+    *s = _mm_and_ps(color, _mm_div_ps(delta, safe_max));
+    *v = max;
+}
+
+static inline void hsv_to_rgb_sse(__m128 h, __m128 s, __m128 v, __m128 *r, __m128 *g, __m128 *b)
+{
+    __m128 const one = _mm_set1_ps(1);
+    h = _mm_mul_ps(h, _mm_set1_ps(6));
+    __m128i index = _mm_cvttps_epi32(h);
+    __m128 fi = _mm_cvtepi32_ps(index);
+    __m128 below = _mm_cmpgt_ps(fi, h);     // truncation of a negative h -> floor
+    fi = _mm_sub_ps(fi, _mm_and_ps(below, one));
+    index = _mm_cvttps_epi32(fi);
+    __m128 f = _mm_sub_ps(h, fi);
+    __m128 p = _mm_mul_ps(v, _mm_sub_ps(one, s));
+    __m128 q = _mm_mul_ps(v, _mm_sub_ps(one, _mm_mul_ps(s, f)));
+    __m128 t = _mm_mul_ps(v, _mm_sub_ps(one, _mm_mul_ps(s, _mm_sub_ps(one, f))));
+    __m128 i0 = _mm_castsi128_ps(_mm_cmpeq_epi32(index, _mm_set1_epi32(0)));
+    __m128 i1 = _mm_castsi128_ps(_mm_cmpeq_epi32(index, _mm_set1_epi32(1)));
+    __m128 i2 = _mm_castsi128_ps(_mm_cmpeq_epi32(index, _mm_set1_epi32(2)));
+    __m128 i3 = _mm_castsi128_ps(_mm_cmpeq_epi32(index, _mm_set1_epi32(3)));
+    __m128 i4 = _mm_castsi128_ps(_mm_cmpeq_epi32(index, _mm_set1_epi32(4)));
+    __m128 rr = select_ps(i0, v, select_ps(i1, q, select_ps(i2, p, select_ps(i3, p, select_ps(i4, t, v)))));
+    __m128 gg = select_ps(i0, t, select_ps(i1, v, select_ps(i2, v, select_ps(i3, q, p))));
+    __m128 bb = select_ps(i0, p, select_ps(i1, p, select_ps(i2, t, select_ps(i3, v, select_ps(i4, v, q)))));
+    __m128 gray = _mm_cmpeq_ps(s, _mm_setzero_ps());
+    *r = select_ps(gray, v, rr);
+    *g = select_ps(gray, v, gg);
+    *b = select_ps(gray, v, bb);
+}
+#endif
+
 void rgb_to_hsv(image im)
 {
     assert(im.c == 3);
-    int i, j;
-    float r, g, b;
-    float h, s, v;
-    for(j = 0; j < im.h; ++j){
-        for(i = 0; i < im.w; ++i){
-            r = get_pixel(im, i , j, 0);
-            g = get_pixel(im, i , j, 1);
-            b = get_pixel(im, i , j, 2);
-            float max = three_way_max(r,g,b);
-            float min = three_way_min(r,g,b);
-            float delta = max - min;
-            v = max;
-            if(max == 0){
-                s = 0;
-                h = 0;
-            }else{
-                s = delta/max;
-                if(r == max){
-                    h = (g - b) / delta;
-                } else if (g == max) {
-                    h = 2 + (b - r) / delta;
-                } else {
-                    h = 4 + (r - g) / delta;
-                }
-                if (h < 0) h += 6;
-                h = h/6.;
-            }
-            set_pixel(im, i, j, 0, h);
-            set_pixel(im, i, j, 1, s);
-            set_pixel(im, i, j, 2, v);
-        }
+    int i = 0, n = im.w*im.h;
+    float *c0 = im.data, *c1 = im.data + n, *c2 = im.data + 2*n;
+#ifdef __SSE2__
+    for(; i + 4 <= n; i += 4){
+        __m128 h, s, v;
+        rgb_to_hsv_sse(_mm_loadu_ps(c0 + i), _mm_loadu_ps(c1 + i), _mm_loadu_ps(c2 + i), &h, &s, &v);
+        _mm_storeu_ps(c0 + i, h);
+        _mm_storeu_ps(c1 + i, s);
+        _mm_storeu_ps(c2 + i, v);
+    }
+#endif
+    for(; i < n; ++i){
+        rgb_to_hsv_pixel(c0[i], c1[i], c2[i], c0 + i, c1 + i, c2 + i);
     }
 }
 
 void hsv_to_rgb(image im)
 {
     assert(im.c == 3);
-    int i, j;
-    float r, g, b;
-    float h, s, v;
-    float f, p, q, t;
-    for(j = 0; j < im.h; ++j){
-        for(i = 0; i < im.w; ++i){
-            h = 6 * get_pixel(im, i , j, 0);
-            s = get_pixel(im, i , j, 1);
-            v = get_pixel(im, i , j, 2);
-            if (s == 0) {
-                r = g = b = v;
-            } else {
-                int index = floor(h);
-                f = h - index;
-                p = v*(1-s);
-                q = v*(1-s*f);
-                t = v*(1-s*(1-f));
-                if(index == 0){
-                    r = v; g = t; b = p;
-                } else if(index == 1){
-                    r = q; g = v; b = p;
-                } else if(index == 2){
-                    r = p; g = v; b = t;
-                } else if(index == 3){
-                    r = p; g = q; b = v;
-                } else if(index == 4){
-                    r = t; g = p; b = v;
-                } else {
-                    r = v; g = p; b = q;
-                }
-            }
-            set_pixel(im, i, j, 0, r);
-            set_pixel(im, i, j, 1, g);
-            set_pixel(im, i, j, 2, b);
-        }
+    int i = 0, n = im.w*im.h;
+    float *c0 = im.data, *c1 = im.data + n, *c2 = im.data + 2*n;
+#ifdef __SSE2__
+    for(; i + 4 <= n; i += 4){
+        __m128 r, g, b;
+        hsv_to_rgb_sse(_mm_loadu_ps(c0 + i), _mm_loadu_ps(c1 + i), _mm_loadu_ps(c2 + i), &r, &g, &b);
+        _mm_storeu_ps(c0 + i, r);
+        _mm_storeu_ps(c1 + i, g);
+        _mm_storeu_ps(c2 + i, b);
+    }
+#endif
+    for(; i < n; ++i){
+        hsv_to_rgb_pixel(c0[i], c1[i], c2[i], c0 + i, c1 + i, c2 + i);
     }
 }
 
@@ -1419,26 +1484,18 @@ image blend_image(image fore, image back, float alpha)
 
 void scale_image_channel(image im, int c, float v)
 {
-    int i, j;
-    for(j = 0; j < im.h; ++j){
-        for(i = 0; i < im.w; ++i){
-            float pix = get_pixel(im, i, j, c);
-            pix = pix*v;
-            set_pixel(im, i, j, c, pix);
-        }
-    }
+    assert(c >= 0 && c < im.c);
+    int i, n = im.w*im.h;
+    float *data = im.data + c*n;
+    for(i = 0; i < n; ++i) data[i] *= v;
 }
 
 void translate_image_channel(image im, int c, float v)
 {
-    int i, j;
-    for(j = 0; j < im.h; ++j){
-        for(i = 0; i < im.w; ++i){
-            float pix = get_pixel(im, i, j, c);
-            pix = pix+v;
-            set_pixel(im, i, j, c, pix);
-        }
-    }
+    assert(c >= 0 && c < im.c);
+    int i, n = im.w*im.h;
+    float *data = im.data + c*n;
+    for(i = 0; i < n; ++i) data[i] += v;
 }
 
 image binarize_image(image im)
@@ -1454,46 +1511,55 @@ image binarize_image(image im)
 
 void saturate_image(image im, float sat)
 {
-    rgb_to_hsv(im);
-    scale_image_channel(im, 1, sat);
-    hsv_to_rgb(im);
-    constrain_image(im);
+    distort_image(im, 0, sat, 1);
 }
 
 void hue_image(image im, float hue)
 {
-    rgb_to_hsv(im);
-    int i;
-    for(i = 0; i < im.w*im.h; ++i){
-        im.data[i] = im.data[i] + hue;
-        if (im.data[i] > 1) im.data[i] -= 1;
-        if (im.data[i] < 0) im.data[i] += 1;
-    }
-    hsv_to_rgb(im);
-    constrain_image(im);
+    distort_image(im, hue, 1, 1);
 }
 
 void exposure_image(image im, float sat)
 {
-    rgb_to_hsv(im);
-    scale_image_channel(im, 2, sat);
-    hsv_to_rgb(im);
-    constrain_image(im);
+    distort_image(im, 0, 1, sat);
 }
 
+// rgb -> hsv, scale s and v, shift h, hsv -> rgb, constrain - in one pass over the pixels
 void distort_image(image im, float hue, float sat, float val)
 {
-    rgb_to_hsv(im);
-    scale_image_channel(im, 1, sat);
-    scale_image_channel(im, 2, val);
-    int i;
-    for(i = 0; i < im.w*im.h; ++i){
-        im.data[i] = im.data[i] + hue;
-        if (im.data[i] > 1) im.data[i] -= 1;
-        if (im.data[i] < 0) im.data[i] += 1;
+    assert(im.c == 3);
+    int i = 0, n = im.w*im.h;
+    float *c0 = im.data, *c1 = im.data + n, *c2 = im.data + 2*n;
+#ifdef __SSE2__
+    __m128 const zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+    __m128 const hue4 = _mm_set1_ps(hue), sat4 = _mm_set1_ps(sat), val4 = _mm_set1_ps(val);
+    for(; i + 4 <= n; i += 4){
+        __m128 h, s, v, r, g, b;
+        rgb_to_hsv_sse(_mm_loadu_ps(c0 + i), _mm_loadu_ps(c1 + i), _mm_loadu_ps(c2 + i), &h, &s, &v);
+        s = _mm_mul_ps(s, sat4);
+        v = _mm_mul_ps(v, val4);
+        h = _mm_add_ps(h, hue4);
+        h = _mm_sub_ps(h, _mm_and_ps(_mm_cmpgt_ps(h, one), one));
+        h = _mm_add_ps(h, _mm_and_ps(_mm_cmplt_ps(h, zero), one));
+        hsv_to_rgb_sse(h, s, v, &r, &g, &b);
+        _mm_storeu_ps(c0 + i, _mm_min_ps(_mm_max_ps(r, zero), one));
+        _mm_storeu_ps(c1 + i, _mm_min_ps(_mm_max_ps(g, zero), one));
+        _mm_storeu_ps(c2 + i, _mm_min_ps(_mm_max_ps(b, zero), one));
+    }
+#endif
+    for(; i < n; ++i){
+        float h, s, v;
+        rgb_to_hsv_pixel(c0[i], c1[i], c2[i], &h, &s, &v);
+        s *= sat;
+        v *= val;
+        h += hue;
+        if (h > 1) h -= 1;
+        if (h < 0) h += 1;
+        hsv_to_rgb_pixel(h, s, v, c0 + i, c1 + i, c2 + i);
+        c0[i] = constrain(0, 1, c0[i]);
+        c1[i] = constrain(0, 1, c1[i]);
+        c2[i] = constrain(0, 1, c2[i]);
     }
-    hsv_to_rgb(im);
-    constrain_image(im);
 }
 
 void random_distort_image(image im, float hue, float saturation, float exposure)
@@ -1506,11 +1572,7 @@ void random_distort_image(image im, float hue, float saturation, float exposure)
 
 void saturate_exposure_image(image im, float sat, float exposure)
 {
-    rgb_to_hsv(im);
-    scale_image_channel(im, 1, sat);
-    scale_image_channel(im, 2, exposure);
-    hsv_to_rgb(im);
-    constrain_image(im);
+    distort_image(im, 0, sat, exposure);
 }
 
 float bilinear_interpolate(image im, float x, float y, int c)
@@ -1528,47 +1590,193 @@ float bilinear_interpolate(image im, float x, float y, int c)
     return val;
 }
 
-image resize_image(image im, int w, int h)
+// Bilinear resize tables: dst[i] = (1 - weight[i])*src[index[i]] + weight[i]*src[index[i] + 1],
+// the last dst pixel is the last src pixel. The tables of the last used (src, dst) size pairs are cached.
+typedef struct {
+    int src_w, src_h, w, h;
+    int *ix;
+    float *dx;
+    int *iy;
+    float *dy;
+    int refs;               // users of the cached table
+    int evicted;            // is freed by the last user
+    unsigned long long used;
+} resize_table;
+
+#define RESIZE_TABLE_CACHE 16
+#define RESIZE_STACK_W 2048
+
+static resize_table *resize_table_cache[RESIZE_TABLE_CACHE];
+static int resize_table_cache_size = 0;
+static unsigned long long resize_table_clock = 0;
+static pthread_mutex_t resize_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void fill_resize_coords(int src, int dst, int *index, float *weight)
 {
-    image resized = make_image(w, h, im.c);   
-    image part = make_image(w, im.h, im.c);
-    int r, c, k;
-    float w_scale = (float)(im.w - 1) / (w - 1);
-    float h_scale = (float)(im.h - 1) / (h - 1);
-    for(k = 0; k < im.c; ++k){
-        for(r = 0; r < im.h; ++r){
-            for(c = 0; c < w; ++c){
-                float val = 0;
-                if(c == w-1 || im.w == 1){
-                    val = get_pixel(im, im.w-1, r, k);
-                } else {
-                    float sx = c*w_scale;
-                    int ix = (int) sx;
-                    float dx = sx - ix;
-                    val = (1 - dx) * get_pixel(im, ix, r, k) + dx * get_pixel(im, ix+1, r, k);
+    int i;
+    float scale = (float)(src - 1) / (dst - 1);
+    for(i = 0; i < dst; ++i){
+        if(i == dst - 1 || src == 1){
+            index[i] = src - 1;
+            weight[i] = 0;
+        } else {
+            float s = i*scale;
+            index[i] = (int)s;
+            weight[i] = s - index[i];
+        }
+    }
+}
+
+static resize_table *make_resize_table(int src_w, int src_h, int w, int h)
+{
+    resize_table *t = calloc(1, sizeof(resize_table));
+    t->src_w = src_w;
+    t->src_h = src_h;
+    t->w = w;
+    t->h = h;
+    t->ix = calloc(w, sizeof(int));
+    t->dx = calloc(w, sizeof(float));
+    t->iy = calloc(h, sizeof(int));
+    t->dy = calloc(h, sizeof(float));
+    fill_resize_coords(src_w, w, t->ix, t->dx);
+    fill_resize_coords(src_h, h, t->iy, t->dy);
+    return t;
+}
+
+static void free_resize_table(resize_table *t)
+{
+    free(t->ix);
+    free(t->dx);
+    free(t->iy);
+    free(t->dy);
+    free(t);
+}
+
+static resize_table *find_resize_table(int src_w, int src_h, int w, int h)
+{
+    int i;
+    for(i = 0; i < resize_table_cache_size; ++i){
+        resize_table *t = resize_table_cache[i];
+        if(t->src_w == src_w && t->src_h == src_h && t->w == w && t->h == h) return t;
+    }
+    return 0;
+}
+
+// the table is built outside of the lock and replaces the least recently used one, release it by release_resize_table()
+static resize_table *get_resize_table(int src_w, int src_h, int w, int h)
+{
+    pthread_mutex_lock(&resize_table_mutex);
+    resize_table *t = find_resize_table(src_w, src_h, w, h);
+    if(!t){
+        pthread_mutex_unlock(&resize_table_mutex);
+        resize_table *made = make_resize_table(src_w, src_h, w, h);
+        pthread_mutex_lock(&resize_table_mutex);
+        t = find_resize_table(src_w, src_h, w, h);  // built by another thread meanwhile
+        if(t) free_resize_table(made);
+        else {
+            t = made;
+            if(resize_table_cache_size < RESIZE_TABLE_CACHE) resize_table_cache[resize_table_cache_size++] = t;
+            else {
+                int i, lru = 0;
+                for(i = 1; i < RESIZE_TABLE_CACHE; ++i){
+                    if(resize_table_cache[i]->used < resize_table_cache[lru]->used) lru = i;
                 }
-                set_pixel(part, c, r, k, val);
+                resize_table *old = resize_table_cache[lru];
+                if(old->refs == 0) free_resize_table(old);
+                else old->evicted = 1;
+                resize_table_cache[lru] = t;
             }
         }
     }
+    t->refs++;
+    t->used = ++resize_table_clock;
+    pthread_mutex_unlock(&resize_table_mutex);
+    return t;
+}
+
+static void release_resize_table(resize_table *t)
+{
+    pthread_mutex_lock(&resize_table_mutex);
+    if(--t->refs == 0 && t->evicted) free_resize_table(t);
+    pthread_mutex_unlock(&resize_table_mutex);
+}
+
+static void resize_row(const float *src, int src_w, float *dst, int w, const int *ix, const float *dx)
+{
+    int c;
+    for(c = 0; c < w; ++c){
+        int i = ix[c];
+        int i1 = (i + 1 < src_w) ? i + 1 : i;
+        dst[c] = (1 - dx[c]) * src[i] + dx[c] * src[i1];
+    }
+}
+
+static void blend_rows(const float *a, const float *b, float *dst, int w, float dy)
+{
+    int c = 0;
+#ifdef __SSE__
+    __m128 wa = _mm_set1_ps(1 - dy);
+    __m128 wb = _mm_set1_ps(dy);
+    for(; c + 4 <= w; c += 4){
+        __m128 va = _mm_mul_ps(wa, _mm_loadu_ps(a + c));
+        __m128 vb = _mm_mul_ps(wb, _mm_loadu_ps(b + c));
+        _mm_storeu_ps(dst + c, _mm_add_ps(va, vb));
+    }
+#endif
+    for(; c < w; ++c){
+        dst[c] = (1 - dy) * a[c] + dy * b[c];
+    }
+}
+
+// resizes im to w x h and writes it into dst at (dx, dy), the region has to be inside dst
+static void resize_image_region(image im, image dst, int dx, int dy, int w, int h)
+{
+    int k;
+    resize_table *table = get_resize_table(im.w, im.h, w, h);
+    resize_table t = *table;
+    #pragma omp parallel for if(im.c > 1 && w*h >= 64*1024)
     for(k = 0; k < im.c; ++k){
+        // two horizontally resized source rows, reused while the output rows map to them
+        float rows_stack[2*RESIZE_STACK_W];
+        float *rows = (w <= RESIZE_STACK_W) ? rows_stack : calloc(2*w, sizeof(float));
+        int row_src[2] = {-1, -1};
+        const float *src = im.data + k*im.w*im.h;
+        float *out = dst.data + k*dst.w*dst.h + dy*dst.w + dx;
+        int r;
         for(r = 0; r < h; ++r){
-            float sy = r*h_scale;
-            int iy = (int) sy;
-            float dy = sy - iy;
-            for(c = 0; c < w; ++c){
-                float val = (1-dy) * get_pixel(part, c, iy, k);
-                set_pixel(resized, c, r, k, val);
-            }
-            if(r == h-1 || im.h == 1) continue;
-            for(c = 0; c < w; ++c){
-                float val = dy * get_pixel(part, c, iy+1, k);
-                add_pixel(resized, c, r, k, val);
+            int iy = t.iy[r];
+            int iy1 = (iy + 1 < im.h) ? iy + 1 : iy;
+            int need[2] = {iy, iy1};
+            float *row[2];
+            int i;
+            for(i = 0; i < 2; ++i){
+                int slot = (row_src[0] == need[i]) ? 0 : (row_src[1] == need[i]) ? 1 : -1;
+                if(slot < 0){
+                    // don't overwrite the row which is needed for the other term
+                    slot = (row_src[0] == need[1 - i]) ? 1 : 0;
+                    resize_row(src + need[i]*im.w, im.w, rows + slot*w, w, t.ix, t.dx);
+                    row_src[slot] = need[i];
+                }
+                row[i] = rows + slot*w;
             }
+            if(t.dy[r] == 0) memcpy(out + r*dst.w, row[0], w*sizeof(float));
+            else blend_rows(row[0], row[1], out + r*dst.w, w, t.dy[r]);
         }
+        if(rows != rows_stack) free(rows);
     }
+    release_resize_table(table);
+}
 
-    free_image(part);
+// resizes im to the size of resized, resized.data is allocated by the caller
+void resize_image_into(image im, image resized)
+{
+    resize_image_region(im, resized, 0, 0, resized.w, resized.h);
+}
+
+image resize_image(image im, int w, int h)
+{
+    image resized = make_image(w, h, im.c);
+    resize_image_into(im, resized);
     return resized;
 }
 
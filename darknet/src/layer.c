@@ -31,6 +31,9 @@ void free_layer(layer l)
 	if (l.scales)             free(l.scales);
 	if (l.scale_updates)      free(l.scale_updates);
 	if (l.weights)            free(l.weights);
+	if (l.weights_half)       free(l.weights_half);
+	if (l.bit_weights)        free(l.bit_weights);
+	if (l.bit_scales)         free(l.bit_scales);
 	if (l.weight_updates)     free(l.weight_updates);
 	if (l.delta)              free(l.delta);
 	if (l.output)             free(l.output);
@@ -3,6 +3,7 @@
 
 #include "activations.h"
 #include "stddef.h"
+#include <stdint.h>
 #include "tree.h"
 
 struct network_state;
@@ -177,12 +178,18 @@ struct layer{
 
     float *weights;
     float *weight_updates;
+    unsigned short *weights_half;   // fp16 weights for CPU inference, weights are freed (convert_weights_to_half)
+    uint64_t *bit_weights;          // xnor inference: sign bits of the weights, 64 per word along K
+    float *bit_scales;              // xnor inference: mean |weight| of each filter
 
     float *col_image;
     int   * input_layers;
     int   * input_sizes;
     float * delta;
     float * output;
+    float * own_output;     // own buffer of a layer whose output is aliased into a route (alias_route_layers)
+    int fused_shortcut;     // the next layer is a shortcut computed by this convolutional layer (fuse_shortcut_layers)
+    int fused_upsample;     // upsample -> route -> 1x1 convolution computed by the convolution (fuse_upsample_layers)
     float * squared;
     float * norms;
 
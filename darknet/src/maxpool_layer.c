@@ -1,6 +1,10 @@
 #include "maxpool_layer.h"
 #include "cuda.h"
 #include <stdio.h>
+#include <string.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 image get_maxpool_image(maxpool_layer l)
 {
@@ -76,8 +80,117 @@ void resize_maxpool_layer(maxpool_layer *l, int w, int h)
     #endif
 }
 
+// Inference path: no indexes, each output row is the max of the columns of the vertical max of its input rows.
+// Border columns are bounds-checked, interior columns go through kernels for 2x2/2, 2x2/1 and 3x3/2.
+
+// vm[x] = max of rows y0 .. y1-1 of the plane
+static void maxpool_rows(const float *src, int w, int y0, int y1, float *vm)
+{
+    int x, y;
+    if (y0 >= y1) {
+        for (x = 0; x < w; ++x) vm[x] = -FLT_MAX;
+        return;
+    }
+    memcpy(vm, src + y0*w, w*sizeof(float));
+    for (y = y0 + 1; y < y1; ++y) {
+        const float *row = src + y*w;
+        x = 0;
+#ifdef __SSE__
+        for (; x + 4 <= w; x += 4) {
+            _mm_storeu_ps(vm + x, _mm_max_ps(_mm_loadu_ps(vm + x), _mm_loadu_ps(row + x)));
+        }
+#endif
+        for (; x < w; ++x) vm[x] = (row[x] > vm[x]) ? row[x] : vm[x];
+    }
+}
+
+// out[j] for j0 <= j < j1, windows of the columns are fully inside of vm
+static int maxpool_cols_interior(const float *vm, float *out, int j0, int j1, int size, int stride, int pad)
+{
+    int j = j0;
+#ifdef __SSE__
+    if (size == 2 && stride == 2) {
+        for (; j + 4 <= j1; j += 4) {
+            const float *p = vm + j*2 - pad;
+            __m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4);
+            __m128 even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 odd = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            _mm_storeu_ps(out + j, _mm_max_ps(even, odd));
+        }
+    }
+    else if (size == 2 && stride == 1) {
+        for (; j + 4 <= j1; j += 4) {
+            const float *p = vm + j - pad;
+            _mm_storeu_ps(out + j, _mm_max_ps(_mm_loadu_ps(p), _mm_loadu_ps(p + 1)));
+        }
+    }
+    else if (size == 3 && stride == 2) {
+        for (; j + 4 <= j1; j += 4) {
+            const float *p = vm + j*2 - pad;
+            __m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4);
+            __m128 c = _mm_loadu_ps(p + 2), d = _mm_loadu_ps(p + 6);
+            __m128 m = _mm_max_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+            _mm_storeu_ps(out + j, _mm_max_ps(m, _mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 0, 2, 0))));
+        }
+    }
+#endif
+    return j;
+}
+
+// out[j] for a window which can cross the border of the plane
+static float maxpool_col_border(const float *vm, int w, int j, int size, int stride, int pad)
+{
+    int m;
+    int x0 = j*stride - pad;
+    float max = -FLT_MAX;
+    for (m = 0; m < size; ++m) {
+        int x = x0 + m;
+        if (x >= 0 && x < w && vm[x] > max) max = vm[x];
+    }
+    return max;
+}
+
+static void maxpool_plane(const float *src, float *dst, float *vm, int w, int h, int out_w, int out_h,
+    int size, int stride, int pad)
+{
+    int i, j;
+    // columns whose windows are inside of the plane
+    int j0 = (pad + stride - 1) / stride;
+    int j1 = (w + pad - size) / stride + 1;
+    if (j0 > out_w) j0 = out_w;
+    if (j1 > out_w) j1 = out_w;
+    if (j1 < j0) j1 = j0;
+    for (i = 0; i < out_h; ++i) {
+        int y0 = i*stride - pad, y1 = y0 + size;
+        maxpool_rows(src, w, (y0 > 0) ? y0 : 0, (y1 < h) ? y1 : h, vm);
+        float *out = dst + i*out_w;
+        for (j = 0; j < j0; ++j) out[j] = maxpool_col_border(vm, w, j, size, stride, pad);
+        for (j = maxpool_cols_interior(vm, out, j0, j1, size, stride, pad); j < out_w; ++j) {
+            out[j] = maxpool_col_border(vm, w, j, size, stride, pad);
+        }
+    }
+}
+
+static void forward_maxpool_layer_inference(const maxpool_layer l, network_state state)
+{
+    int k;
+    int planes = l.batch*l.c;
+    #pragma omp parallel for if(planes > 1 && l.outputs*l.batch >= 64*1024)
+    for (k = 0; k < planes; ++k) {
+        float vm_buf[2048 + 4];     // +4: the 3x3/2 kernel loads (and drops) one float after the row
+        float *vm = (l.w <= 2048) ? vm_buf : calloc(l.w + 4, sizeof(float));
+        maxpool_plane(state.input + k*l.w*l.h, l.output + k*l.out_w*l.out_h, vm, l.w, l.h, l.out_w, l.out_h,
+            l.size, l.stride, l.pad);
+        if (vm != vm_buf) free(vm);
+    }
+}
+
 void forward_maxpool_layer(const maxpool_layer l, network_state state)
 {
+    if (!state.train) {
+        forward_maxpool_layer_inference(l, state);
+        return;
+    }
     int b,i,j,k,m,n;
     int w_offset = -l.pad;
     int h_offset = -l.pad;
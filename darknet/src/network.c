@@ -6,6 +6,7 @@
 #include "data.h"
 #include "utils.h"
 #include "blas.h"
+#include "gemm.h"
 
 #include "crop_layer.h"
 #include "connected_layer.h"
@@ -350,6 +351,11 @@ float train_network_batch(network net, data d, int n)
 
 void set_batch_network(network *net, int b)
 {
+    // aliases of multi-input routes are valid only for batch = 1
+    int alias_routes = net->alias_routes, fuse_shortcuts = net->fuse_shortcuts, fuse_upsamples = net->fuse_upsamples;
+    unfuse_upsample_layers(net);
+    unfuse_shortcut_layers(net);
+    unalias_route_layers(net);
     net->batch = b;
     int i;
     for(i = 0; i < net->n; ++i){
@@ -373,6 +379,9 @@ void set_batch_network(network *net, int b)
         }
 #endif
     }
+    if (alias_routes) alias_route_layers(net);
+    if (fuse_shortcuts) fuse_shortcut_layers(net);
+    if (fuse_upsamples) fuse_upsample_layers(net);
 }
 
 int resize_network(network *net, int w, int h)
@@ -390,6 +399,10 @@ int resize_network(network *net, int w, int h)
     }
 #endif
     int i;
+    int alias_routes = net->alias_routes, fuse_shortcuts = net->fuse_shortcuts, fuse_upsamples = net->fuse_upsamples;
+    unfuse_upsample_layers(net);
+    unfuse_shortcut_layers(net);
+    unalias_route_layers(net);
     //if(w == net->w && h == net->h) return 0;
     net->w = w;
     net->h = h;
@@ -448,10 +461,88 @@ int resize_network(network *net, int w, int h)
     free(net->workspace);
     net->workspace = calloc(1, workspace_size);
 #endif
+    if (alias_routes) alias_route_layers(net);
+    if (fuse_shortcuts) fuse_shortcut_layers(net);
+    if (fuse_upsamples) fuse_upsample_layers(net);
     //fprintf(stderr, " Done!\n");
     return 0;
 }
 
+// Execution context of the network for another input size:
+// layers share weights with net, but have their own outputs and workspace (allocated here, once),
+// so switching between contexts costs nothing. Only for inference on CPU.
+network make_network_context(network *net, int w, int h)
+{
+    int i;
+    network ctx = *net;
+    ctx.layers = calloc(net->n, sizeof(layer));
+    memcpy(ctx.layers, net->layers, net->n * sizeof(layer));
+    for (i = 0; i < ctx.n; ++i) {
+        layer *l = &ctx.layers[i];
+        if (l->own_output) {
+            l->output = l->own_output;
+            l->own_output = 0;
+        }
+        l->fused_shortcut = 0;
+        l->fused_upsample = 0;
+        // buffers which are reallocated by resize_*_layer() - detach them from net
+        if (l->type == CONVOLUTIONAL || l->type == CROP || l->type == MAXPOOL || l->type == REGION ||
+            l->type == YOLO || l->type == ROUTE || l->type == SHORTCUT || l->type == UPSAMPLE ||
+            l->type == REORG || l->type == NORMALIZATION || l->type == COST)
+        {
+            l->output = 0;
+            l->delta = 0;
+            l->indexes = 0;
+            l->squared = 0;
+            l->norms = 0;
+            if (l->batch_normalize) {
+                l->x = 0;
+                l->x_norm = 0;
+            }
+            if (l->type == CONVOLUTIONAL && l->xnor) l->binary_input = 0;
+        }
+        // resize_route_layer() writes the input sizes - the context gets its own arrays
+        if (l->type == ROUTE) {
+            l->input_layers = calloc(l->n, sizeof(int));
+            l->input_sizes = calloc(l->n, sizeof(int));
+            memcpy(l->input_layers, net->layers[i].input_layers, l->n * sizeof(int));
+            memcpy(l->input_sizes, net->layers[i].input_sizes, l->n * sizeof(int));
+        }
+    }
+    ctx.workspace = 0;
+    resize_network(&ctx, w, h);
+    ctx.inputs = ctx.w * ctx.h * ctx.c;
+    return ctx;
+}
+
+// frees only buffers of ctx which aren't shared with net
+void free_network_context(network ctx, network *net)
+{
+    int i;
+    unfuse_upsample_layers(&ctx);
+    unfuse_shortcut_layers(&ctx);
+    unalias_route_layers(&ctx);
+    for (i = 0; i < ctx.n; ++i) {
+        layer l = ctx.layers[i];
+        layer base = net->layers[i];
+        if (base.own_output) base.output = base.own_output;
+        if (l.output != base.output) free(l.output);
+        if (l.delta != base.delta) free(l.delta);
+        if (l.indexes != base.indexes) free(l.indexes);
+        if (l.squared != base.squared) free(l.squared);
+        if (l.norms != base.norms) free(l.norms);
+        if (l.x != base.x) free(l.x);
+        if (l.x_norm != base.x_norm) free(l.x_norm);
+        if (l.binary_input != base.binary_input) free(l.binary_input);
+        if (l.type == ROUTE) {
+            free(l.input_layers);
+            free(l.input_sizes);
+        }
+    }
+    free(ctx.layers);
+    if (ctx.workspace != net->workspace) free(ctx.workspace);
+}
+
 int get_network_output_size(network net)
 {
     int i;
@@ -622,6 +713,26 @@ detection *get_network_boxes(network *net, int w, int h, float thresh, float hie
 	return dets;
 }
 
+// boxes of the b-th image of a batched forward pass:
+// output layers of a copy of the network point to the b-th sample and act as batch = 1
+detection *get_network_boxes_batch(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter)
+{
+	int j;
+	network net_b = *net;
+	net_b.layers = calloc(net->n, sizeof(layer));
+	memcpy(net_b.layers, net->layers, net->n * sizeof(layer));
+	for (j = 0; j < net_b.n; ++j) {
+		layer *l = &net_b.layers[j];
+		if (l->type == YOLO || l->type == REGION || l->type == DETECTION) {
+			l->output += b*l->outputs;
+			l->batch = 1;
+		}
+	}
+	detection *dets = get_network_boxes(&net_b, w, h, thresh, hier, map, relative, num, letter);
+	free(net_b.layers);
+	return dets;
+}
+
 void free_detections(detection *dets, int n)
 {
 	int i;
@@ -763,6 +874,9 @@ float network_accuracy_multi(network net, data d, int n)
 void free_network(network net)
 {
 	int i;
+	unfuse_upsample_layers(&net);
+	unfuse_shortcut_layers(&net);
+	unalias_route_layers(&net);
 	for (i = 0; i < net.n; ++i) {
 		free_layer(net.layers[i]);
 	}
@@ -817,6 +931,7 @@ void fuse_conv_batchnorm(network net)
 				}
 
 				l->batch_normalize = 0;
+				pack_binary_weights(*l);
 #ifdef GPU
 				if (gpu_index >= 0) {
 					push_convolutional_layer(*l);
@@ -829,3 +944,172 @@ void fuse_conv_batchnorm(network net)
 		}
 	}
 }
+
+// Inference on CPU: weights of convolutional layers are kept as IEEE half precision and widened
+// to fp32 in gemm_half(). Call after fuse_conv_batchnorm(), the fp32 weights are freed.
+// Returns the number of bytes saved.
+size_t convert_weights_to_half(network net)
+{
+	int j;
+	size_t saved = 0;
+#ifdef GPU
+	if (gpu_index >= 0) return 0;
+#endif
+	for (j = 0; j < net.n; ++j) {
+		layer *l = &net.layers[j];
+		if (l->type != CONVOLUTIONAL || l->xnor || l->binary || !l->weights || l->weights_half) continue;
+		size_t size = (size_t)l->n*l->c*l->size*l->size;
+		l->weights_half = calloc(size, sizeof(unsigned short));
+		float_to_half_array(l->weights, l->weights_half, size);
+		free(l->weights);
+		l->weights = 0;
+		saved += size * (sizeof(float) - sizeof(unsigned short));
+	}
+	return saved;
+}
+
+// true if another layer uses the output buffer of l as its own (e.g. dropout), aliases aren't counted
+static int output_is_shared(network *net, layer *l)
+{
+    int i;
+    if (l->own_output) return 0;
+    for (i = 0; i < net->n; ++i) {
+        layer *k = &net->layers[i];
+        if (k != l && !k->own_output && k->output == l->output) return 1;
+    }
+    return 0;
+}
+
+// Inference: producers of route layers write their outputs directly into their slices of the route output,
+// so forward_route_layer() doesn't copy them. A route of one layer becomes a view of it (any batch),
+// routes of several layers - only for batch = 1, because for batch > 1 the slices aren't contiguous.
+// A producer is aliased into one route only, other routes still copy it.
+void alias_route_layers(network *net)
+{
+    int i, j;
+#ifdef GPU
+    if (gpu_index >= 0) return;
+#endif
+    net->alias_routes = 1;
+    // from the end: a route can be a producer of a later route, its output has to be final before
+    // its own producers are aliased into it
+    for (i = net->n - 1; i >= 0; --i) {
+        layer *l = &net->layers[i];
+        if (l->type != ROUTE) continue;
+        if (l->n > 1 && net->batch != 1) continue;
+        int offset = 0;
+        for (j = 0; j < l->n; ++j) {
+            layer *in = &net->layers[l->input_layers[j]];
+            if (!in->own_output && in->output != l->output + offset && !output_is_shared(net, in)) {
+                in->own_output = in->output;
+                in->output = l->output + offset;
+            }
+            offset += l->input_sizes[j];
+        }
+    }
+}
+
+void unalias_route_layers(network *net)
+{
+    int i;
+    for (i = 0; i < net->n; ++i) {
+        layer *l = &net->layers[i];
+        if (l->own_output && !l->fused_shortcut) {
+            l->output = l->own_output;
+            l->own_output = 0;
+        }
+    }
+    net->alias_routes = 0;
+}
+
+// number of references to the output of layer i from route and shortcut layers (the next layer isn't counted)
+static int output_readers(network *net, int i)
+{
+    int k, j;
+    int readers = output_is_shared(net, &net->layers[i]);
+    for (k = 0; k < net->n; ++k) {
+        layer *l = &net->layers[k];
+        if (l->type == SHORTCUT && l->index == i) ++readers;
+        if (l->type == ROUTE) {
+            for (j = 0; j < l->n; ++j) if (l->input_layers[j] == i) ++readers;
+        }
+    }
+    return readers;
+}
+
+// true if any layer except the next one reads the output of layer i
+static int output_is_read(network *net, int i)
+{
+    return output_readers(net, i) > 0;
+}
+
+// Inference: a shortcut layer which follows a convolutional layer of the same shape is computed
+// in the epilogue of the convolution (activation, residual add, shortcut activation - one pass),
+// the convolution writes into the shortcut output and forward_shortcut_layer() does nothing.
+// Call after alias_route_layers() - then the shortcut output can be a route slice.
+void fuse_shortcut_layers(network *net)
+{
+    int i;
+#ifdef GPU
+    if (gpu_index >= 0) return;
+#endif
+    net->fuse_shortcuts = 1;
+    for (i = 1; i < net->n; ++i) {
+        layer *s = &net->layers[i];
+        layer *conv = &net->layers[i - 1];
+        if (s->type != SHORTCUT || conv->type != CONVOLUTIONAL) continue;
+        if (s->w != s->out_w || s->h != s->out_h || s->c != s->out_c || conv->outputs != s->outputs) continue;
+        if (s->index == i - 1 || conv->own_output || output_is_read(net, i - 1)) continue;
+        conv->own_output = conv->output;
+        conv->output = s->output;
+        conv->fused_shortcut = 1;
+    }
+}
+
+void unfuse_shortcut_layers(network *net)
+{
+    int i;
+    for (i = 0; i < net->n; ++i) {
+        layer *l = &net->layers[i];
+        if (l->fused_shortcut) {
+            l->output = l->own_output;
+            l->own_output = 0;
+            l->fused_shortcut = 0;
+        }
+    }
+    net->fuse_shortcuts = 0;
+}
+
+// Inference: upsample -> route -> 1x1 convolution (yolov3 heads). The convolution is linear in the channels
+// of the route, so the part of it over the upsampled channels is computed at low resolution and upsampled
+// (stride^2 times less work), the upsample and the route layers do nothing.
+// The low resolution result is kept in the idle buffer of the upsample layer.
+void fuse_upsample_layers(network *net)
+{
+    int i, j;
+#ifdef GPU
+    if (gpu_index >= 0) return;
+#endif
+    net->fuse_upsamples = 1;
+    for (i = 3; i < net->n; ++i) {
+        layer *conv = &net->layers[i];
+        layer *route = &net->layers[i - 1];
+        layer *up = &net->layers[i - 2];
+        if (conv->type != CONVOLUTIONAL || route->type != ROUTE || up->type != UPSAMPLE) continue;
+        if (conv->size != 1 || conv->stride != 1 || conv->pad != 0 || conv->xnor || conv->binary) continue;
+        if (up->reverse || conv->n * up->w * up->h > up->outputs) continue;
+        int found = 0;
+        for (j = 0; j < route->n; ++j) found += (route->input_layers[j] == i - 2);
+        if (found != 1 || output_readers(net, i - 2) != 1 || output_is_read(net, i - 1)) continue;
+        up->fused_upsample = 1;
+        route->fused_upsample = 1;
+        conv->fused_upsample = 1;
+    }
+}
+
+void unfuse_upsample_layers(network *net)
+{
+    int i;
+    for (i = 0; i < net->n; ++i) net->layers[i].fused_upsample = 0;
+    net->fuse_upsamples = 0;
+}
@@ -62,6 +62,9 @@ typedef struct network{
 
     int gpu_index;
     tree *hierarchy;
+    int alias_routes;   // producers of route layers write into the route outputs (alias_route_layers)
+    int fuse_shortcuts; // shortcut layers are computed by the previous convolutional layers (fuse_shortcut_layers)
+    int fuse_upsamples; // upsample layers are read at low resolution by 1x1 convolutions (fuse_upsample_layers)
 
     #ifdef GPU
     float **input_gpu;
@@ -131,10 +134,13 @@ int get_predicted_class_network(network net);
 void print_network(network net);
 void visualize_network(network net);
 int resize_network(network *net, int w, int h);
+network make_network_context(network *net, int w, int h);
+void free_network_context(network ctx, network *net);
 void set_batch_network(network *net, int b);
 int get_network_input_size(network net);
 float get_network_cost(network net);
 YOLODLL_API detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter);
+YOLODLL_API detection *get_network_boxes_batch(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter);
 YOLODLL_API detection *make_network_boxes(network *net, float thresh, int *num);
 YOLODLL_API void free_detections(detection *dets, int n);
 YOLODLL_API void reset_rnn(network *net);
@@ -147,6 +153,13 @@ YOLODLL_API int network_height(network *net);
 int get_network_nuisance(network net);
 int get_network_background(network net);
 void fuse_conv_batchnorm(network net);
+size_t convert_weights_to_half(network net);
+void alias_route_layers(network *net);
+void unalias_route_layers(network *net);
+void fuse_shortcut_layers(network *net);
+void unfuse_shortcut_layers(network *net);
+void fuse_upsample_layers(network *net);
+void unfuse_upsample_layers(network *net);
 
 #ifdef __cplusplus
 }
@@ -1071,6 +1071,7 @@ void load_convolutional_weights_binary(layer l, FILE *fp)
             }
         }
     }
+    pack_binary_weights(l);
 #ifdef GPU
     if(gpu_index >= 0){
         push_convolutional_layer(l);
@@ -1116,6 +1117,7 @@ void load_convolutional_weights(layer l, FILE *fp)
         transpose_matrix(l.weights, l.c*l.size*l.size, l.n);
     }
     //if (l.binary) binarize_weights(l.weights, l.n, l.c*l.size*l.size, l.weights);
+    pack_binary_weights(l);
 #ifdef GPU
     if(gpu_index >= 0){
         push_convolutional_layer(l);
@@ -74,10 +74,15 @@ void forward_route_layer(const route_layer l, network_state state)
 {
     int i, j;
     int offset = 0;
+    if(l.fused_upsample) return;    // the next convolution reads the inputs (fuse_upsample_layers)
     for(i = 0; i < l.n; ++i){
         int index = l.input_layers[i];
         float *input = state.net.layers[index].output;
         int input_size = l.input_sizes[i];
+        if(input == l.output + offset){     // the input layer writes into its slice (alias_route_layers)
+            offset += input_size;
+            continue;
+        }
         for(j = 0; j < l.batch; ++j){
             copy_cpu(input_size, input + j*input_size, 1, l.output + offset + j*l.outputs, 1);
         }
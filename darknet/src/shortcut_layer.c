@@ -58,6 +58,7 @@ void resize_shortcut_layer(layer *l, int w, int h)
 
 void forward_shortcut_layer(const layer l, network_state state)
 {
+    if (state.input == l.output) return;    // computed by the previous convolutional layer (fuse_shortcut_layers)
     copy_cpu(l.outputs*l.batch, state.input, 1, l.output, 1);
     shortcut_cpu(l.batch, l.w, l.h, l.c, state.net.layers[l.index].output, l.out_w, l.out_h, l.out_c, l.output);
     activate_array(l.output, l.outputs*l.batch, l.activation);
@@ -67,11 +67,12 @@ void resize_upsample_layer(layer *l, int w, int h)
 
 void forward_upsample_layer(const layer l, network_state net)
 {
-    fill_cpu(l.outputs*l.batch, 0, l.output, 1);
+    if(l.fused_upsample) return;    // read at low resolution by the convolution after the route (fuse_upsample_layers)
     if(l.reverse){
+        fill_cpu(l.outputs*l.batch, 0, l.output, 1);
         upsample_cpu(l.output, l.out_w, l.out_h, l.c, l.batch, l.stride, 0, l.scale, net.input);
     }else{
-        upsample_cpu(net.input, l.w, l.h, l.c, l.batch, l.stride, 1, l.scale, l.output);
+        upsample_cpu(net.input, l.w, l.h, l.c, l.batch, l.stride, 1, l.scale, l.output);  // sets every output
     }
 }
 
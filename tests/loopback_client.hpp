@@ -0,0 +1,83 @@
+#ifndef _DARKNET_TESTS_LOOPBACK_CLIENT_HPP_
+#define _DARKNET_TESTS_LOOPBACK_CLIENT_HPP_
+
+// Blocking HTTP client of the loopback tests: every read gives up after timeout_ms, so a server which
+// doesn't answer fails the test instead of hanging it.
+
+#include <string>
+#include <cstring>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+class loopback_client_t {
+	int sock;
+public:
+	std::string buf;	// received and not consumed yet
+
+	loopback_client_t(int port, int timeout_ms = 5000) : sock(-1)
+	{
+		int const s = ::socket(AF_INET, SOCK_STREAM, 0);
+		if (s < 0) return;
+		struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+		::setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char const*)&tv, sizeof(tv));
+		::setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (char const*)&tv, sizeof(tv));
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (::connect(s, (struct sockaddr *)&addr, sizeof(addr)) == 0) sock = s;
+		else ::close(s);
+	}
+	~loopback_client_t() { if (sock >= 0) ::close(sock); }
+
+	bool is_connected() const { return sock >= 0; }
+
+	bool send(std::string const& data)
+	{
+		for (size_t sent = 0; sent < data.size();) {
+			ssize_t const n = ::send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0) return false;
+			sent += n;
+		}
+		return true;
+	}
+
+	// buf has at least size bytes, false - timeout or the connection is closed
+	bool recv_bytes(size_t size)
+	{
+		char tmp[4096];
+		while (buf.size() < size) {
+			ssize_t const n = ::recv(sock, tmp, sizeof(tmp), 0);
+			if (n <= 0) return false;
+			buf.append(tmp, n);
+		}
+		return true;
+	}
+
+	// buf up to and including delim (removed from buf), false - timeout or the connection is closed
+	bool recv_until(std::string const& delim, std::string &out)
+	{
+		size_t pos;
+		while ((pos = buf.find(delim)) == std::string::npos)
+			if (!recv_bytes(buf.size() + 1)) return false;
+		out = buf.substr(0, pos + delim.size());
+		buf.erase(0, pos + delim.size());
+		return true;
+	}
+
+	// everything till the server closes the connection (or timeout)
+	std::string recv_all()
+	{
+		while (recv_bytes(buf.size() + 1)) {}
+		std::string out;
+		out.swap(buf);
+		return out;
+	}
+};
+
+#endif	// _DARKNET_TESTS_LOOPBACK_CLIENT_HPP_
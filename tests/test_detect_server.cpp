@@ -0,0 +1,123 @@
+// detect_server_t (wrapper/detect_server.hpp) on the loopback: POST /detect with a JPEG body, with
+// "Expect: 100-continue", with a broken body, GET /stats and "Connection: close" on one keep-alive connection.
+// The network is a 32x32 max pool and a 1x1 convolution with zero weights in front of a [yolo] layer, so each
+// anchor of the 2 x 2 cells gives objectness 0.5 and class prob 0.5 (box prob 0.25) whatever the image is.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "darknet/src/stb_image_write.h"
+#include "wrapper/detect_server.hpp"
+#include "loopback_client.hpp"
+
+#define CHECK(cond) do { if (!(cond)) { std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond "\n"; return 1; } } while (0)
+
+static void append_bytes(void *context, void *data, int size)
+{
+	std::string *out = (std::string *)context;
+	out->append((char *)data, size);
+}
+
+static bool write_network(std::string const& cfg_filename, std::string const& weights_filename)
+{
+	std::ofstream cfg(cfg_filename.c_str());
+	cfg << "[net]\nbatch=1\nsubdivisions=1\nwidth=64\nheight=64\nchannels=3\n\n[maxpool]\nsize=32\nstride=32\n\n"
+		"[convolutional]\nfilters=18\nsize=1\nstride=1\npad=0\nactivation=linear\n\n"
+		"[yolo]\nmask=0,1,2\nanchors=10,14, 23,27, 37,58\nclasses=1\nnum=3\n";
+	cfg.close();
+	FILE *fp = fopen(weights_filename.c_str(), "wb");
+	if (!fp) return false;
+	int const version[3] = { 0, 2, 0 };
+	uint64_t const seen = 0;
+	std::vector<float> const params(18 + 18 * 3, 0);	// biases, weights
+	bool const written = fwrite(version, sizeof(int), 3, fp) == 3 && fwrite(&seen, sizeof(seen), 1, fp) == 1 &&
+		fwrite(params.data(), sizeof(float), params.size(), fp) == params.size();
+	return fclose(fp) == 0 && written && cfg.good();
+}
+
+// status line and headers (lower case) and the body of Content-Length
+static int read_response(loopback_client_t &client, std::string &head, std::string &body)
+{
+	CHECK(client.recv_until("\r\n\r\n", head));
+	for (auto &ch : head) ch = tolower(ch);
+	size_t const cl = head.find("\r\ncontent-length: ");
+	CHECK(cl != std::string::npos);
+	size_t const length = strtoul(head.c_str() + cl + 18, NULL, 10);
+	CHECK(client.recv_bytes(length));
+	body = client.buf.substr(0, length);
+	client.buf.erase(0, length);
+	return 0;
+}
+
+static size_t count(std::string const& s, std::string const& what)
+{
+	size_t n = 0;
+	for (size_t pos = s.find(what); pos != std::string::npos; pos = s.find(what, pos + 1)) ++n;
+	return n;
+}
+
+int main()
+{
+	std::string const cfg_filename = "test_detect_server_" + std::to_string(getpid()) + ".cfg";
+	std::string const weights_filename = "test_detect_server_" + std::to_string(getpid()) + ".weights";
+	CHECK(write_network(cfg_filename, weights_filename));
+	Detector detector(cfg_filename, weights_filename, 0, 4);
+	std::remove(cfg_filename.c_str());
+	std::remove(weights_filename.c_str());
+	int const port = 40000 + getpid() % 20000;
+	detect_server_t server(detector, port, 2, 4, 5, std::vector<std::string>(1, "thing"));
+	CHECK(server.is_opened());
+
+	std::vector<unsigned char> pixels(96 * 64 * 3, 128);
+	std::string jpeg;
+	CHECK(stbi_write_jpg_to_func(append_bytes, &jpeg, 96, 64, 3, pixels.data(), 80));
+	loopback_client_t client(port);
+	CHECK(client.is_connected());
+	std::string head, body;
+
+	// boxes in the pixels of the posted image: 2 x 2 cells * 3 anchors
+	CHECK(client.send("POST /detect?thresh=0.2 HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Type: image/jpeg\r\n"
+		"Content-Length: " + std::to_string(jpeg.size()) + "\r\n\r\n" + jpeg));
+	CHECK(read_response(client, head, body) == 0);
+	CHECK(head.find("http/1.1 200 ok\r\n") == 0);
+	CHECK(head.find("\r\ncontent-type: application/json") != std::string::npos);
+	CHECK(head.find("\r\nconnection: keep-alive") != std::string::npos);
+	CHECK(body.find("{\"width\":96,\"height\":64,\"boxes\":[{") == 0);
+	CHECK(body.substr(body.size() - 2) == "]}");
+	CHECK(count(body, "\"obj_id\":0,\"prob\":0.2500,") == 12);
+	CHECK(count(body, "\"name\":\"thing\"") == 12);
+	// the smallest anchor of the bottom-right cell, scaled from the 64x64 network input
+	CHECK(body.find("\"x\":64.5,\"y\":41.0,") != std::string::npos);
+
+	// the body is sent after "100 Continue", thresh is above the box prob
+	CHECK(client.send("POST /detect?thresh=0.3 HTTP/1.1\r\nHost: 127.0.0.1\r\nExpect: 100-continue\r\n"
+		"Content-Length: " + std::to_string(jpeg.size()) + "\r\n\r\n"));
+	CHECK(client.recv_until("\r\n\r\n", head));
+	CHECK(head == "HTTP/1.1 100 Continue\r\n\r\n");
+	CHECK(client.send(jpeg));
+	CHECK(read_response(client, head, body) == 0);
+	CHECK(head.find("http/1.1 200 ok\r\n") == 0);
+	CHECK(body == "{\"width\":96,\"height\":64,\"boxes\":[]}");
+
+	// a body which isn't an image
+	CHECK(client.send("POST /detect HTTP/1.1\r\nContent-Length: 9\r\n\r\nnot a jpg"));
+	CHECK(read_response(client, head, body) == 0);
+	CHECK(head.find("http/1.1 400 bad request\r\n") == 0);
+	CHECK(body.find("{\"error\":\"") == 0);
+
+	// the last request of the connection
+	CHECK(client.send("GET /stats HTTP/1.1\r\nConnection: close\r\n\r\n"));
+	CHECK(read_response(client, head, body) == 0);
+	CHECK(head.find("http/1.1 200 ok\r\n") == 0);
+	CHECK(head.find("\r\nconnection: close") != std::string::npos);
+	CHECK(body.find("{\"requests\":3,\"errors\":1,") == 0);
+	CHECK(body.find(",\"images\":2,") != std::string::npos);
+	CHECK(client.recv_all().empty());	// closed by the server
+
+	std::cout << "detect server: port " << port << ", " << body << " \n";
+	return 0;
+}
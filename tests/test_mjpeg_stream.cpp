@@ -0,0 +1,98 @@
+// MJPEG server of http_stream.cpp on the loopback: a client of the stream "cam" gets the multipart response
+// headers and the published JPEG frame byte for byte, a client which connects later gets the last frame.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "darknet/src/http_stream.h"
+#include "darknet/src/stb_image.h"
+#include "darknet/src/stb_image_write.h"
+#include "loopback_client.hpp"
+
+#define CHECK(cond) do { if (!(cond)) { std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond "\n"; return 1; } } while (0)
+
+static void append_bytes(void *context, void *data, int size)
+{
+	std::vector<unsigned char> *out = (std::vector<unsigned char> *)context;
+	out->insert(out->end(), (unsigned char *)data, (unsigned char *)data + size);
+}
+
+// waits until get_mjpeg_stats() gives the value
+static bool wait_stats(int port, int clients, unsigned long long frames_sent)
+{
+	for (int i = 0; i < 500; ++i) {
+		int c = 0;
+		unsigned long long sent = 0, dropped = 0;
+		get_mjpeg_stats(port, &c, &sent, &dropped);
+		if (c == clients && sent == frames_sent) return true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return false;
+}
+
+// one part of the multipart stream, 1 - it isn't the JPEG frame
+static int check_part(loopback_client_t &client, std::vector<unsigned char> const& jpeg)
+{
+	std::string head;
+	CHECK(client.recv_until("\r\n\r\n", head));
+	CHECK(head.find("--mjpegstream\r\n") == 0);
+	CHECK(head.find("Content-Type: image/jpeg\r\n") != std::string::npos);
+	size_t const length_pos = head.find("Content-Length: ");
+	CHECK(length_pos != std::string::npos);
+	size_t const length = strtoul(head.c_str() + length_pos + 16, NULL, 10);
+	CHECK(length == jpeg.size());
+	CHECK(client.recv_bytes(length));
+	std::vector<unsigned char> const frame(client.buf.begin(), client.buf.begin() + length);
+	client.buf.erase(0, length);
+	CHECK(frame == jpeg);
+	CHECK(frame[0] == 0xFF && frame[1] == 0xD8 && frame[length - 2] == 0xFF && frame[length - 1] == 0xD9);
+	int w = 0, h = 0, c = 0;
+	unsigned char *pixels = stbi_load_from_memory(frame.data(), (int)frame.size(), &w, &h, &c, 3);
+	CHECK(pixels != NULL);
+	stbi_image_free(pixels);
+	CHECK(w == 32 && h == 24);
+	return 0;
+}
+
+int main()
+{
+	int const port = 20000 + getpid() % 20000;
+	std::vector<unsigned char> pixels(32 * 24 * 3), jpeg;
+	for (size_t i = 0; i < pixels.size(); ++i) pixels[i] = (unsigned char)(i * 13);
+	CHECK(stbi_write_jpg_to_func(append_bytes, &jpeg, 32, 24, 3, pixels.data(), 80));
+
+	send_mjpeg_buffer(port, "cam", jpeg.data(), jpeg.size());	// starts the server, nobody gets it
+	CHECK(wait_stats(port, 0, 0));
+
+	loopback_client_t client(port);
+	CHECK(client.is_connected());
+	CHECK(client.send("GET /cam HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"));
+	CHECK(wait_stats(port, 1, 0));
+
+	std::vector<unsigned char> const other(100, 0x55);
+	send_mjpeg_buffer(port, "other", other.data(), other.size());
+	send_mjpeg_buffer(port, "cam", jpeg.data(), jpeg.size());
+
+	std::string head;
+	CHECK(client.recv_until("\r\n\r\n", head));
+	CHECK(head.find("HTTP/1.0 200 OK\r\n") == 0);
+	CHECK(head.find("Content-Type: multipart/x-mixed-replace; boundary=mjpegstream\r\n") != std::string::npos);
+	CHECK(check_part(client, jpeg) == 0);
+	CHECK(wait_stats(port, 1, 1));
+
+	// the last frame of the stream is sent to a new client right away
+	loopback_client_t late_client(port);
+	CHECK(late_client.is_connected());
+	CHECK(late_client.send("GET /cam HTTP/1.1\r\n\r\n"));
+	CHECK(late_client.recv_until("\r\n\r\n", head));
+	CHECK(head.find("HTTP/1.0 200 OK\r\n") == 0);
+	CHECK(check_part(late_client, jpeg) == 0);
+	CHECK(wait_stats(port, 2, 2));
+
+	std::cout << "mjpeg stream: " << jpeg.size() << " bytes frame on port " << port << " \n";
+	return 0;
+}
@@ -0,0 +1,165 @@
+// Two processes on the shm_ring_t rings (wrapper/shm_ring.hpp): the forked producer writes frames into
+// the frames ring, the consumer checks them in place and answers with boxes through the results ring.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "wrapper/shm_ring.hpp"
+
+#define CHECK(cond) do { if (!(cond)) { std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond "\n"; return 1; } } while (0)
+
+static uint64_t const frames_count = 50;
+static int const frame_w = 64, frame_h = 48;
+
+static unsigned char pixel(uint64_t id, int x, int y, int c) { return (unsigned char)(id * 7 + x * 3 + y * 5 + c); }
+
+// results which are ready within timeout_ms: one per frame, in order, id % 3 boxes
+static int read_results(shm_ring_t &results, uint64_t &next_id, int timeout_ms)
+{
+	uint64_t id = 0;
+	std::vector<bbox_t> boxes;
+	while (shm_read_boxes(results, id, boxes, timeout_ms)) {
+		CHECK(id == next_id);
+		CHECK(boxes.size() == id % 3);
+		for (size_t i = 0; i < boxes.size(); ++i) CHECK(boxes[i].obj_id == i && boxes[i].track_id == id);
+		++next_id;
+	}
+	return 0;
+}
+
+// decoder side: writes the frames without blocking on the results
+static int producer(std::string const& name)
+{
+	shm_ring_t frames, results;
+	CHECK(frames.create(name + "_frames", 4, frame_w * frame_h * 3));
+	CHECK(results.open(name + "_results", 5000));
+	uint64_t next_result = 0;
+	for (uint64_t id = 0; id < frames_count; ++id) {
+		auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		shm_slot_t *s = NULL;
+		while (!(s = frames.acquire(0))) {	// the consumer may wait for a free results slot
+			CHECK(std::chrono::steady_clock::now() < deadline);
+			CHECK(read_results(results, next_result, 10) == 0);
+		}
+		s->frame_id = id;
+		s->timestamp_us = id * 40000;
+		s->width = frame_w, s->height = frame_h, s->stride = frame_w * 3, s->format = PIXEL_BGR24;
+		s->bytes = s->stride * s->height;
+		for (int y = 0; y < frame_h; ++y)
+			for (int x = 0; x < frame_w; ++x)
+				for (int c = 0; c < 3; ++c) s->data()[y * s->stride + x * 3 + c] = pixel(id, x, y, c);
+		frames.commit();
+		CHECK(read_results(results, next_result, 0) == 0);
+	}
+	frames.finish();
+	CHECK(read_results(results, next_result, 5000) == 0);	// till the consumer finishes the results
+	CHECK(next_result == frames_count);
+	return 0;
+}
+
+// detector side: the frames in order and intact, boxes for each of them
+static int consumer(std::string const& name)
+{
+	shm_ring_t frames, results;
+	CHECK(results.create(name + "_results", 2, 4 * sizeof(bbox_t)));
+	CHECK(frames.open(name + "_frames", 5000));
+	CHECK(frames.slot_count() == 4);
+	uint64_t next_id = 0;
+	while (shm_slot_t *s = frames.wait_slot(5000)) {
+		CHECK(s->frame_id == next_id && s->timestamp_us == (int64_t)next_id * 40000);
+		CHECK(s->width == frame_w && s->height == frame_h && s->format == PIXEL_BGR24);
+		for (int y = 0; y < frame_h; ++y)
+			for (int x = 0; x < frame_w; ++x)
+				for (int c = 0; c < 3; ++c) CHECK(s->data()[y * s->stride + x * 3 + c] == pixel(next_id, x, y, c));
+		frames.release();
+		std::vector<bbox_t> boxes(next_id % 3);
+		for (size_t i = 0; i < boxes.size(); ++i) {
+			memset(&boxes[i], 0, sizeof(bbox_t));
+			boxes[i].obj_id = i;
+			boxes[i].track_id = next_id;
+		}
+		CHECK(shm_write_boxes(results, next_id, 0, boxes, 5000));
+		++next_id;
+	}
+	CHECK(frames.is_finished());
+	CHECK(next_id == frames_count);
+	results.finish();
+	return 0;
+}
+
+// a header which puts the slots outside the shared memory object isn't opened, a boxes slot gives at most
+// the slot capacity of boxes
+static int corrupted_ring(std::string const& name)
+{
+	shm_ring_t ring, reader;
+	CHECK(ring.create(name, 2, 256));
+	int const fd = shm_open(("/" + name).c_str(), O_RDWR, 0600);
+	CHECK(fd >= 0);
+	struct stat st;
+	CHECK(fstat(fd, &st) == 0);
+	void *ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	CHECK(ptr != MAP_FAILED);
+	shm_ring_header_t *h = (shm_ring_header_t *)ptr;
+
+	uint32_t const slot_count = h->slot_count;
+	uint64_t const slot_bytes = h->slot_bytes, slot_stride = h->slot_stride;
+	h->slot_count = 0;
+	CHECK(!reader.open(name));
+	h->slot_count = slot_count + 1;
+	CHECK(!reader.open(name));
+	h->slot_count = slot_count;
+	h->slot_bytes = slot_stride;
+	CHECK(!reader.open(name));
+	h->slot_bytes = slot_bytes;
+	h->slot_stride = slot_stride * 1024;
+	CHECK(!reader.open(name));
+	h->slot_stride = slot_stride;
+	CHECK(reader.open(name));
+	munmap(ptr, st.st_size);
+
+	shm_slot_t *s = ring.acquire();
+	CHECK(s != NULL);
+	s->frame_id = 1;
+	s->format = SHM_FORMAT_BOXES;
+	s->count = 1000000;
+	ring.commit();
+	s = ring.acquire();
+	CHECK(s != NULL);
+	s->frame_id = 2;
+	s->format = PIXEL_BGR24;
+	s->count = 1;
+	ring.commit();
+	uint64_t id = 0;
+	std::vector<bbox_t> boxes;
+	CHECK(shm_read_boxes(reader, id, boxes, 1000));
+	CHECK(id == 1 && boxes.size() == 256 / sizeof(bbox_t));
+	CHECK(shm_read_boxes(reader, id, boxes, 1000));
+	CHECK(id == 2 && boxes.empty());
+	return 0;
+}
+
+int main()
+{
+	std::string const name = "dk_test_ring_" + std::to_string(getpid());
+	if (corrupted_ring(name)) return 1;
+
+	pid_t const pid = fork();
+	if (pid < 0) return 1;
+	if (pid == 0) _exit(producer(name));
+	int const consumed = consumer(name);
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (consumed || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		std::cerr << "consumer: " << consumed << ", producer: " << status << "\n";
+		return 1;
+	}
+	std::cout << "shm ring: " << frames_count << " frames \n";
+	return 0;
+}
@@ -0,0 +1,231 @@
+#ifndef _DARKNET_WRAPPER_BATCH_LIST_HPP_
+#define _DARKNET_WRAPPER_BATCH_LIST_HPP_
+
+#ifdef __cplusplus
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#endif
+
+#include "box_image.h"
+#include "detector.hpp"
+#include "result_cache.hpp"
+
+struct batch_list_stats_t {
+	size_t images, failed;
+	size_t cached;			// results of the result cache
+	double wall_sec;
+	double decode_sec, infer_sec, write_sec;	// busy time of the stages (decode - sum of the threads)
+	int decode_threads;
+	double throughput() const { return wall_sec > 0 ? images / wall_sec : 0; }
+	double decode_utilization() const { return wall_sec > 0 ? decode_sec / (decode_threads * wall_sec) : 0; }
+	double infer_utilization() const { return wall_sec > 0 ? infer_sec / wall_sec : 0; }
+	double write_utilization() const { return wall_sec > 0 ? write_sec / wall_sec : 0; }
+};
+
+// Offline detection of a list of image files: decode threads decode each file at reduced size
+// (Detector::load_image_into) straight into a free slot of network size, the infer thread runs
+// Detector::detect_batch() on the ready slots while the next images are decoded, the results are
+// written in the order of the list, one JSON line per image:
+//   {"path":"a.jpg","width":1920,"height":1080,"boxes":[{"obj_id":0,"prob":0.9,"x":1,"y":2,"w":3,"h":4}]}
+// The slots are allocated once, there are 2 * max_batch + decode_threads of them.
+// With a result_cache_t the decoded slots already in the cache don't go through the network.
+class batch_list_t {
+	typedef std::chrono::steady_clock clock_type;
+
+	struct slot_t {
+		size_t index;		// in the list
+		image_t img;		// network size
+		int orig_w, orig_h;
+		bool ok;
+	};
+
+	Detector &detector;
+	int const decode_threads;
+	std::vector<std::string> const obj_names;
+
+public:
+	float thresh;
+	result_cache_t *cache;		// NULL - no cache
+
+	batch_list_t(Detector &_detector, int _decode_threads = 4,
+		std::vector<std::string> const& _obj_names = std::vector<std::string>(), float _thresh = 0.25F,
+		result_cache_t *_cache = NULL) :
+		detector(_detector), decode_threads(std::max(1, _decode_threads)), obj_names(_obj_names), thresh(_thresh),
+		cache(_cache)
+	{}
+
+	batch_list_stats_t process(std::string const& list_filename, std::string const& out_filename)
+	{
+		batch_list_stats_t stats = batch_list_stats_t();
+		stats.decode_threads = decode_threads;
+		std::vector<std::string> paths;
+		std::ifstream list_file(list_filename);
+		for (std::string line; getline(list_file, line);) {
+			while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+			if (!line.empty()) paths.push_back(line);
+		}
+		FILE *out = fopen(out_filename.c_str(), "wb");
+		if (!out) throw std::runtime_error("can't create " + out_filename);
+
+		int const net_w = detector.get_net_width(), net_h = detector.get_net_height();
+		int const max_batch = detector.get_max_batch();
+		size_t const image_size = (size_t)net_w * net_h * 3;
+		size_t const slot_count = 2 * max_batch + decode_threads;
+		std::vector<float> slot_memory(slot_count * image_size);
+		std::vector<slot_t> slots(slot_count);
+		std::vector<slot_t*> free_slots, ready_slots;
+		for (size_t i = 0; i < slot_count; ++i) {
+			slots[i].img.w = net_w;
+			slots[i].img.h = net_h;
+			slots[i].img.c = 3;
+			slots[i].img.data = slot_memory.data() + i * image_size;
+			free_slots.push_back(&slots[i]);
+		}
+
+		std::mutex mtx;
+		std::condition_variable cv_free, cv_ready;
+		size_t next_index = 0, decoded = 0;
+		std::vector<double> decode_busy(decode_threads, 0);
+		auto const start = clock_type::now();
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < decode_threads; ++t) {
+			threads.push_back(std::thread([&, t]() {
+				for (;;) {
+					slot_t *slot;
+					{
+						std::unique_lock<std::mutex> lock(mtx);
+						while (free_slots.empty() && next_index < paths.size()) cv_free.wait(lock);
+						if (next_index >= paths.size()) return;
+						slot = free_slots.back();
+						free_slots.pop_back();
+						slot->index = next_index++;
+					}
+					auto const t0 = clock_type::now();
+					slot->ok = Detector::load_image_into(paths[slot->index], slot->img, slot->orig_w, slot->orig_h);
+					decode_busy[t] += std::chrono::duration<double>(clock_type::now() - t0).count();
+					{
+						std::lock_guard<std::mutex> lock(mtx);
+						ready_slots.push_back(slot);
+						++decoded;
+					}
+					cv_ready.notify_one();
+				}
+			}));
+		}
+
+		// results which wait for the previous images of the list
+		std::map<size_t, std::string> pending_lines;
+		size_t next_write = 0;
+		while (next_write < paths.size()) {
+			std::vector<slot_t*> batch;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				// a full batch, or whatever is ready when nothing more can be decoded
+				while (ready_slots.size() < (size_t)max_batch && decoded < paths.size() && !free_slots.empty())
+					cv_ready.wait(lock);
+				while (ready_slots.empty()) cv_ready.wait(lock);
+				size_t const n = std::min(ready_slots.size(), (size_t)max_batch);
+				batch.assign(ready_slots.begin(), ready_slots.begin() + n);
+				ready_slots.erase(ready_slots.begin(), ready_slots.begin() + n);
+			}
+
+			auto const t0 = clock_type::now();
+			std::vector<uint64_t> key_vec(batch.size());
+			std::vector<std::vector<bbox_t>> result_vec(batch.size());
+			std::vector<image_t> img_vec;
+			std::vector<size_t> detect_vec;		// in the batch
+			for (size_t i = 0; i < batch.size(); ++i) {
+				if (!batch[i]->ok) continue;
+				if (cache) {
+					key_vec[i] = cache->key(batch[i]->img, thresh, detector.nms, net_w, net_h);
+					if (cache->get(key_vec[i], result_vec[i])) {
+						++stats.cached;
+						continue;
+					}
+				}
+				img_vec.push_back(batch[i]->img);
+				detect_vec.push_back(i);
+			}
+			if (!img_vec.empty()) {
+				std::vector<std::vector<bbox_t>> detected_vec = detector.detect_batch(img_vec, thresh);
+				for (size_t k = 0; k < detect_vec.size(); ++k) {
+					result_vec[detect_vec[k]].swap(detected_vec[k]);
+					if (cache) cache->put(key_vec[detect_vec[k]], result_vec[detect_vec[k]]);
+				}
+			}
+			auto const t1 = clock_type::now();
+			stats.infer_sec += std::chrono::duration<double>(t1 - t0).count();
+
+			for (size_t i = 0; i < batch.size(); ++i) {
+				slot_t *s = batch[i];
+				if (s->ok) pending_lines[s->index] = json_line(paths[s->index], *s, result_vec[i]);
+				else {
+					pending_lines[s->index] = "{\"path\":\"" + json_escape(paths[s->index]) + "\",\"error\":\"can't decode\"}";
+					++stats.failed;
+				}
+			}
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				for (auto s : batch) free_slots.push_back(s);
+			}
+			cv_free.notify_all();
+			for (auto i = pending_lines.begin(); i != pending_lines.end() && i->first == next_write; i = pending_lines.erase(i)) {
+				fputs(i->second.c_str(), out);
+				fputc('\n', out);
+				++next_write;
+			}
+			stats.write_sec += std::chrono::duration<double>(clock_type::now() - t1).count();
+		}
+		for (auto &t : threads) t.join();
+		fclose(out);
+
+		stats.images = paths.size();
+		stats.wall_sec = std::chrono::duration<double>(clock_type::now() - start).count();
+		for (double d : decode_busy) stats.decode_sec += d;
+		return stats;
+	}
+
+private:
+	static std::string json_escape(std::string const& s)
+	{
+		std::string out;
+		for (char c : s) {
+			if (c == '"' || c == '\\') out += '\\';
+			if ((unsigned char)c >= 0x20) out += c;
+		}
+		return out;
+	}
+
+	// boxes of the network-size slot in the pixels of the original image
+	std::string json_line(std::string const& path, slot_t const& slot, std::vector<bbox_t> const& boxes) const
+	{
+		float const wk = (float)slot.orig_w / slot.img.w, hk = (float)slot.orig_h / slot.img.h;
+		char buf[256];
+		std::string s = "{\"path\":\"" + json_escape(path) + "\",";
+		sprintf(buf, "\"width\":%d,\"height\":%d,\"boxes\":[", slot.orig_w, slot.orig_h);
+		s += buf;
+		for (size_t i = 0; i < boxes.size(); ++i) {
+			bbox_t const& b = boxes[i];
+			sprintf(buf, "%s{\"obj_id\":%u,\"prob\":%.4f,\"x\":%.1f,\"y\":%.1f,\"w\":%.1f,\"h\":%.1f", i ? "," : "",
+				b.obj_id, b.prob, b.x * wk, b.y * hk, b.w * wk, b.h * hk);
+			s += buf;
+			if (b.obj_id < obj_names.size()) s += ",\"name\":\"" + json_escape(obj_names[b.obj_id]) + "\"";
+			s += "}";
+		}
+		return s + "]}";
+	}
+};
+
+#endif	// _DARKNET_WRAPPER_BATCH_LIST_HPP_
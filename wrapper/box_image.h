@@ -16,4 +16,13 @@ struct image_t {
 	float *data;				// pointer to the image data
 };
 
+// layout of 8-bit interleaved pixels
+enum pixel_format_t {
+	PIXEL_RGB24 = 0,
+	PIXEL_BGR24 = 1,			// OpenCV
+	PIXEL_RGBA32 = 2,
+	PIXEL_BGRA32 = 3,
+	PIXEL_GRAY8 = 4
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,199 @@
+#ifndef _DARKNET_WRAPPER_CASCADE_DETECT_HPP_
+#define _DARKNET_WRAPPER_CASCADE_DETECT_HPP_
+
+#ifdef __cplusplus
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#endif
+
+#ifdef OPENCV
+#include <opencv2/opencv.hpp>			// C++
+#endif	// OPENCV
+
+#include "box_image.h"
+#include "detector.hpp"
+
+struct cascade_stats_t {
+	unsigned long long frames;
+	unsigned long long escalated_frames;	// the full model was run
+	unsigned long long regions;				// images of the full model
+	double screen_sec, full_sec;			// total time of the stages
+	double escalation_rate() const { return frames ? (double)escalated_frames / frames : 0; }
+	double screen_latency() const { return frames ? screen_sec / frames : 0; }
+	double full_latency() const { return escalated_frames ? full_sec / escalated_frames : 0; }
+};
+
+// Two-stage detection: the cheap screen model (yolov2-tiny) runs on the whole frame, its boxes with
+// prob >= accept_thresh are kept as they are, boxes with candidate_thresh <= prob < accept_thresh are escalated:
+// they are padded, grown to at least the input size of the full model (objects aren't upscaled), merged
+// when they overlap and the regions are detected by the full model in one Detector::detect_batch().
+// If the regions cover most of the frame the full model runs on the whole frame instead.
+// Boxes of the full model which are cut by a region border are dropped, the rest are merged with the accepted
+// screen boxes by NMS. Both models have to be trained on the same classes.
+class cascade_detect_t {
+	Detector &screen_detector;
+	Detector &full_detector;
+
+	struct rect_t { int x, y, w, h; };
+
+	static image_t crop_image(image_t img, rect_t r)
+	{
+		image_t out;
+		out.w = r.w;
+		out.h = r.h;
+		out.c = img.c;
+		out.data = (float *)calloc((size_t)r.w * r.h * img.c, sizeof(float));
+		for (int k = 0; k < img.c; ++k)
+			for (int y = 0; y < r.h; ++y)
+				memcpy(out.data + ((size_t)k * r.h + y) * r.w, img.data + ((size_t)k * img.h + r.y + y) * img.w + r.x, r.w * sizeof(float));
+		return out;
+	}
+
+	static float box_iou(bbox_t const& a, bbox_t const& b)
+	{
+		float const w = std::min(a.x + a.w, b.x + b.w) - (float)std::max(a.x, b.x);
+		float const h = std::min(a.y + a.h, b.y + b.h) - (float)std::max(a.y, b.y);
+		if (w <= 0 || h <= 0) return 0;
+		float const inter = w * h;
+		return inter / ((float)a.w * a.h + (float)b.w * b.h - inter);
+	}
+
+	// padded candidate boxes of at least min_w x min_h, overlapping regions are joined
+	std::vector<rect_t> make_regions(std::vector<bbox_t> const& candidates, int frame_w, int frame_h) const
+	{
+		int const min_w = std::min(frame_w, full_detector.get_net_width());
+		int const min_h = std::min(frame_h, full_detector.get_net_height());
+		std::vector<rect_t> regions;
+		for (auto &b : candidates) {
+			int const pad_w = b.w * pad, pad_h = b.h * pad;
+			int x0 = (int)b.x - pad_w, y0 = (int)b.y - pad_h;
+			int x1 = b.x + b.w + pad_w, y1 = b.y + b.h + pad_h;
+			grow(x0, x1, min_w, frame_w);
+			grow(y0, y1, min_h, frame_h);
+			rect_t r = { x0, y0, x1 - x0, y1 - y0 };
+			regions.push_back(r);
+		}
+		for (bool joined = true; joined;) {
+			joined = false;
+			for (size_t i = 0; i < regions.size() && !joined; ++i) {
+				for (size_t k = i + 1; k < regions.size() && !joined; ++k) {
+					rect_t &a = regions[i], &b = regions[k];
+					if (a.x >= b.x + b.w || b.x >= a.x + a.w || a.y >= b.y + b.h || b.y >= a.y + a.h) continue;
+					int const x0 = std::min(a.x, b.x), y0 = std::min(a.y, b.y);
+					int const x1 = std::max(a.x + a.w, b.x + b.w), y1 = std::max(a.y + a.h, b.y + b.h);
+					a.x = x0, a.y = y0, a.w = x1 - x0, a.h = y1 - y0;
+					regions.erase(regions.begin() + k);
+					joined = true;
+				}
+			}
+		}
+		return regions;
+	}
+
+	// [v0, v1) is grown around its center to at least min_size and shifted into [0, size)
+	static void grow(int &v0, int &v1, int min_size, int size)
+	{
+		if (v1 - v0 < min_size) {
+			int const c = (v0 + v1) / 2;
+			v0 = c - min_size / 2;
+			v1 = v0 + min_size;
+		}
+		if (v0 < 0) v1 -= v0, v0 = 0;
+		if (v1 > size) v0 -= v1 - size, v1 = size;
+		v0 = std::max(0, v0);
+	}
+
+public:
+	float candidate_thresh;		// screen boxes which may be objects
+	float accept_thresh;		// screen boxes which are accepted without the full model (> 1 - escalate all)
+	float thresh;				// full model
+	float pad;					// part of the box size added on each side of a candidate
+	float max_region_part;		// larger part of the frame in the regions - the full model runs on the whole frame
+	float nms;
+	cascade_stats_t stats;
+
+	cascade_detect_t(Detector &_screen_detector, Detector &_full_detector, float _candidate_thresh = 0.1F,
+		float _accept_thresh = 0.7F, float _thresh = 0.25F) :
+		screen_detector(_screen_detector), full_detector(_full_detector), candidate_thresh(_candidate_thresh),
+		accept_thresh(_accept_thresh), thresh(_thresh), pad(0.5F), max_region_part(0.6F), nms(0.45F)
+	{
+		memset(&stats, 0, sizeof(stats));
+	}
+
+	std::vector<bbox_t> detect(image_t img)
+	{
+		if (img.data == NULL)
+			throw std::runtime_error("Image is empty");
+		auto const screen_start = std::chrono::steady_clock::now();
+		std::vector<bbox_t> const screen_vec = screen_detector.detect(img, candidate_thresh);
+		std::chrono::duration<double> const screen_spent = std::chrono::steady_clock::now() - screen_start;
+		++stats.frames;
+		stats.screen_sec += screen_spent.count();
+
+		std::vector<bbox_t> result_vec, candidates;
+		for (auto &b : screen_vec) {
+			if (b.prob >= accept_thresh) result_vec.push_back(b);
+			else candidates.push_back(b);
+		}
+		if (candidates.empty()) return result_vec;
+
+		auto const full_start = std::chrono::steady_clock::now();
+		std::vector<rect_t> regions = make_regions(candidates, img.w, img.h);
+		long long area = 0;
+		for (auto &r : regions) area += (long long)r.w * r.h;
+		if (area > max_region_part * img.w * img.h) {
+			rect_t const whole = { 0, 0, img.w, img.h };
+			regions.assign(1, whole);
+		}
+		std::vector<image_t> crop_vec;
+		for (auto &r : regions)
+			crop_vec.push_back((r.w == img.w && r.h == img.h) ? img : crop_image(img, r));
+		std::vector<std::vector<bbox_t>> full_vec = full_detector.detect_batch(crop_vec, thresh);
+		for (auto &c : crop_vec)
+			if (c.data != img.data) Detector::free_image(c);
+
+		int const border = 2;	// px, a box closer to an inner region border is cut by the region
+		for (size_t i = 0; i < regions.size(); ++i) {
+			rect_t const& r = regions[i];
+			for (auto b : full_vec[i]) {
+				if ((r.x > 0 && (int)b.x < border) || (r.y > 0 && (int)b.y < border) ||
+					(r.x + r.w < img.w && (int)(b.x + b.w) > r.w - border) ||
+					(r.y + r.h < img.h && (int)(b.y + b.h) > r.h - border)) continue;
+				b.x += r.x;
+				b.y += r.y;
+				result_vec.push_back(b);
+			}
+		}
+
+		// the accepted screen boxes and the full model boxes of the same objects
+		std::sort(result_vec.begin(), result_vec.end(), [](bbox_t const& a, bbox_t const& b) { return a.prob > b.prob; });
+		std::vector<bbox_t> merged_vec;
+		for (auto &b : result_vec) {
+			bool duplicate = false;
+			for (auto &m : merged_vec)
+				if (m.obj_id == b.obj_id && box_iou(m, b) > nms) duplicate = true;
+			if (!duplicate) merged_vec.push_back(b);
+		}
+
+		std::chrono::duration<double> const full_spent = std::chrono::steady_clock::now() - full_start;
+		++stats.escalated_frames;
+		stats.regions += regions.size();
+		stats.full_sec += full_spent.count();
+		return merged_vec;
+	}
+
+#ifdef OPENCV
+	std::vector<bbox_t> detect(cv::Mat mat)
+	{
+		if (mat.data == NULL)
+			throw std::runtime_error("Image is empty");
+		auto image_ptr = Detector::mat_to_image(mat);
+		return detect(*image_ptr);
+	}
+#endif	// OPENCV
+};
+
+#endif	// _DARKNET_WRAPPER_CASCADE_DETECT_HPP_
@@ -0,0 +1,122 @@
+#ifndef _DARKNET_WRAPPER_DETECT_SCHEDULER_HPP_
+#define _DARKNET_WRAPPER_DETECT_SCHEDULER_HPP_
+
+#ifdef __cplusplus
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#endif
+
+#include "box_image.h"
+
+// Decides for each frame of a stream whether to run the full detector or only to propagate
+// the previous boxes (Tracker_optflow / extrapolate_coords_t).
+// The detector runs every N-th frame, N is adapted from:
+//  - measured latency of detection and propagation - the average compute time per output frame
+//    has to fit into latency_budget, and the detector has to finish within N frames at target_fps
+//  - scene motion (center shift of the tracked boxes between consecutive frames, relative to box size) -
+//    fast motion decreases N
+//  - track confidence (mean prob * part of the boxes that survived propagation) - low confidence decreases N,
+//    below min_confidence the detector is started on the next frame
+// All methods are called from the thread that shows/writes the frames.
+class detect_scheduler_t {
+	double const frame_period;		// 1 / target_fps, sec
+	double const latency_budget;	// average compute time per output frame allowed for this stream, sec
+	int const min_n, max_n;
+	float const motion_ref;			// motion at which the quality limit of N is halved
+	float const min_confidence;
+
+	double detect_latency, propagate_latency;	// moving average, sec
+	float motion, confidence;
+	int n, frames_since_detect;
+
+	static double ema(double avg, double val) { return (avg < 0) ? val : (0.8 * avg + 0.2 * val); }
+
+	void update_n()
+	{
+		int n_latency = min_n;
+		if (detect_latency > 0) {
+			// (detect + (N-1)*propagate) / N <= budget
+			double const budget_margin = latency_budget - std::max(0.0, propagate_latency);
+			if (budget_margin > 0)
+				n_latency = (int)std::ceil((detect_latency - std::max(0.0, propagate_latency)) / budget_margin);
+			else n_latency = max_n;
+			// frames which pass while the detector works
+			n_latency = std::max(n_latency, (int)std::ceil(detect_latency / frame_period));
+		}
+		int const n_quality = (int)(max_n * confidence / (1.0F + motion / motion_ref));
+		n = std::max(min_n, std::min(max_n, std::max(n_latency, n_quality)));
+	}
+
+public:
+	unsigned long long detected_frames, propagated_frames;
+
+	detect_scheduler_t(double target_fps = 25, double _latency_budget = 0.02, int _min_n = 1, int _max_n = 30,
+		float _motion_ref = 0.05F, float _min_confidence = 0.3F) :
+		frame_period(1.0 / std::max(1.0, target_fps)), latency_budget(_latency_budget),
+		min_n(std::max(1, _min_n)), max_n(std::max(std::max(1, _min_n), _max_n)),
+		motion_ref(_motion_ref), min_confidence(_min_confidence),
+		detect_latency(-1), propagate_latency(-1), motion(0), confidence(0),
+		n(min_n), frames_since_detect(0), detected_frames(0), propagated_frames(0)
+	{}
+
+	// true - the full detector should be started on the current frame
+	bool need_detect() const {
+		return frames_since_detect + 1 >= n || confidence < min_confidence;
+	}
+
+	// counts the frame as detected or propagated
+	void frame_done(bool detected) {
+		if (detected) ++detected_frames, frames_since_detect = 0;
+		else ++propagated_frames, ++frames_since_detect;
+	}
+
+	// result of the detector and the time it spent on one frame
+	void detected(std::vector<bbox_t> const& result_vec, double latency_sec)
+	{
+		detect_latency = ema(detect_latency, latency_sec);
+		float prob_sum = 0;
+		for (auto &i : result_vec) prob_sum += i.prob;
+		// empty scene - nothing to lose between detections
+		confidence = (result_vec.size() > 0) ? (prob_sum / result_vec.size()) : 1.0F;
+		update_n();
+	}
+
+	// boxes of the previous frame (detected or propagated), the boxes propagated to the current frame and the time
+	// spent on it - the shift is measured over one frame, not since the last detection
+	void propagated(std::vector<bbox_t> const& old_vec, std::vector<bbox_t> const& new_vec, double latency_sec)
+	{
+		propagate_latency = ema(propagate_latency, latency_sec);
+
+		float motion_sum = 0, prob_sum = 0;
+		size_t found = 0;
+		for (auto &i : old_vec) {
+			auto it = std::find_if(new_vec.begin(), new_vec.end(),
+				[&i](bbox_t const& b) { return b.track_id == i.track_id && b.obj_id == i.obj_id; });
+			if (it == new_vec.end()) continue;
+			float const dx = ((float)it->x + it->w / 2.0F) - ((float)i.x + i.w / 2.0F);
+			float const dy = ((float)it->y + it->h / 2.0F) - ((float)i.y + i.h / 2.0F);
+			float const size = std::max(1.0F, (float)std::max(i.w, i.h));
+			motion_sum += std::sqrt(dx*dx + dy*dy) / size;
+			prob_sum += it->prob;
+			++found;
+		}
+		if (old_vec.size() > 0) {
+			motion = 0.5F * motion + 0.5F * ((found > 0) ? (motion_sum / found) : 0);
+			confidence = std::min(confidence, (found > 0) ? (prob_sum / old_vec.size()) : 0.0F);
+		}
+		update_n();
+	}
+
+	int get_n() const { return n; }
+	float get_motion() const { return motion; }
+	float get_confidence() const { return confidence; }
+	double get_detect_latency() const { return std::max(0.0, detect_latency); }
+	double get_propagate_latency() const { return std::max(0.0, propagate_latency); }
+	float detected_part() const {
+		unsigned long long const total = detected_frames + propagated_frames;
+		return (total > 0) ? ((float)detected_frames / total) : 0;
+	}
+};
+
+#endif
@@ -0,0 +1,534 @@
+#ifndef _DARKNET_WRAPPER_DETECT_SERVER_HPP_
+#define _DARKNET_WRAPPER_DETECT_SERVER_HPP_
+
+#include "darknet/src/http_socket.hpp"
+
+#ifdef __cplusplus
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#endif
+
+#include "box_image.h"
+#include "detector.hpp"
+
+// HTTP inference server on localhost:
+//   POST /detect[?thresh=0.25]  body - encoded image (JPEG, PNG, ...), answer - JSON with the boxes in image pixels
+//   GET /stats                  JSON with request / batch counters, latency and batch size histograms
+// One IO thread serves all connections (keep-alive) over non-blocking sockets, images are decoded and resized
+// to the network size by a pool of decode threads, the batch thread coalesces decoded requests into one
+// Detector::detect_batch() call: the batch is started when max_batch images are ready or when the oldest one
+// has waited max_wait_ms. Only the batch thread uses the Detector.
+class detect_server_t {
+	typedef std::chrono::steady_clock server_clock;
+
+	struct job_t {
+		unsigned long long conn_id;
+		std::string body;
+		float thresh;
+		server_clock::time_point received, decoded;
+		image_t img;				// network size
+		int orig_w, orig_h;
+	};
+	typedef std::shared_ptr<job_t> job_ptr;
+
+	struct conn_t {
+		unsigned long long id;
+		std::string in, out;
+		size_t sent;
+		bool busy;					// the request is being detected, next requests wait in "in"
+		bool close_after;			// close when "out" is sent
+		bool want_write;
+		bool continue_sent;			// "100 Continue" is sent for the request at the head of "in"
+	};
+
+	Detector &detector;
+	int const max_batch;
+	int const max_wait_ms;
+	std::vector<std::string> const obj_names;
+
+	SOCKET sock;
+	socket_poller_t poller;
+	std::map<SOCKET, conn_t> conns;
+	std::map<unsigned long long, SOCKET> conn_socks;
+	unsigned long long next_conn_id;
+	int wake_pipe[2];
+
+	std::atomic<bool> stop;
+	std::thread io_thread, batch_thread;
+	std::vector<std::thread> decode_threads;
+
+	std::mutex queue_mutex;
+	std::condition_variable decode_cv, batch_cv;
+	std::deque<job_ptr> decode_queue, batch_queue;
+
+	std::mutex response_mutex;
+	std::vector<std::pair<unsigned long long, std::string>> responses;	// ready for the IO thread
+
+	static size_t const max_body = 64 * 1024 * 1024;
+	static int const latency_buckets = 13;
+
+	std::mutex stats_mutex;
+	unsigned long long requests, errors, batches, images;
+	double latency_sum;					// sec
+	std::vector<unsigned long long> batch_hist;	// [n] - batches of n images
+	unsigned long long latency_hist[latency_buckets];
+
+	// upper bounds of the latency histogram, ms (the last bucket has no bound)
+	static double latency_bound(int i) {
+		static double const bounds[latency_buckets - 1] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+		return bounds[i];
+	}
+
+public:
+	detect_server_t(Detector &_detector, int port, int decode_thread_count = 2, int _max_batch = 0, int _max_wait_ms = 5,
+		std::vector<std::string> const& _obj_names = std::vector<std::string>()) :
+		detector(_detector), max_batch((_max_batch > 0) ? _max_batch : _detector.get_max_batch()),
+		max_wait_ms(std::max(0, _max_wait_ms)), obj_names(_obj_names), next_conn_id(1), stop(false),
+		requests(0), errors(0), batches(0), images(0), latency_sum(0), batch_hist(max_batch + 1, 0)
+	{
+		std::fill(latency_hist, latency_hist + latency_buckets, 0);
+		wake_pipe[0] = wake_pipe[1] = -1;
+		sock = open_listen_socket(port, true);
+		if (sock == INVALID_SOCKET) return;
+		poller.add(sock, false);
+#ifdef __linux__
+		if (::pipe(wake_pipe) == 0) {
+			set_nonblocking(wake_pipe[0]);
+			set_nonblocking(wake_pipe[1]);
+			poller.add(wake_pipe[0], false);
+		}
+		else wake_pipe[0] = wake_pipe[1] = -1;
+#endif
+		for (int i = 0; i < std::max(1, decode_thread_count); ++i)
+			decode_threads.push_back(std::thread(&detect_server_t::decode_loop, this));
+		batch_thread = std::thread(&detect_server_t::batch_loop, this);
+		io_thread = std::thread(&detect_server_t::io_loop, this);
+	}
+
+	~detect_server_t()
+	{
+		{
+			std::lock_guard<std::mutex> lock(queue_mutex);
+			stop = true;
+		}
+		decode_cv.notify_all();
+		batch_cv.notify_all();
+		wake();
+		if (io_thread.joinable()) io_thread.join();
+		if (batch_thread.joinable()) batch_thread.join();
+		for (auto &t : decode_threads) t.join();
+		for (auto &j : batch_queue) Detector::free_image(j->img);
+		for (auto &i : conns) close_socket(i.first);
+		if (sock != INVALID_SOCKET) close_socket(sock);
+#ifdef __linux__
+		if (wake_pipe[0] >= 0) {
+			::close(wake_pipe[0]);
+			::close(wake_pipe[1]);
+		}
+#endif
+	}
+
+	bool is_opened() const { return sock != INVALID_SOCKET; }
+
+	std::string stats_json()
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		unsigned long long answered = 0;
+		for (int i = 0; i < latency_buckets; ++i) answered += latency_hist[i];
+		char buf[256];
+		sprintf(buf, "{\"requests\":%llu,\"errors\":%llu,\"batches\":%llu,\"images\":%llu,\"mean_batch\":%.3f,\"mean_latency_ms\":%.3f,",
+			requests, errors, batches, images, batches ? (double)images / batches : 0.0,
+			answered ? 1000 * latency_sum / answered : 0.0);
+		std::string s = buf;
+		s += "\"batch_size_hist\":{";
+		for (int n = 1; n <= max_batch; ++n) {
+			sprintf(buf, "%s\"%d\":%llu", (n > 1) ? "," : "", n, batch_hist[n]);
+			s += buf;
+		}
+		s += "},\"latency_ms_hist\":{";
+		for (int i = 0; i < latency_buckets; ++i) {
+			if (i < latency_buckets - 1) sprintf(buf, "%s\"%g\":%llu", i ? "," : "", latency_bound(i), latency_hist[i]);
+			else sprintf(buf, ",\"inf\":%llu", latency_hist[i]);
+			s += buf;
+		}
+		s += "}}";
+		return s;
+	}
+
+private:
+	void wake()
+	{
+#ifdef __linux__
+		if (wake_pipe[1] >= 0) {
+			char c = 0;
+			if (::write(wake_pipe[1], &c, 1) < 0) {}	// full pipe - the loop is woken anyway
+		}
+#endif
+	}
+
+	static std::string http_response(int code, std::string const& body, bool close_after)
+	{
+		char const *status = (code == 200) ? "200 OK" : (code == 400) ? "400 Bad Request" : (code == 404) ? "404 Not Found" :
+			(code == 413) ? "413 Payload Too Large" : "500 Internal Server Error";
+		char head[256];
+		sprintf(head, "HTTP/1.1 %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n",
+			status, body.size(), close_after ? "close" : "keep-alive");
+		return head + body;
+	}
+
+	static std::string error_json(std::string const& msg) { return "{\"error\":\"" + json_escape(msg) + "\"}"; }
+
+	static std::string json_escape(std::string const& s)
+	{
+		std::string out;
+		for (char c : s) {
+			if (c == '"' || c == '\\') out += '\\';
+			if ((unsigned char)c >= 0x20) out += c;
+		}
+		return out;
+	}
+
+	// from the decode / batch threads
+	void post_response(job_ptr const& job, int code, std::string const& body)
+	{
+		double const sec = std::chrono::duration<double>(server_clock::now() - job->received).count();
+		{
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			if (code != 200) ++errors;
+			else {
+				latency_sum += sec;
+				int i = 0;
+				while (i < latency_buckets - 1 && sec * 1000 > latency_bound(i)) ++i;
+				++latency_hist[i];
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(response_mutex);
+			responses.push_back(std::make_pair(job->conn_id, http_response(code, body, false)));
+		}
+		wake();
+	}
+
+	//
+	// IO thread
+	//
+	void io_loop()
+	{
+		std::vector<socket_poller_t::event_t> events;
+		while (!stop) {
+#ifdef __linux__
+			poller.wait(events, 1000);
+#else
+			poller.wait(events, 10);	// no wake-up socket, responses are polled
+#endif
+			for (auto &e : events) {
+				if (e.sock == sock) accept_conns();
+#ifdef __linux__
+				else if (e.sock == wake_pipe[0]) {
+					char buf[256];
+					while (::read(wake_pipe[0], buf, sizeof(buf)) > 0) {}
+				}
+#endif
+				else if (conns.count(e.sock)) {
+					if (e.readable && !on_readable(e.sock)) continue;
+					if (e.writable) flush(e.sock);
+				}
+			}
+			deliver_responses();
+		}
+	}
+
+	void accept_conns()
+	{
+		for (;;) {
+			SOCKADDR_IN address;
+#ifdef _WIN32
+			int addrlen = sizeof(SOCKADDR);
+#else
+			socklen_t addrlen = sizeof(SOCKADDR);
+#endif
+			SOCKET client = ::accept(sock, (SOCKADDR*)&address, &addrlen);
+			if (client == INVALID_SOCKET) return;
+			set_nonblocking(client);
+			int one = 1;
+			::setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (char const*)&one, sizeof(one));
+			conn_t &c = conns[client];
+			c.id = next_conn_id++;
+			c.sent = 0;
+			c.busy = c.close_after = c.want_write = c.continue_sent = false;
+			conn_socks[c.id] = client;
+			poller.add(client, false);
+		}
+	}
+
+	void close_conn(SOCKET s)
+	{
+		conn_socks.erase(conns[s].id);
+		poller.remove(s);
+		close_socket(s);
+		conns.erase(s);
+	}
+
+	// false - the connection is closed
+	bool on_readable(SOCKET s)
+	{
+		conn_t &c = conns[s];
+		char buf[64 * 1024];
+		for (;;) {
+			int const n = ::recv(s, buf, sizeof(buf), 0);
+			if (n == 0 || (n < 0 && !would_block())) {
+				close_conn(s);
+				return false;
+			}
+			if (n < 0) break;
+			c.in.append(buf, n);
+			if (c.in.size() > max_body + 8192) {
+				close_conn(s);
+				return false;
+			}
+		}
+		return process_requests(s);
+	}
+
+	// parses the complete requests of the connection, false - the connection is closed
+	bool process_requests(SOCKET s)
+	{
+		conn_t &c = conns[s];
+		while (!c.busy && !c.close_after) {
+			size_t const head_end = c.in.find("\r\n\r\n");
+			if (head_end == std::string::npos) {
+				if (c.in.size() > 8192) {
+					close_conn(s);
+					return false;
+				}
+				break;
+			}
+			std::string head = c.in.substr(0, head_end);
+			for (auto &ch : head) ch = tolower(ch);
+			size_t content_length = 0;
+			size_t const cl = head.find("\r\ncontent-length:");
+			if (cl != std::string::npos) content_length = strtoul(head.c_str() + cl + 17, NULL, 10);
+			std::string const request_line = head.substr(0, head.find("\r\n"));
+			bool const http10 = request_line.find(" http/1.0") != std::string::npos;
+			bool const keep_alive = head.find("\r\nconnection: keep-alive") != std::string::npos;
+			bool const close_after = head.find("\r\nconnection: close") != std::string::npos || (http10 && !keep_alive);
+			if (content_length > max_body) {
+				c.out += http_response(413, error_json("image is too large"), true);
+				c.close_after = true;
+				c.in.clear();
+				break;
+			}
+			if (c.in.size() < head_end + 4 + content_length) {	// the body isn't received yet
+				// curl and others wait ~1 s for "100 Continue" before sending a large body
+				if (!c.continue_sent && head.find("\r\nexpect: 100-continue") != std::string::npos) {
+					c.out += "HTTP/1.1 100 Continue\r\n\r\n";
+					c.continue_sent = true;
+				}
+				break;
+			}
+
+			// "POST /detect?thresh=0.3 HTTP/1.1"
+			size_t const path = request_line.find(' ');
+			size_t const path_end = (path == std::string::npos) ? path : request_line.find_first_of(" ?", path + 1);
+			std::string const method = request_line.substr(0, path);
+			std::string const route = (path_end == std::string::npos) ? "" : request_line.substr(path + 1, path_end - path - 1);
+			c.close_after = close_after;
+
+			if (method == "post" && route == "/detect") {
+				job_ptr job = std::make_shared<job_t>();
+				job->conn_id = c.id;
+				job->body = c.in.substr(head_end + 4, content_length);
+				job->thresh = 0.25F;
+				size_t const query = request_line.find("thresh=");
+				if (query != std::string::npos) job->thresh = strtof(request_line.c_str() + query + 7, NULL);
+				job->received = server_clock::now();
+				job->img.data = NULL;
+				c.busy = true;
+				{
+					std::lock_guard<std::mutex> lock(stats_mutex);
+					++requests;
+				}
+				{
+					std::lock_guard<std::mutex> lock(queue_mutex);
+					decode_queue.push_back(job);
+				}
+				decode_cv.notify_one();
+			}
+			else if (method == "get" && route == "/stats") c.out += http_response(200, stats_json(), close_after);
+			else c.out += http_response(404, error_json("use POST /detect or GET /stats"), close_after);
+			c.in.erase(0, head_end + 4 + content_length);
+			c.continue_sent = false;
+		}
+		return flush(s);
+	}
+
+	void deliver_responses()
+	{
+		std::vector<std::pair<unsigned long long, std::string>> ready;
+		{
+			std::lock_guard<std::mutex> lock(response_mutex);
+			ready.swap(responses);
+		}
+		for (auto &r : ready) {
+			auto i = conn_socks.find(r.first);
+			if (i == conn_socks.end()) continue;	// the client has gone
+			conn_t &c = conns[i->second];
+			c.busy = false;
+			if (c.close_after) r.second.replace(r.second.find("Connection: keep-alive"), 22, "Connection: close");
+			c.out += r.second;
+			process_requests(i->second);
+		}
+	}
+
+	// sends until the socket would block, false - the connection is closed
+	bool flush(SOCKET s)
+	{
+		conn_t &c = conns[s];
+		while (c.sent < c.out.size()) {
+			int const n = ::send(s, c.out.data() + c.sent, (int)(c.out.size() - c.sent), MSG_NOSIGNAL);
+			if (n < 0 && would_block()) break;
+			if (n <= 0) {
+				close_conn(s);
+				return false;
+			}
+			c.sent += n;
+		}
+		if (c.sent == c.out.size()) {
+			c.out.clear();
+			c.sent = 0;
+			if (c.close_after && !c.busy) {
+				close_conn(s);
+				return false;
+			}
+		}
+		bool const want_write = !c.out.empty();
+		if (want_write != c.want_write) {
+			c.want_write = want_write;
+			poller.modify(s, want_write);
+		}
+		return true;
+	}
+
+	//
+	// decode threads
+	//
+	void decode_loop()
+	{
+		for (;;) {
+			job_ptr job;
+			{
+				std::unique_lock<std::mutex> lock(queue_mutex);
+				while (!stop && decode_queue.empty()) decode_cv.wait(lock);
+				if (stop) return;
+				job = decode_queue.front();
+				decode_queue.pop_front();
+			}
+			try {
+				image_t img = Detector::load_image((unsigned char const*)job->body.data(), job->body.size());
+				job->orig_w = img.w;
+				job->orig_h = img.h;
+				int const net_w = detector.get_net_width(), net_h = detector.get_net_height();
+				if (img.w != net_w || img.h != net_h) {
+					image_t sized = Detector::resize_image(img, net_w, net_h);
+					Detector::free_image(img);
+					img = sized;
+				}
+				job->img = img;
+			}
+			catch (std::exception &e) {
+				post_response(job, 400, error_json(e.what()));
+				continue;
+			}
+			std::string().swap(job->body);
+			job->decoded = server_clock::now();
+			{
+				std::lock_guard<std::mutex> lock(queue_mutex);
+				batch_queue.push_back(job);
+			}
+			batch_cv.notify_one();
+		}
+	}
+
+	//
+	// batch thread
+	//
+	void batch_loop()
+	{
+		for (;;) {
+			std::vector<job_ptr> batch;
+			{
+				std::unique_lock<std::mutex> lock(queue_mutex);
+				while (!stop && batch_queue.empty()) batch_cv.wait(lock);
+				if (stop) return;
+				server_clock::time_point const deadline = batch_queue.front()->decoded + std::chrono::milliseconds(max_wait_ms);
+				while (!stop && batch_queue.size() < (size_t)max_batch && server_clock::now() < deadline)
+					batch_cv.wait_until(lock, deadline);
+				if (stop) return;
+				size_t const n = std::min(batch_queue.size(), (size_t)max_batch);
+				batch.assign(batch_queue.begin(), batch_queue.begin() + n);
+				batch_queue.erase(batch_queue.begin(), batch_queue.begin() + n);
+			}
+			detect(batch);
+		}
+	}
+
+	void detect(std::vector<job_ptr> const& batch)
+	{
+		std::vector<image_t> img_vec;
+		float thresh = 1;
+		for (auto &j : batch) {
+			img_vec.push_back(j->img);
+			thresh = std::min(thresh, j->thresh);
+		}
+		std::vector<std::vector<bbox_t>> result_vec;
+		std::string error;
+		try {
+			result_vec = detector.detect_batch(img_vec, thresh);
+		}
+		catch (std::exception &e) { error = e.what(); }
+		for (auto &img : img_vec) Detector::free_image(img);
+		{
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			++batches;
+			images += batch.size();
+			++batch_hist[batch.size()];
+		}
+		for (size_t i = 0; i < batch.size(); ++i) {
+			if (!error.empty()) post_response(batch[i], 500, error_json(error));
+			else post_response(batch[i], 200, boxes_json(*batch[i], result_vec[i]));
+		}
+	}
+
+	// boxes of the network-size image in the pixels of the original image
+	std::string boxes_json(job_t const& job, std::vector<bbox_t> const& boxes) const
+	{
+		float const wk = (float)job.orig_w / job.img.w, hk = (float)job.orig_h / job.img.h;
+		char buf[256];
+		sprintf(buf, "{\"width\":%d,\"height\":%d,\"boxes\":[", job.orig_w, job.orig_h);
+		std::string s = buf;
+		bool first = true;
+		for (auto &b : boxes) {
+			if (b.prob <= job.thresh) continue;
+			sprintf(buf, "%s{\"obj_id\":%u,\"prob\":%.4f,\"x\":%.1f,\"y\":%.1f,\"w\":%.1f,\"h\":%.1f", first ? "" : ",",
+				b.obj_id, b.prob, b.x * wk, b.y * hk, b.w * wk, b.h * hk);
+			s += buf;
+			if (b.obj_id < obj_names.size()) s += ",\"name\":\"" + json_escape(obj_names[b.obj_id]) + "\"";
+			s += "}";
+			first = false;
+		}
+		return s + "]}";
+	}
+};
+
+#endif	// _DARKNET_WRAPPER_DETECT_SERVER_HPP_
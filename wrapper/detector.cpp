@@ -19,6 +19,9 @@ extern "C" {
 #include <vector>
 #include <iostream>
 #include <algorithm>
+#include <limits>
+#include <chrono>
+#include <cmath>
 
 #define FRAMES 3
 
@@ -37,10 +40,42 @@ struct detector_gpu_t {
 	float *avg;
 	float *predictions[FRAMES];
 	int demo_index;
-	unsigned int *track_id;
+	float *batch_input;		// max_batch images of network size for detect_batch()
+	size_t batch_input_size;
+
+	std::vector<network> contexts;		// other input sizes, share weights with net
+	std::vector<double> latency;		// moving average of detection time: [0] - net, [i+1] - contexts[i]
+	int cur_context;					// -1 - net
 };
 
-Detector::Detector(std::string cfg_filename, std::string weight_filename, int gpu_id) : cur_gpu_id(gpu_id)
+// network of the selected input size
+static network &cur_network(detector_gpu_t &detector_gpu)
+{
+	return (detector_gpu.cur_context >= 0) ? detector_gpu.contexts[detector_gpu.cur_context] : detector_gpu.net;
+}
+
+// shapes of the layers and the route input sizes - a context must not change them in the base network
+static std::vector<int> network_shapes(network const& net)
+{
+	std::vector<int> shapes;
+	for (int i = 0; i < net.n; ++i) {
+		layer const& l = net.layers[i];
+		shapes.push_back(l.outputs);
+		shapes.push_back(l.inputs);
+		if (l.type == ROUTE)
+			shapes.insert(shapes.end(), l.input_sizes, l.input_sizes + l.n);
+	}
+	return shapes;
+}
+
+static void update_latency(detector_gpu_t &detector_gpu, double sec)
+{
+	double &avg = detector_gpu.latency[detector_gpu.cur_context + 1];
+	avg = (avg > 0) ? (0.8 * avg + 0.2 * sec) : sec;
+}
+
+Detector::Detector(std::string cfg_filename, std::string weight_filename, int gpu_id, int max_batch) : 
+	cur_gpu_id(gpu_id), max_batch(std::max(1, max_batch))
 {
 	wait_stream = 0;
 	int old_gpu_index;
@@ -63,13 +98,17 @@ Detector::Detector(std::string cfg_filename, std::string weight_filename, int gp
 	char *cfgfile = const_cast<char *>(cfg_filename.data());
 	char *weightfile = const_cast<char *>(weight_filename.data());
 
-	net = parse_network_cfg_custom(cfgfile, 1);
+	// layers are allocated for max_batch images, detect() uses batch = 1
+	net = parse_network_cfg_custom(cfgfile, this->max_batch);
 	if (weightfile) {
 		load_weights(&net, weightfile);
 	}
 	set_batch_network(&net, 1);
 	net.gpu_index = cur_gpu_id;
 	fuse_conv_batchnorm(net);
+	alias_route_layers(&net);
+	fuse_shortcut_layers(&net);
+	fuse_upsample_layers(&net);
 
 	layer l = net.layers[net.n - 1];
 	int j;
@@ -78,8 +117,11 @@ Detector::Detector(std::string cfg_filename, std::string weight_filename, int gp
 	for (j = 0; j < FRAMES; ++j) detector_gpu.predictions[j] = (float *)calloc(l.outputs, sizeof(float));
 	for (j = 0; j < FRAMES; ++j) detector_gpu.images[j] = make_image(1, 1, 3);
 
-	detector_gpu.track_id = (unsigned int *)calloc(l.classes, sizeof(unsigned int));
-	for (j = 0; j < l.classes; ++j) detector_gpu.track_id[j] = 1;
+
+	detector_gpu.batch_input_size = this->max_batch * net.w * net.h * net.c;
+	detector_gpu.batch_input = (float *)calloc(detector_gpu.batch_input_size, sizeof(float));
+	detector_gpu.latency.assign(1, 0);
+	detector_gpu.cur_context = -1;
 
 #ifdef GPU
 	check_cuda( cudaSetDevice(old_gpu_index) );
@@ -92,7 +134,8 @@ Detector::~Detector()
 	detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
 	layer l = detector_gpu.net.layers[detector_gpu.net.n - 1];
 
-	free(detector_gpu.track_id);
+	free(detector_gpu.batch_input);
+	for (auto &ctx : detector_gpu.contexts) free_network_context(ctx, &detector_gpu.net);
 
 	free(detector_gpu.avg);
 	for (int j = 0; j < FRAMES; ++j) free(detector_gpu.predictions[j]);
@@ -113,28 +156,150 @@ Detector::~Detector()
 
 int Detector::get_net_width() const {
 	detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
-	return detector_gpu.net.w;
+	return cur_network(detector_gpu).w;
 }
 int Detector::get_net_height() const {
 	detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
-	return detector_gpu.net.h;
+	return cur_network(detector_gpu).h;
 }
 
 
 std::vector<bbox_t> Detector::detect(std::string image_filename, float thresh, bool use_mean)
 {
+	if (!use_mean) return detect_reduced(image_filename, thresh);
 	std::shared_ptr<image_t> image_ptr(new image_t, [](image_t *img) { if (img->data) free(img->data); delete img; });
 	*image_ptr = load_image(image_filename);
 	return detect(*image_ptr, thresh, use_mean);
 }
 
-static image load_image_stb(char *filename, int channels)
+static void pixels_to_input(unsigned char const* data, int w, int h, int stride, pixel_format_t format, image sized);
+
+int Detector::reduced_decode_factor(int w, int h, int net_w, int net_h)
 {
-	int w, h, c;
-	unsigned char *data = stbi_load(filename, &w, &h, &c, channels);
-	if (!data) 
+	int f = 1;
+	while (f < 8 && w / (f * 2) >= net_w && h / (f * 2) >= net_h) f *= 2;
+	return f;
+}
+
+// box filter by an integer factor in place, (w + f - 1) / f x (h + f - 1) / f pixels remain
+static void downscale_pixels(unsigned char *data, int w, int h, int c, int f)
+{
+	int const out_w = (w + f - 1) / f, out_h = (h + f - 1) / f;
+	std::vector<unsigned int> sum(out_w * c);
+	for (int oy = 0; oy < out_h; ++oy) {
+		std::fill(sum.begin(), sum.end(), 0);
+		int const y_end = std::min(h, (oy + 1) * f);
+		for (int y = oy * f; y < y_end; ++y) {
+			unsigned char const* row = data + (size_t)y * w * c;
+			for (int x = 0; x < w; ++x)
+				for (int k = 0; k < c; ++k) sum[(x / f) * c + k] += row[x * c + k];
+		}
+		// the output row is behind the rows which are already summed
+		unsigned char *dst = data + (size_t)oy * out_w * c;
+		for (int ox = 0; ox < out_w; ++ox) {
+			int const n = (std::min(w, (ox + 1) * f) - ox * f) * (y_end - oy * f);
+			for (int k = 0; k < c; ++k) dst[ox * c + k] = (sum[ox * c + k] + n / 2) / n;
+		}
+	}
+}
+
+#ifdef OPENCV
+cv::Mat Detector::imread_reduced(std::string const& filename, int net_w, int net_h, int &orig_w, int &orig_h)
+{
+	int w = 0, h = 0, c;
+#if CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 2)
+	if (stbi_info(filename.c_str(), &w, &h, &c)) {
+		int const factor = reduced_decode_factor(w, h, net_w, net_h);
+		// libjpeg scales in the DCT domain
+		int const flags = (factor == 8) ? cv::IMREAD_REDUCED_COLOR_8 : (factor == 4) ? cv::IMREAD_REDUCED_COLOR_4 :
+			(factor == 2) ? cv::IMREAD_REDUCED_COLOR_2 : cv::IMREAD_COLOR;
+		cv::Mat mat = cv::imread(filename, flags);
+		// imread() applies the EXIF orientation, stbi_info() doesn't. The reduced size is rounded up by libjpeg
+		// (DCT scaling) and down by the resize of the other formats
+		auto const reduced_to = [&](int mat_w, int mat_h) {
+			return (mat.cols == mat_w / factor || mat.cols == (mat_w + factor - 1) / factor) &&
+				(mat.rows == mat_h / factor || mat.rows == (mat_h + factor - 1) / factor);
+		};
+		if (!reduced_to(w, h) && reduced_to(h, w)) std::swap(w, h);
+		orig_w = w;
+		orig_h = h;
+		return mat;
+	}
+#endif
+	// TIFF, WebP, JPEG 2000... - the size isn't known before decoding (or no reduced decoding before OpenCV 3.2)
+	cv::Mat mat = cv::imread(filename, cv::IMREAD_COLOR);
+	orig_w = mat.cols;
+	orig_h = mat.rows;
+	return mat;
+}
+#endif
+
+bool Detector::load_image_into(std::string image_filename, image_t sized, int &orig_w, int &orig_h)
+{
+	image im;
+	im.w = sized.w;
+	im.h = sized.h;
+	im.c = sized.c;
+	im.data = sized.data;
+#if defined(OPENCV) && (CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 2))
+	cv::Mat mat = imread_reduced(image_filename, sized.w, sized.h, orig_w, orig_h);
+	if (mat.empty()) return false;
+	pixels_to_input(mat.data, mat.cols, mat.rows, (int)mat.step, PIXEL_BGR24, im);
+#else
+	int w = 0, h = 0, c;
+	if (!stbi_info(image_filename.c_str(), &w, &h, &c)) return false;
+	int const factor = reduced_decode_factor(w, h, sized.w, sized.h);
+	unsigned char *data = stbi_load(image_filename.c_str(), &w, &h, &c, 3);
+	if (!data) return false;
+	if (factor > 1) downscale_pixels(data, w, h, 3, factor);
+	int const reduced_w = (w + factor - 1) / factor;
+	pixels_to_input(data, reduced_w, (h + factor - 1) / factor, reduced_w * 3, PIXEL_RGB24, im);
+	free(data);
+	orig_w = w;
+	orig_h = h;
+#endif
+	return true;
+}
+
+std::vector<bbox_t> Detector::detect_reduced(std::string image_filename, float thresh)
+{
+	std::vector<bbox_t> result_vec;
+	int w = 0, h = 0, reduced_w, reduced_h;
+#if defined(OPENCV) && (CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 2))
+	cv::Mat mat = imread_reduced(image_filename, get_net_width(), get_net_height(), w, h);
+	if (mat.empty())
 		throw std::runtime_error("file not found");
-	if (channels) c = channels;
+	reduced_w = mat.cols;
+	reduced_h = mat.rows;
+	result_vec = detect_pixels(mat.data, mat.cols, mat.rows, (int)mat.step, PIXEL_BGR24, thresh);
+#else
+	int c;
+	if (!stbi_info(image_filename.c_str(), &w, &h, &c))
+		throw std::runtime_error("file not found");
+	int const factor = reduced_decode_factor(w, h, get_net_width(), get_net_height());
+	unsigned char *data = stbi_load(image_filename.c_str(), &w, &h, &c, 3);
+	if (!data)
+		throw std::runtime_error("file not found");
+	if (factor > 1) downscale_pixels(data, w, h, 3, factor);
+	reduced_w = (w + factor - 1) / factor;
+	reduced_h = (h + factor - 1) / factor;
+	try {
+		result_vec = detect_pixels(data, reduced_w, reduced_h, reduced_w * 3, PIXEL_RGB24, thresh);
+	}
+	catch (...) {
+		free(data);
+		throw;
+	}
+	free(data);
+#endif
+	float const wk = (float)w / reduced_w, hk = (float)h / reduced_h;
+	for (auto &i : result_vec) i.x *= wk, i.w *= wk, i.y *= hk, i.h *= hk;
+	return result_vec;
+}
+
+// planar float image from interleaved 8-bit pixels (frees data)
+static image stb_pixels_to_image(unsigned char *data, int w, int h, int c)
+{
 	int i, j, k;
 	image im = make_image(w, h, c);
 	for (k = 0; k < c; ++k) {
@@ -150,6 +315,16 @@ static image load_image_stb(char *filename, int channels)
 	return im;
 }
 
+static image load_image_stb(char *filename, int channels)
+{
+	int w, h, c;
+	unsigned char *data = stbi_load(filename, &w, &h, &c, channels);
+	if (!data) 
+		throw std::runtime_error("file not found");
+	if (channels) c = channels;
+	return stb_pixels_to_image(data, w, h, c);
+}
+
 image_t Detector::load_image(std::string image_filename)
 {
 	char *input = const_cast<char *>(image_filename.data());
@@ -165,6 +340,41 @@ image_t Detector::load_image(std::string image_filename)
 }
 
 
+image_t Detector::load_image(unsigned char const* buf, size_t size)
+{
+	int w, h, c;
+	unsigned char *data = stbi_load_from_memory(buf, (int)size, &w, &h, &c, 3);
+	if (!data)
+		throw std::runtime_error("can't decode image");
+	image im = stb_pixels_to_image(data, w, h, 3);
+
+	image_t img;
+	img.c = im.c;
+	img.data = im.data;
+	img.h = im.h;
+	img.w = im.w;
+
+	return img;
+}
+
+image_t Detector::resize_image(image_t m, int w, int h)
+{
+	image im;
+	im.c = m.c;
+	im.data = m.data;
+	im.h = m.h;
+	im.w = m.w;
+	image sized = ::resize_image(im, w, h);
+
+	image_t img;
+	img.c = sized.c;
+	img.data = sized.data;
+	img.h = sized.h;
+	img.w = sized.w;
+
+	return img;
+}
+
 void Detector::free_image(image_t m)
 {
 	if (m.data) {
@@ -172,10 +382,38 @@ void Detector::free_image(image_t m)
 	}
 }
 
+static std::vector<bbox_t> detections_to_bbox_vec(detection *dets, int nboxes, int classes, int w, int h, float thresh)
+{
+	std::vector<bbox_t> bbox_vec;
+
+	for (size_t i = 0; i < nboxes; ++i) {
+		box b = dets[i].bbox;
+		int const obj_id = max_index(dets[i].prob, classes);
+		float const prob = dets[i].prob[obj_id];
+		
+		if (prob > thresh) 
+		{
+			bbox_t bbox;
+			bbox.x = std::max((double)0, (b.x - b.w / 2.)*w);
+			bbox.y = std::max((double)0, (b.y - b.h / 2.)*h);
+			bbox.w = b.w*w;
+			bbox.h = b.h*h;
+			bbox.obj_id = obj_id;
+			bbox.prob = prob;
+			bbox.track_id = 0;
+			bbox.frames_counter = 0;
+
+			bbox_vec.push_back(bbox);
+		}
+	}
+	return bbox_vec;
+}
+
 std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use_mean)
 {
 	detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
-	network &net = detector_gpu.net;
+	network &net = cur_network(detector_gpu);
+	auto const start_time = std::chrono::steady_clock::now();
 	int old_gpu_index;
 #ifdef GPU
 	cudaGetDevice(&old_gpu_index);
@@ -194,14 +432,20 @@ std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use_mean)
 	im.h = img.h;
 	im.w = img.w;
 
+	if (im.c != net.c)
+		throw std::runtime_error("Image has wrong number of channels");
+
+	// the first slot of the batch buffer is used as the network input - no allocation per frame
 	image sized;
+	sized.w = net.w;
+	sized.h = net.h;
+	sized.c = im.c;
+	sized.data = detector_gpu.batch_input;
 	
-	if (net.w == im.w && net.h == im.h) {
-		sized = make_image(im.w, im.h, im.c);
+	if (net.w == im.w && net.h == im.h)
 		memcpy(sized.data, im.data, im.w*im.h*im.c * sizeof(float));
-	}
 	else
-		sized = resize_image(im, net.w, net.h);
+		resize_image_into(im, sized);
 
 	layer l = net.layers[net.n - 1];
 
@@ -209,7 +453,7 @@ std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use_mean)
 
 	float *prediction = network_predict(net, X);
 
-	if (use_mean) {
+	if (use_mean && detector_gpu.cur_context < 0) {	// the history is kept only for the cfg input size
 		memcpy(detector_gpu.predictions[detector_gpu.demo_index], prediction, l.outputs * sizeof(float));
 		mean_arrays(detector_gpu.predictions, FRAMES, l.outputs, detector_gpu.avg);
 		l.output = detector_gpu.avg;
@@ -224,31 +468,97 @@ std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use_mean)
 	detection *dets = get_network_boxes(&net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes, letterbox);
 	if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
 
-	std::vector<bbox_t> bbox_vec;
+	std::vector<bbox_t> bbox_vec = detections_to_bbox_vec(dets, nboxes, l.classes, im.w, im.h, thresh);
 
-	for (size_t i = 0; i < nboxes; ++i) {
-		box b = dets[i].bbox;
-		int const obj_id = max_index(dets[i].prob, l.classes);
-		float const prob = dets[i].prob[obj_id];
-		
-		if (prob > thresh) 
-		{
-			bbox_t bbox;
-			bbox.x = std::max((double)0, (b.x - b.w / 2.)*im.w);
-			bbox.y = std::max((double)0, (b.y - b.h / 2.)*im.h);
-			bbox.w = b.w*im.w;
-			bbox.h = b.h*im.h;
-			bbox.obj_id = obj_id;
-			bbox.prob = prob;
-			bbox.track_id = 0;
+	free_detections(dets, nboxes);
 
-			bbox_vec.push_back(bbox);
+	std::chrono::duration<double> const spent = std::chrono::steady_clock::now() - start_time;
+	update_latency(detector_gpu, spent.count());
+
+#ifdef GPU
+	if (cur_gpu_id != old_gpu_index)
+		cudaSetDevice(old_gpu_index);
+#endif
+
+	return bbox_vec;
+}
+
+// bilinear resize of 8-bit interleaved pixels into the planar float network input (same sampling as resize_image)
+static void pixels_to_input(unsigned char const* data, int w, int h, int stride, pixel_format_t format, image sized)
+{
+	int const channels = (format == PIXEL_GRAY8) ? 1 : (format == PIXEL_RGBA32 || format == PIXEL_BGRA32) ? 4 : 3;
+	bool const bgr = (format == PIXEL_BGR24 || format == PIXEL_BGRA32);
+	float const w_scale = (sized.w > 1) ? (float)(w - 1) / (sized.w - 1) : 0;
+	float const h_scale = (sized.h > 1) ? (float)(h - 1) / (sized.h - 1) : 0;
+	std::vector<int> x0(sized.w);
+	std::vector<float> dx(sized.w);
+	for (int x = 0; x < sized.w; ++x) {
+		float const sx = x * w_scale;
+		x0[x] = std::min((int)sx, std::max(0, w - 2));
+		dx[x] = (w > 1) ? sx - x0[x] : 0;
+	}
+	int const x_step = (w > 1) ? channels : 0;
+	for (int y = 0; y < sized.h; ++y) {
+		float const sy = y * h_scale;
+		int const y0 = std::min((int)sy, std::max(0, h - 2));
+		float const dy = (h > 1) ? sy - y0 : 0;
+		unsigned char const* row0 = data + (size_t)y0 * stride;
+		unsigned char const* row1 = (h > 1) ? row0 + stride : row0;
+		for (int k = 0; k < 3; ++k) {
+			int const src_k = (channels == 1) ? 0 : bgr ? 2 - k : k;
+			float *dst = sized.data + (size_t)k * sized.w * sized.h + (size_t)y * sized.w;
+			for (int x = 0; x < sized.w; ++x) {
+				unsigned char const* p0 = row0 + x0[x] * channels + src_k;
+				unsigned char const* p1 = row1 + x0[x] * channels + src_k;
+				float const top = p0[0] + dx[x] * (p0[x_step] - p0[0]);
+				float const bottom = p1[0] + dx[x] * (p1[x_step] - p1[0]);
+				dst[x] = (top + dy * (bottom - top)) * (1.F / 255);
+			}
 		}
 	}
+}
+
+std::vector<bbox_t> Detector::detect_pixels(unsigned char const* data, int w, int h, int stride, pixel_format_t format,
+	float thresh)
+{
+	detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
+	network &net = cur_network(detector_gpu);
+	auto const start_time = std::chrono::steady_clock::now();
+	int old_gpu_index;
+#ifdef GPU
+	cudaGetDevice(&old_gpu_index);
+	if (cur_gpu_id != old_gpu_index)
+		cudaSetDevice(net.gpu_index);
+
+	net.wait_stream = wait_stream;	// 1 - wait CUDA-stream, 0 - not to wait
+#endif
+	if (data == NULL || w <= 0 || h <= 0)
+		throw std::runtime_error("Image is empty");
+	if (net.c != 3)
+		throw std::runtime_error("Image has wrong number of channels");
+
+	image sized;
+	sized.w = net.w;
+	sized.h = net.h;
+	sized.c = net.c;
+	sized.data = detector_gpu.batch_input;
+	pixels_to_input(data, w, h, stride, format, sized);
+
+	layer l = net.layers[net.n - 1];
+	network_predict(net, sized.data);
+
+	int nboxes = 0;
+	int letterbox = 0;
+	float hier_thresh = 0.5;
+	detection *dets = get_network_boxes(&net, w, h, thresh, hier_thresh, 0, 1, &nboxes, letterbox);
+	if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+
+	std::vector<bbox_t> bbox_vec = detections_to_bbox_vec(dets, nboxes, l.classes, w, h, thresh);
 
 	free_detections(dets, nboxes);
-	if(sized.data)
-		free(sized.data);
+
+	std::chrono::duration<double> const spent = std::chrono::steady_clock::now() - start_time;
+	update_latency(detector_gpu, spent.count());
 
 #ifdef GPU
 	if (cur_gpu_id != old_gpu_index)
@@ -261,57 +571,215 @@ std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use_mean)
 std::vector<bbox_t> Detector::tracking_id(std::vector<bbox_t> cur_bbox_vec, bool const change_history, 
 	int const frames_story, int const max_dist)
 {
-	detector_gpu_t &det_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
-
-	bool prev_track_id_present = false;
-	for (auto &i : prev_bbox_vec_deque)
-		if (i.size() > 0) prev_track_id_present = true;
-
-	if (!prev_track_id_present) {
-		for (size_t i = 0; i < cur_bbox_vec.size(); ++i)
-			cur_bbox_vec[i].track_id = det_gpu.track_id[cur_bbox_vec[i].obj_id]++;
-		prev_bbox_vec_deque.push_front(cur_bbox_vec);
-		if (prev_bbox_vec_deque.size() > frames_story) prev_bbox_vec_deque.pop_back();
-		return cur_bbox_vec;
-	}
+	return tracker.update(cur_bbox_vec, change_history, frames_story, max_dist);
+}
 
-	std::vector<unsigned int> dist_vec(cur_bbox_vec.size(), std::numeric_limits<unsigned int>::max());
-
-	for (auto &prev_bbox_vec : prev_bbox_vec_deque) {
-		for (auto &i : prev_bbox_vec) {
-			int cur_index = -1;
-			for (size_t m = 0; m < cur_bbox_vec.size(); ++m) {
-				bbox_t const& k = cur_bbox_vec[m];
-				if (i.obj_id == k.obj_id) {
-					float center_x_diff = (float)(i.x + i.w/2) - (float)(k.x + k.w/2);
-					float center_y_diff = (float)(i.y + i.h/2) - (float)(k.y + k.h/2);
-					unsigned int cur_dist = sqrt(center_x_diff*center_x_diff + center_y_diff*center_y_diff);
-					if (cur_dist < max_dist && (k.track_id == 0 || dist_vec[m] > cur_dist)) {
-						dist_vec[m] = cur_dist;
-						cur_index = m;
-					}
-				}
+std::vector<std::vector<bbox_t>> Detector::detect_batch(std::vector<image_t> const& img_vec, float thresh)
+{
+	detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
+	network &net = cur_network(detector_gpu);
+	int old_gpu_index;
+#ifdef GPU
+	cudaGetDevice(&old_gpu_index);
+	if (cur_gpu_id != old_gpu_index)
+		cudaSetDevice(net.gpu_index);
+
+	net.wait_stream = wait_stream;	// 1 - wait CUDA-stream, 0 - not to wait
+#endif
+	layer l = net.layers[net.n - 1];
+	size_t const image_size = net.w * net.h * net.c;
+	std::vector<std::vector<bbox_t>> result_vec;
+	result_vec.reserve(img_vec.size());
+
+	// one forward pass per max_batch images
+	for (size_t start = 0; start < img_vec.size(); start += max_batch) {
+		int const batch = std::min((size_t)max_batch, img_vec.size() - start);
+
+		for (int b = 0; b < batch; ++b) {
+			image_t const& img = img_vec[start + b];
+			if (img.data == NULL)
+				throw std::runtime_error("Image is empty");
+			if (img.c != net.c)
+				throw std::runtime_error("Image has wrong number of channels");
+			float *dst = detector_gpu.batch_input + b*image_size;
+			if (img.w == net.w && img.h == net.h) {
+				memcpy(dst, img.data, image_size * sizeof(float));
 			}
+			else {
+				image im;
+				im.c = img.c;
+				im.data = img.data;
+				im.h = img.h;
+				im.w = img.w;
+				image sized;
+				sized.w = net.w;
+				sized.h = net.h;
+				sized.c = net.c;
+				sized.data = dst;
+				resize_image_into(im, sized);
+			}
+		}
 
-			bool track_id_absent = !std::any_of(cur_bbox_vec.begin(), cur_bbox_vec.end(), 
-				[&i](bbox_t const& b) { return b.track_id == i.track_id && b.obj_id == i.obj_id; });
+		set_batch_network(&net, batch);
+		network_predict(net, detector_gpu.batch_input);
+
+		int const letterbox = 0;
+		float const hier_thresh = 0.5;
+		for (int b = 0; b < batch; ++b) {
+			image_t const& img = img_vec[start + b];
+			int nboxes = 0;
+			detection *dets = get_network_boxes_batch(&net, b, img.w, img.h, thresh, hier_thresh, 0, 1, &nboxes, letterbox);
+			if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+			result_vec.push_back(detections_to_bbox_vec(dets, nboxes, l.classes, img.w, img.h, thresh));
+			free_detections(dets, nboxes);
+		}
+		set_batch_network(&net, 1);
+	}
 
-			if (cur_index >= 0 && track_id_absent){
-				cur_bbox_vec[cur_index].track_id = i.track_id;
-				cur_bbox_vec[cur_index].w = (cur_bbox_vec[cur_index].w + i.w) / 2;
-				cur_bbox_vec[cur_index].h = (cur_bbox_vec[cur_index].h + i.h) / 2;
-			}
+#ifdef GPU
+	if (cur_gpu_id != old_gpu_index)
+		cudaSetDevice(old_gpu_index);
+#endif
+
+	return result_vec;
+}
+
+
+bool Detector::add_resolution(int net_w, int net_h)
+{
+	detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
+	network &net = detector_gpu.net;
+	if (net_w % 32 != 0 || net_h % 32 != 0 || net_w <= 0 || net_h <= 0) return false;
+	if (net_w == net.w && net_h == net.h) return true;
+	for (auto &ctx : detector_gpu.contexts)
+		if (ctx.w == net_w && ctx.h == net_h) return true;
+#ifdef GPU
+	// contexts share the CPU layers only
+	return false;
+#else
+	// buffers of the context are allocated for max_batch images
+	set_batch_network(&net, max_batch);
+	std::vector<int> const base_shapes = network_shapes(net);
+	network ctx = make_network_context(&net, net_w, net_h);
+	bool const base_changed = network_shapes(net) != base_shapes;
+	set_batch_network(&net, 1);
+	set_batch_network(&ctx, 1);
+	if (base_changed) {
+		free_network_context(ctx, &net);
+		throw std::runtime_error("add_resolution() has changed the network of the cfg size");
+	}
+
+	size_t const batch_input_size = max_batch * ctx.w * ctx.h * ctx.c;
+	if (batch_input_size > detector_gpu.batch_input_size) {
+		free(detector_gpu.batch_input);
+		detector_gpu.batch_input = (float *)calloc(batch_input_size, sizeof(float));
+		detector_gpu.batch_input_size = batch_input_size;
+	}
+
+	detector_gpu.contexts.push_back(ctx);
+	detector_gpu.latency.push_back(0);
+	return true;
+#endif
+}
+
+bool Detector::select_resolution(int net_w, int net_h)
+{
+	detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
+	if (detector_gpu.net.w == net_w && detector_gpu.net.h == net_h) {
+		detector_gpu.cur_context = -1;
+		return true;
+	}
+	for (size_t i = 0; i < detector_gpu.contexts.size(); ++i) {
+		if (detector_gpu.contexts[i].w == net_w && detector_gpu.contexts[i].h == net_h) {
+			detector_gpu.cur_context = i;
+			return true;
 		}
 	}
+	return false;
+}
+
+void Detector::select_resolution_auto(int frame_w, int frame_h, double latency_budget)
+{
+	detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
+
+	// known latency of any size is scaled by area for the sizes which weren't used yet
+	double sec_per_pixel = 0;
+	for (int i = -1; i < (int)detector_gpu.contexts.size(); ++i) {
+		network const& n = (i < 0) ? detector_gpu.net : detector_gpu.contexts[i];
+		if (detector_gpu.latency[i + 1] > 0) sec_per_pixel = detector_gpu.latency[i + 1] / (n.w * n.h);
+	}
+
+	int best = -1, smallest = -1;
+	long long best_area = -1, smallest_area = std::numeric_limits<long long>::max();
+	for (int i = -1; i < (int)detector_gpu.contexts.size(); ++i) {
+		network const& n = (i < 0) ? detector_gpu.net : detector_gpu.contexts[i];
+		long long const area = (long long)n.w * n.h;
+		if (area < smallest_area) smallest_area = area, smallest = i;
+
+		// larger input than the source frame gives nothing
+		if (frame_w > 0 && frame_h > 0 && n.w > frame_w && n.h > frame_h) continue;
+		if (latency_budget > 0) {
+			double const latency = (detector_gpu.latency[i + 1] > 0) ? detector_gpu.latency[i + 1] : (sec_per_pixel * area);
+			if (latency > latency_budget) continue;
+		}
+		if (area > best_area) best_area = area, best = i;
+	}
+	detector_gpu.cur_context = (best_area >= 0) ? best : smallest;
+}
 
-	for (size_t i = 0; i < cur_bbox_vec.size(); ++i)
-		if (cur_bbox_vec[i].track_id == 0)
-			cur_bbox_vec[i].track_id = det_gpu.track_id[cur_bbox_vec[i].obj_id]++;
+static float box_iou(bbox_t const& a, bbox_t const& b)
+{
+	float const w = (float)std::min(a.x + a.w, b.x + b.w) - (float)std::max(a.x, b.x);
+	float const h = (float)std::min(a.y + a.h, b.y + b.h) - (float)std::max(a.y, b.y);
+	if (w <= 0 || h <= 0) return 0;
+	float const inter = w * h;
+	return inter / ((float)a.w * a.h + (float)b.w * b.h - inter);
+}
 
-	if (change_history) {
-		prev_bbox_vec_deque.push_front(cur_bbox_vec);
-		if (prev_bbox_vec_deque.size() > frames_story) prev_bbox_vec_deque.pop_back();
+bool Detector::use_fp16_weights(std::vector<image_t> const& check_images, fp16_report_t *report, float thresh)
+{
+	detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
+	network &net = detector_gpu.net;
+#ifdef GPU
+	// GPU layers use their own weights
+	return false;
+#endif
+	std::vector<std::vector<bbox_t>> fp32_vec;
+	for (auto &img : check_images) fp32_vec.push_back(detect(img, thresh));
+
+	size_t const saved = convert_weights_to_half(net);
+	// contexts share the weights
+	for (auto &ctx : detector_gpu.contexts) {
+		for (int i = 0; i < ctx.n; ++i) {
+			ctx.layers[i].weights = net.layers[i].weights;
+			ctx.layers[i].weights_half = net.layers[i].weights_half;
+		}
 	}
 
-	return cur_bbox_vec;
-}
\ No newline at end of file
+	if (report) {
+		fp16_report_t r = fp16_report_t();
+		r.images = check_images.size();
+		r.bytes_saved = saved;
+		double iou_sum = 0;
+		for (size_t i = 0; i < check_images.size(); ++i) {
+			std::vector<bbox_t> const fp16 = detect(check_images[i], thresh);
+			r.boxes_fp32 += fp32_vec[i].size();
+			r.boxes_fp16 += fp16.size();
+			for (auto &a : fp32_vec[i]) {
+				float best_iou = 0;
+				bbox_t const *best = NULL;
+				for (auto &b : fp16) {
+					float const iou = (a.obj_id == b.obj_id) ? box_iou(a, b) : 0;
+					if (iou > best_iou) best_iou = iou, best = &b;
+				}
+				if (best_iou <= 0.5F) continue;
+				++r.matched;
+				iou_sum += best_iou;
+				r.max_prob_delta = std::max(r.max_prob_delta, std::abs(a.prob - best->prob));
+			}
+		}
+		r.mean_iou = (r.matched > 0) ? (float)(iou_sum / r.matched) : 0;
+		*report = r;
+	}
+	return true;
+}
@@ -3,6 +3,8 @@
 
 #ifdef __cplusplus
 #include <memory>
+#include <string>
+#include <stdexcept>
 #include <vector>
 #include <deque>
 #include <algorithm>
@@ -15,24 +17,72 @@
 #endif	// OPENCV
 
 #include "box_image.h"
+#include "track_id.hpp"
+
+// accuracy delta of fp16 weights (Detector::use_fp16_weights) on the check images
+struct fp16_report_t {
+	size_t images;
+	size_t boxes_fp32, boxes_fp16;
+	size_t matched;			// fp32 boxes which have an fp16 box of the same class with IoU > 0.5
+	float mean_iou;			// of the matched boxes
+	float max_prob_delta;	// of the matched boxes
+	size_t bytes_saved;		// weights memory
+};
 
 class Detector {
 	std::shared_ptr<void> detector_gpu_ptr;
-	std::deque<std::vector<bbox_t>> prev_bbox_vec_deque;
+	track_id_t tracker;
 	const int cur_gpu_id;
+	const int max_batch;
 public:
 	float nms = .4;
 	bool wait_stream;
 
-	Detector(std::string cfg_filename, std::string weight_filename, int gpu_id = 0);
+	// max_batch - how many images detect_batch() processes in one forward pass
+	Detector(std::string cfg_filename, std::string weight_filename, int gpu_id = 0, int max_batch = 1);
 	~Detector();
 
+	// without use_mean the file is decoded by detect_reduced()
 	std::vector<bbox_t> detect(std::string image_filename, float thresh = 0.2, bool use_mean = false);
+	// The image file is decoded at 1/2, 1/4 or 1/8 size if it stays at least as large as the network input
+	// (DCT-domain scaling of OpenCV IMREAD_REDUCED_*, or 8-bit box filter after stb decoding), the 8-bit
+	// pixels go to detect_pixels(). Boxes are in the pixels of the original image.
+	std::vector<bbox_t> detect_reduced(std::string image_filename, float thresh = 0.2);
+	static int reduced_decode_factor(int w, int h, int net_w, int net_h);
+	// decodes the file at reduced size and resizes it into sized (w, h, c = 3 and data are set by the caller),
+	// false - can't be decoded
+	static bool load_image_into(std::string image_filename, image_t sized, int &orig_w, int &orig_h);
 	std::vector<bbox_t> detect(image_t img, float thresh = 0.2, bool use_mean = false);
+	// 8-bit interleaved pixels (stride - bytes per row) are resized straight into the network input,
+	// there is no intermediate float image, e.g. for frames in shared memory (shm_ring.hpp)
+	std::vector<bbox_t> detect_pixels(unsigned char const* data, int w, int h, int stride, pixel_format_t format,
+		float thresh = 0.2);
+	// boxes of each image in its own pixel coordinates, images are processed by batches of get_max_batch()
+	std::vector<std::vector<bbox_t>> detect_batch(std::vector<image_t> const& img_vec, float thresh = 0.2);
 	static image_t load_image(std::string image_filename);
+	// encoded JPEG/PNG/BMP... in memory, throws if it can't be decoded
+	static image_t load_image(unsigned char const* buf, size_t size);
+	// new image, m isn't freed
+	static image_t resize_image(image_t m, int w, int h);
 	static void free_image(image_t m);
 	int get_net_width() const;
 	int get_net_height() const;
+	int get_max_batch() const { return max_batch; }
+
+	// Pre-builds an execution context for another network input size (multiple of 32), it shares weights
+	// with the cfg network, buffers are allocated once here. CPU only.
+	bool add_resolution(int net_w, int net_h);
+	// switches to a pre-built input size (or to the cfg size) without allocations, false - isn't pre-built
+	bool select_resolution(int net_w, int net_h);
+	// selects the largest pre-built size which isn't larger than the source frame and whose measured
+	// detection time fits into latency_budget (sec, 0 - no limit)
+	void select_resolution_auto(int frame_w, int frame_h, double latency_budget = 0);
+
+	// Keeps weights of convolutional layers as IEEE half precision (half of the weights memory and bandwidth),
+	// they are widened to fp32 in GEMM. CPU only, can't be undone. check_images are detected before and after
+	// the conversion to fill the report.
+	bool use_fp16_weights(std::vector<image_t> const& check_images = std::vector<image_t>(),
+		fp16_report_t *report = NULL, float thresh = 0.2);
 
 	std::vector<bbox_t> tracking_id(std::vector<bbox_t> cur_bbox_vec, bool const change_history = true, 
 												int const frames_story = 10, int const max_dist = 150);
@@ -48,6 +98,9 @@ public:
 	}
 
 #ifdef OPENCV
+	// the file decoded at the reduced size of detect_reduced() (oriented by EXIF), orig_w x orig_h - its full size
+	static cv::Mat imread_reduced(std::string const& filename, int net_w, int net_h, int &orig_w, int &orig_h);
+
 	std::vector<bbox_t> detect(cv::Mat mat, float thresh = 0.2, bool use_mean = false)
 	{
 		if(mat.data == NULL)
@@ -56,6 +109,25 @@ public:
 		return detect_resized(*image_ptr, mat.cols, mat.rows, thresh, use_mean);
 	}
 
+	// boxes of each cv::Mat in its pixel coordinates
+	std::vector<std::vector<bbox_t>> detect_batch(std::vector<cv::Mat> const& mat_vec, float thresh = 0.2)
+	{
+		std::vector<std::shared_ptr<image_t>> image_ptr_vec;
+		std::vector<image_t> img_vec;
+		for (auto &mat : mat_vec) {
+			if (mat.data == NULL)
+				throw std::runtime_error("Image is empty");
+			image_ptr_vec.push_back(mat_to_image_resize(mat));
+			img_vec.push_back(*image_ptr_vec.back());
+		}
+		auto result_vec = detect_batch(img_vec, thresh);
+		for (size_t i = 0; i < result_vec.size(); ++i) {
+			float const wk = (float)mat_vec[i].cols / img_vec[i].w, hk = (float)mat_vec[i].rows / img_vec[i].h;
+			for (auto &k : result_vec[i]) k.x *= wk, k.w *= wk, k.y *= hk, k.h *= hk;
+		}
+		return result_vec;
+	}
+
 	std::shared_ptr<image_t> mat_to_image_resize(cv::Mat mat) const
 	{
 		if (mat.data == NULL) return std::shared_ptr<image_t>(NULL);
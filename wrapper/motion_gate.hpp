@@ -0,0 +1,254 @@
+#ifndef _DARKNET_WRAPPER_MOTION_GATE_HPP_
+#define _DARKNET_WRAPPER_MOTION_GATE_HPP_
+
+#ifdef __cplusplus
+#include <vector>
+#include <algorithm>
+#endif
+
+#ifdef OPENCV
+#include <opencv2/opencv.hpp>			// C++
+#endif	// OPENCV
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MOTION_GATE_SSE2
+#endif
+
+#include "box_image.h"
+#include "detector.hpp"
+
+// Per-pixel change mask of two grey images: mask[i] = 255 if |cur[i] - ref[i]| > thresh, else 0.
+// Returns the number of changed pixels.
+static size_t motion_mask(unsigned char const *cur, unsigned char const *ref, unsigned char *mask, size_t size,
+	unsigned char thresh)
+{
+	size_t changed = 0, i = 0;
+#ifdef MOTION_GATE_SSE2
+	__m128i const thresh128 = _mm_set1_epi8((char)thresh), zero128 = _mm_setzero_si128();
+	for (; i + 16 <= size; i += 16) {
+		__m128i const a128 = _mm_loadu_si128((__m128i const *)(cur + i));
+		__m128i const b128 = _mm_loadu_si128((__m128i const *)(ref + i));
+		__m128i const diff128 = _mm_or_si128(_mm_subs_epu8(a128, b128), _mm_subs_epu8(b128, a128));	// |a - b|
+		// diff > thresh  <=>  saturated (diff - thresh) != 0
+		__m128i const mask128 = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_subs_epu8(diff128, thresh128), zero128),
+			_mm_set1_epi8((char)0xff));
+		_mm_storeu_si128((__m128i *)(mask + i), mask128);
+		unsigned int bits = _mm_movemask_epi8(mask128);
+		for (; bits; bits &= bits - 1) ++changed;
+	}
+#endif
+	for (; i < size; ++i) {
+		int const diff = (int)cur[i] - (int)ref[i];
+		mask[i] = (diff > thresh || -diff > thresh) ? 255 : 0;
+		changed += (mask[i] != 0);
+	}
+	return changed;
+}
+
+#ifdef OPENCV
+
+struct motion_gate_stats_t {
+	unsigned long long frames;			// all frames passed to motion_gate_t::detect()
+	unsigned long long static_frames;	// previous boxes are reused, the detector isn't started
+	unsigned long long crop_frames;		// the detector is started only on crops of changed regions
+	unsigned long long full_frames;		// the detector is started on the whole frame
+	unsigned long long crops;			// number of detected crops
+	double crop_area;					// sum of (crop area / frame area) over crop_frames
+};
+
+// Optional pre-stage of the detector for fixed cameras.
+// The downscaled grey frame is compared with the key frame (the frame of the last detection):
+//  - no changes - the previous boxes are returned without running the detector
+//  - local changes - the detector runs on a batch of crops around the changed regions, the found boxes are
+//    mapped to frame coordinates and merged with the previous boxes outside of the crops
+//  - large changes - the detector runs on the whole frame
+// One motion_gate_t per stream.
+class motion_gate_t {
+	cv::Mat key_grey, cur_grey, mask;
+	std::vector<bbox_t> prev_result_vec;
+	std::vector<unsigned char> cells;
+	std::vector<int> cell_stack;
+	motion_gate_stats_t stats;
+
+public:
+	int const small_width;			// width of the downscaled frame for differencing
+	int const cell_size;			// changed pixels are grouped by cells (in downscaled pixels)
+	unsigned char const pixel_thresh;
+	float const min_changed;		// part of changed pixels to consider a cell (and a frame) changed
+	float const max_crop_area;		// run full frame detection if crops cover more of the frame
+	size_t const max_crops;
+	float const crop_pad;			// padding of a crop relative to its size
+
+	motion_gate_t(int _small_width = 160, int _cell_size = 8, unsigned char _pixel_thresh = 25,
+		float _min_changed = 0.1F, float _max_crop_area = 0.5F, size_t _max_crops = 8, float _crop_pad = 0.5F) :
+		small_width(_small_width), cell_size(_cell_size), pixel_thresh(_pixel_thresh), min_changed(_min_changed),
+		max_crop_area(_max_crop_area), max_crops(_max_crops), crop_pad(_crop_pad)
+	{
+		reset();
+	}
+
+	void reset() {
+		key_grey = cv::Mat();
+		prev_result_vec.clear();
+		stats = motion_gate_stats_t();
+	}
+
+	motion_gate_stats_t get_stats() const { return stats; }
+
+	std::vector<bbox_t> detect(Detector &detector, cv::Mat frame, float thresh = 0.2)
+	{
+		if (frame.data == NULL)
+			throw std::runtime_error("Image is empty");
+		++stats.frames;
+
+		int const small_height = std::max(1, frame.rows * small_width / std::max(1, frame.cols));
+		cv::Mat small_frame;
+		cv::resize(frame, small_frame, cv::Size(small_width, small_height), 0, 0, cv::INTER_AREA);
+		if (small_frame.channels() == 3) cv::cvtColor(small_frame, cur_grey, cv::COLOR_BGR2GRAY);
+		else if (small_frame.channels() == 4) cv::cvtColor(small_frame, cur_grey, cv::COLOR_BGRA2GRAY);
+		else cur_grey = small_frame.clone();
+
+		if (key_grey.size() != cur_grey.size())
+			return detect_full(detector, frame, thresh);
+
+		mask.create(cur_grey.size(), CV_8UC1);
+		size_t const changed = motion_mask(cur_grey.data, key_grey.data, mask.data, cur_grey.total(), pixel_thresh);
+		size_t const min_cell_pixels = std::max(1, (int)(min_changed * cell_size * cell_size));
+		if (changed < min_cell_pixels) {
+			++stats.static_frames;
+			return prev_result_vec;		// key frame isn't changed - slow changes are accumulated
+		}
+
+		std::vector<cv::Rect> crop_vec = changed_regions(min_cell_pixels, frame.size());
+		double area = 0;
+		for (auto &r : crop_vec) area += r.area();
+		area /= frame.size().area();
+		if (crop_vec.empty()) {
+			++stats.static_frames;
+			return prev_result_vec;
+		}
+		if (crop_vec.size() > max_crops || area > max_crop_area)
+			return detect_full(detector, frame, thresh);
+
+		// batch of crops
+		std::vector<cv::Mat> crop_mat_vec;
+		for (auto &r : crop_vec) crop_mat_vec.push_back(frame(r));
+		auto crop_result_vec = detector.detect_batch(crop_mat_vec, thresh);
+
+		// previous boxes outside of the crops are carried over
+		std::vector<bbox_t> result_vec;
+		for (auto &b : prev_result_vec) {
+			cv::Point2f const center(b.x + b.w / 2.0F, b.y + b.h / 2.0F);
+			bool const inside = std::any_of(crop_vec.begin(), crop_vec.end(),
+				[&center](cv::Rect const& r) { return r.contains(center); });
+			if (!inside) result_vec.push_back(b);
+		}
+		for (size_t i = 0; i < crop_vec.size(); ++i) {
+			for (auto &b : crop_result_vec[i]) {
+				b.x += crop_vec[i].x;
+				b.y += crop_vec[i].y;
+				merge_box(result_vec, b, detector.nms);
+			}
+		}
+
+		++stats.crop_frames;
+		stats.crops += crop_vec.size();
+		stats.crop_area += area;
+		cur_grey.copyTo(key_grey);
+		prev_result_vec = result_vec;
+		return result_vec;
+	}
+
+private:
+	std::vector<bbox_t> detect_full(Detector &detector, cv::Mat frame, float thresh)
+	{
+		++stats.full_frames;
+		prev_result_vec = detector.detect(frame, thresh);
+		cur_grey.copyTo(key_grey);
+		return prev_result_vec;
+	}
+
+	// bounding rects (in frame pixels, padded) of 8-connected groups of changed cells
+	std::vector<cv::Rect> changed_regions(size_t min_cell_pixels, cv::Size frame_size)
+	{
+		int const cells_w = (mask.cols + cell_size - 1) / cell_size, cells_h = (mask.rows + cell_size - 1) / cell_size;
+		cells.assign(cells_w * cells_h, 0);
+		for (int y = 0; y < mask.rows; ++y) {
+			unsigned char const *row = mask.ptr<unsigned char>(y);
+			unsigned char *cell_row = cells.data() + (y / cell_size) * cells_w;
+			for (int x = 0; x < mask.cols; ++x)
+				if (row[x] && cell_row[x / cell_size] < 255) ++cell_row[x / cell_size];
+		}
+		for (auto &c : cells) c = (c >= min_cell_pixels) ? 1 : 0;
+
+		float const scale_x = (float)frame_size.width / mask.cols, scale_y = (float)frame_size.height / mask.rows;
+		cv::Rect const frame_rect(cv::Point(0, 0), frame_size);
+		std::vector<cv::Rect> rect_vec;
+		for (int i = 0; i < (int)cells.size(); ++i) {
+			if (cells[i] != 1) continue;
+			int min_x = cells_w, min_y = cells_h, max_x = -1, max_y = -1;
+			cell_stack.assign(1, i);
+			cells[i] = 2;
+			while (!cell_stack.empty()) {
+				int const k = cell_stack.back();
+				cell_stack.pop_back();
+				int const cx = k % cells_w, cy = k / cells_w;
+				min_x = std::min(min_x, cx), max_x = std::max(max_x, cx);
+				min_y = std::min(min_y, cy), max_y = std::max(max_y, cy);
+				for (int dy = -1; dy <= 1; ++dy) {
+					for (int dx = -1; dx <= 1; ++dx) {
+						int const nx = cx + dx, ny = cy + dy;
+						if (nx < 0 || ny < 0 || nx >= cells_w || ny >= cells_h) continue;
+						if (cells[ny*cells_w + nx] == 1) {
+							cells[ny*cells_w + nx] = 2;
+							cell_stack.push_back(ny*cells_w + nx);
+						}
+					}
+				}
+			}
+			float const x0 = min_x * cell_size * scale_x, y0 = min_y * cell_size * scale_y;
+			float const x1 = (max_x + 1) * cell_size * scale_x, y1 = (max_y + 1) * cell_size * scale_y;
+			float const pad = crop_pad * std::max(x1 - x0, y1 - y0);
+			cv::Rect r(cv::Point((int)(x0 - pad), (int)(y0 - pad)), cv::Point((int)(x1 + pad), (int)(y1 + pad)));
+			rect_vec.push_back(r & frame_rect);
+		}
+
+		// merge overlapping crops - an object shouldn't be split between two crops
+		for (bool merged = true; merged;) {
+			merged = false;
+			for (size_t i = 0; i < rect_vec.size() && !merged; ++i) {
+				for (size_t j = i + 1; j < rect_vec.size(); ++j) {
+					if ((rect_vec[i] & rect_vec[j]).area() > 0) {
+						rect_vec[i] |= rect_vec[j];
+						rect_vec.erase(rect_vec.begin() + j);
+						merged = true;
+						break;
+					}
+				}
+			}
+		}
+		return rect_vec;
+	}
+
+	// adds the box, or replaces the same-class box which overlaps it more than iou_thresh and has lower prob
+	static void merge_box(std::vector<bbox_t> &result_vec, bbox_t const& b, float iou_thresh)
+	{
+		if (iou_thresh <= 0) iou_thresh = 0.4F;
+		cv::Rect const rb(b.x, b.y, b.w, b.h);
+		for (auto &i : result_vec) {
+			if (i.obj_id != b.obj_id) continue;
+			cv::Rect const ri(i.x, i.y, i.w, i.h);
+			float const inter = (rb & ri).area(), uni = rb.area() + ri.area() - inter;
+			if (uni > 0 && inter / uni > iou_thresh) {
+				if (b.prob > i.prob) i = b;
+				return;
+			}
+		}
+		result_vec.push_back(b);
+	}
+};
+
+#endif	// OPENCV
+
+#endif
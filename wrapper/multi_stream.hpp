@@ -0,0 +1,336 @@
+#ifndef _DARKNET_WRAPPER_MULTI_STREAM_HPP_
+#define _DARKNET_WRAPPER_MULTI_STREAM_HPP_
+
+#ifdef __cplusplus
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#endif
+
+#ifdef OPENCV
+#include <opencv2/opencv.hpp>			// C++
+#endif	// OPENCV
+
+#include "box_image.h"
+#include "detector.hpp"
+#include "track_id.hpp"
+
+// Many cameras share one Detector: every stream keeps only its latest frame, the scheduler thread takes
+// at most one frame per stream into a cross-stream batch (Detector::detect_batch()), by the policy:
+//  EDF - earliest deadline first, the deadline of a frame is one period (1 / target_fps) after it became due
+//  WRR - smooth weighted round robin by the stream priorities
+// A stream isn't detected faster than its target fps, frames of live streams which are older than max_lag
+// are dropped instead of being detected late.
+
+enum stream_policy_t { STREAM_POLICY_EDF, STREAM_POLICY_WRR };
+
+// scheduling state of a stream, all times are in seconds
+struct stream_slot_t {
+	double period;			// 1 / target_fps
+	int weight;				// priority
+	bool live;				// frames can be dropped
+	bool pending;			// a frame waits for detection
+	double captured;		// capture time of the pending frame
+	double next_due;		// the next frame isn't detected earlier
+	int current;			// smooth weighted round robin counter
+};
+
+class stream_batcher_t {
+public:
+	stream_policy_t policy;
+	double max_lag;
+	std::vector<stream_slot_t> slots;
+
+	stream_batcher_t(stream_policy_t _policy = STREAM_POLICY_EDF, double _max_lag = 0.5) :
+		policy(_policy), max_lag(_max_lag) {}
+
+	int add(double target_fps, int weight, bool live)
+	{
+		stream_slot_t s;
+		s.period = 1.0 / std::max(0.01, target_fps);
+		s.weight = std::max(1, weight);
+		s.live = live;
+		s.pending = false;
+		s.captured = s.next_due = 0;
+		s.current = 0;
+		slots.push_back(s);
+		return slots.size() - 1;
+	}
+
+	// streams of the next batch; stale - live frames older than max_lag, they are dropped (pending = false)
+	std::vector<int> select(double now, int max_batch, std::vector<int> &stale)
+	{
+		std::vector<int> ready;
+		for (size_t i = 0; i < slots.size(); ++i) {
+			stream_slot_t &s = slots[i];
+			if (!s.pending) continue;
+			if (s.live && max_lag > 0 && now - s.captured > max_lag) {
+				s.pending = false;
+				stale.push_back(i);
+			}
+			else if (now >= s.next_due) ready.push_back(i);
+		}
+		if (policy == STREAM_POLICY_EDF) {
+			std::sort(ready.begin(), ready.end(), [&](int a, int b) {
+				double const da = deadline(slots[a]), db = deadline(slots[b]);
+				return (da != db) ? (da < db) : (slots[a].weight > slots[b].weight);
+			});
+			if (ready.size() > (size_t)max_batch) ready.resize(max_batch);
+			return ready;
+		}
+		std::vector<int> batch;
+		while (!ready.empty() && batch.size() < (size_t)max_batch) {
+			int total = 0;
+			size_t best = 0;
+			for (size_t k = 0; k < ready.size(); ++k) {
+				stream_slot_t &s = slots[ready[k]];
+				s.current += s.weight;
+				total += s.weight;
+				if (s.current > slots[ready[best]].current) best = k;
+			}
+			slots[ready[best]].current -= total;
+			batch.push_back(ready[best]);
+			ready.erase(ready.begin() + best);
+		}
+		return batch;
+	}
+
+	// the frame of the stream is taken into a batch
+	void taken(int id, double now)
+	{
+		stream_slot_t &s = slots[id];
+		s.pending = false;
+		s.next_due += s.period;
+		if (s.next_due < now - s.period) s.next_due = now + s.period;	// no burst after a stall
+	}
+
+	// the earliest time when a pending frame becomes due
+	double next_ready(double now) const
+	{
+		double t = now + 1;
+		for (auto &s : slots)
+			if (s.pending) t = std::min(t, s.next_due);
+		return std::max(t, now);
+	}
+
+private:
+	static double deadline(stream_slot_t const& s) { return std::max(s.captured, s.next_due) + s.period; }
+};
+
+#ifdef OPENCV
+
+struct stream_stats_t {
+	std::string source;
+	double target_fps;
+	double fps;				// achieved detections per second (moving average)
+	double lag;				// capture to result, sec (moving average)
+	unsigned long long captured, detected, dropped;
+};
+
+// Runtime: one capture thread per stream (cv::VideoCapture), one scheduler thread with the shared Detector,
+// each stream has its own track ids. Video files added as live are paced at their fps to simulate cameras.
+class multi_stream_t {
+	typedef std::chrono::steady_clock clock_type;
+
+	struct stream_t {
+		std::string source;
+		bool live;
+		cv::VideoCapture cap;
+		std::thread capture_thread;
+		bool ended;
+		cv::Mat frame;						// pending
+		track_id_t tracker;
+		cv::Mat result_frame;
+		std::vector<bbox_t> result_vec;
+		stream_stats_t stats;
+		double last_detected;
+		double interval;					// between detections, moving average
+	};
+
+	Detector &detector;
+	float const thresh;
+	stream_batcher_t batcher;
+	std::vector<std::unique_ptr<stream_t>> streams;
+	std::mutex mtx;
+	std::condition_variable cv_frame, cv_taken;
+	std::atomic<bool> running;
+	std::thread scheduler_thread;
+	clock_type::time_point const start_time;
+
+	double now() const { return std::chrono::duration<double>(clock_type::now() - start_time).count(); }
+	static double ema(double avg, double val) { return (avg <= 0) ? val : (0.9 * avg + 0.1 * val); }
+
+public:
+	// called from the scheduler thread with the detected frame and its tracked boxes
+	std::function<void(int stream_id, cv::Mat const& frame, std::vector<bbox_t> const& result_vec)> on_result;
+
+	multi_stream_t(Detector &_detector, stream_policy_t policy = STREAM_POLICY_EDF, float _thresh = 0.2,
+		double max_lag = 0.5) :
+		detector(_detector), thresh(_thresh), batcher(policy, max_lag), running(false), start_time(clock_type::now())
+	{}
+
+	~multi_stream_t() { stop(); }
+
+	// before start(), returns the stream id, -1 - can't be opened
+	int add_stream(std::string const& source, double target_fps, int priority = 1, bool live = true)
+	{
+		std::unique_ptr<stream_t> s(new stream_t);
+		if (!s->cap.open(source)) return -1;
+		s->source = source;
+		s->live = live;
+		s->ended = false;
+		s->stats.source = source;
+		s->stats.target_fps = target_fps;
+		s->stats.fps = s->stats.lag = 0;
+		s->stats.captured = s->stats.detected = s->stats.dropped = 0;
+		s->last_detected = -1;
+		s->interval = 0;
+		streams.push_back(std::move(s));
+		return batcher.add(target_fps, priority, live);
+	}
+
+	void start()
+	{
+		running = true;
+		for (size_t i = 0; i < streams.size(); ++i)
+			streams[i]->capture_thread = std::thread(&multi_stream_t::capture_loop, this, i);
+		scheduler_thread = std::thread(&multi_stream_t::scheduler_loop, this);
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			running = false;
+		}
+		cv_frame.notify_all();
+		cv_taken.notify_all();
+		for (auto &s : streams)
+			if (s->capture_thread.joinable()) s->capture_thread.join();
+		if (scheduler_thread.joinable()) scheduler_thread.join();
+	}
+
+	// all streams have ended and their frames are detected
+	bool is_finished()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		for (size_t i = 0; i < streams.size(); ++i)
+			if (!streams[i]->ended || batcher.slots[i].pending) return false;
+		return true;
+	}
+
+	std::vector<stream_stats_t> get_stats()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		std::vector<stream_stats_t> stats;
+		for (auto &s : streams) stats.push_back(s->stats);
+		return stats;
+	}
+
+	// the last detected frame of the stream and its boxes, false - nothing is detected yet
+	bool get_result(int id, cv::Mat &frame, std::vector<bbox_t> &result_vec)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stream_t &s = *streams[id];
+		if (s.result_frame.empty()) return false;
+		frame = s.result_frame;
+		result_vec = s.result_vec;
+		return true;
+	}
+
+private:
+	void capture_loop(size_t id)
+	{
+		stream_t &s = *streams[id];
+		std::string const protocol = s.source.substr(0, 7);
+		bool const network = protocol == "rtmp://" || protocol == "rtsp://" || protocol == "http://" || protocol == "https:/";
+		double const file_fps = s.cap.get(cv::CAP_PROP_FPS);
+		bool const paced = s.live && !network && file_fps > 0;	// a video file simulates a camera
+		clock_type::time_point const paced_start = clock_type::now();
+		unsigned long long n = 0;
+		while (running) {
+			cv::Mat frame;
+			s.cap >> frame;
+			if (frame.empty()) break;
+			++n;
+			if (paced) std::this_thread::sleep_until(paced_start + std::chrono::microseconds((long long)(n * 1e6 / file_fps)));
+			std::unique_lock<std::mutex> lock(mtx);
+			stream_slot_t &slot = batcher.slots[id];
+			while (!s.live && slot.pending && running) cv_taken.wait(lock);	// files are detected frame by frame
+			if (slot.pending) ++s.stats.dropped;	// the newer frame replaces it
+			s.frame = frame;
+			slot.pending = true;
+			slot.captured = now();
+			++s.stats.captured;
+			lock.unlock();
+			cv_frame.notify_one();
+		}
+		std::lock_guard<std::mutex> lock(mtx);
+		s.ended = true;
+		cv_frame.notify_one();
+	}
+
+	void scheduler_loop()
+	{
+		int const max_batch = detector.get_max_batch();
+		while (running) {
+			std::vector<int> ids;
+			std::vector<cv::Mat> mat_vec;
+			std::vector<double> captured_vec;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				double const t = now();
+				std::vector<int> stale;
+				ids = batcher.select(t, max_batch, stale);
+				for (int i : stale) {
+					++streams[i]->stats.dropped;
+					streams[i]->frame.release();
+				}
+				if (!stale.empty()) cv_taken.notify_all();
+				if (ids.empty()) {
+					double const wait = std::min(0.1, batcher.next_ready(t) - t);
+					cv_frame.wait_for(lock, std::chrono::microseconds((long long)(wait * 1e6) + 100));
+					continue;
+				}
+				for (int i : ids) {
+					mat_vec.push_back(streams[i]->frame);
+					captured_vec.push_back(batcher.slots[i].captured);
+					streams[i]->frame.release();
+					batcher.taken(i, t);
+				}
+			}
+			cv_taken.notify_all();
+
+			std::vector<std::vector<bbox_t>> result_vec = detector.detect_batch(mat_vec, thresh);
+			double const t = now();
+			for (size_t k = 0; k < ids.size(); ++k) {
+				stream_t &s = *streams[ids[k]];
+				result_vec[k] = s.tracker.update(result_vec[k]);
+				{
+					std::lock_guard<std::mutex> lock(mtx);
+					++s.stats.detected;
+					s.stats.lag = ema(s.stats.lag, t - captured_vec[k]);
+					if (s.last_detected >= 0) {
+						s.interval = ema(s.interval, t - s.last_detected);
+						s.stats.fps = (s.interval > 0) ? 1 / s.interval : 0;
+					}
+					s.last_detected = t;
+					s.result_frame = mat_vec[k];
+					s.result_vec = result_vec[k];
+				}
+				if (on_result) on_result(ids[k], mat_vec[k], result_vec[k]);
+			}
+		}
+	}
+};
+
+#endif	// OPENCV
+
+#endif	// _DARKNET_WRAPPER_MULTI_STREAM_HPP_
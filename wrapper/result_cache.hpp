@@ -0,0 +1,252 @@
+#ifndef _DARKNET_WRAPPER_RESULT_CACHE_HPP_
+#define _DARKNET_WRAPPER_RESULT_CACHE_HPP_
+
+#ifdef __cplusplus
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <string>
+#include <mutex>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#endif
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#include "box_image.h"
+#include "detector.hpp"
+
+struct result_cache_stats_t {
+	unsigned long long hits, misses;
+	size_t entries, bytes;
+};
+
+// Detection results keyed by a 64-bit hash of the decoded network input (image_t pixels) mixed with the model id,
+// threshold and sizes: byte-identical images and keyframes don't go through the network again.
+// LRU with a memory limit; with persist_file the entries are loaded from the memory-mapped file on construction
+// and written back by save() / the destructor.
+class result_cache_t {
+	typedef std::list<std::pair<uint64_t, std::vector<bbox_t>>> lru_list_t;
+
+	size_t const max_bytes;
+	std::string const persist_file;
+	uint64_t const model_hash;
+	lru_list_t lru;			// front - the most recently used
+	std::unordered_map<uint64_t, lru_list_t::iterator> index;
+	size_t bytes;
+	unsigned long long hits, misses;
+	std::mutex mtx;
+
+	static size_t entry_bytes(std::vector<bbox_t> const& boxes) { return 64 + boxes.size() * sizeof(bbox_t); }
+
+	static uint64_t mix(uint64_t h, uint64_t v)
+	{
+		h ^= v * 0x9E3779B97F4A7C15ULL;
+		h = (h << 31) | (h >> 33);
+		return h * 0xC2B2AE3D27D4EB4FULL;
+	}
+
+	struct file_header_t {
+		char magic[8];		// "DKRC0001"
+		uint64_t count;
+	};
+	struct file_entry_t {
+		uint64_t key;
+		uint32_t count;		// boxes which follow the entry
+		uint32_t reserved;
+	};
+
+	// under the mutex
+	void insert(uint64_t key, std::vector<bbox_t> const& boxes)
+	{
+		auto i = index.find(key);
+		if (i != index.end()) {
+			bytes -= entry_bytes(i->second->second);
+			lru.erase(i->second);
+		}
+		lru.push_front(std::make_pair(key, boxes));
+		index[key] = lru.begin();
+		bytes += entry_bytes(boxes);
+		while (bytes > max_bytes && !lru.empty()) {
+			bytes -= entry_bytes(lru.back().second);
+			index.erase(lru.back().first);
+			lru.pop_back();
+		}
+	}
+
+	void load()
+	{
+#ifdef _WIN32
+		HANDLE file = CreateFileA(persist_file.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		if (file == INVALID_HANDLE_VALUE) return;
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(file, &file_size);
+		size_t const size = (size_t)file_size.QuadPart;
+		HANDLE mapping = (size > 0) ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+		char const *data = mapping ? (char const *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+		int const fd = ::open(persist_file.c_str(), O_RDONLY);
+		if (fd < 0) return;
+		struct stat st;
+		size_t const size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+		void *ptr = (size > 0) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		::close(fd);
+		char const *data = (ptr == MAP_FAILED) ? NULL : (char const *)ptr;
+#endif
+		if (data && size >= sizeof(file_header_t) && memcmp(data, "DKRC0001", 8) == 0) {
+			file_header_t const *h = (file_header_t const *)data;
+			size_t pos = sizeof(file_header_t);
+			// the entries are stored from the least recently used
+			for (uint64_t k = 0; k < h->count && pos + sizeof(file_entry_t) <= size; ++k) {
+				file_entry_t const *e = (file_entry_t const *)(data + pos);
+				pos += sizeof(file_entry_t);
+				if (pos + e->count * sizeof(bbox_t) > size) break;
+				bbox_t const *b = (bbox_t const *)(data + pos);
+				insert(e->key, std::vector<bbox_t>(b, b + e->count));
+				pos += e->count * sizeof(bbox_t);
+			}
+		}
+#ifdef _WIN32
+		if (data) UnmapViewOfFile(data);
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+#else
+		if (data) munmap(ptr, size);
+#endif
+	}
+
+public:
+	// model_id - anything which identifies the weights, e.g. file_model_id() of the cfg and weights files
+	result_cache_t(std::string const& model_id, size_t _max_bytes = 64 * 1024 * 1024,
+		std::string const& _persist_file = std::string()) :
+		max_bytes(_max_bytes), persist_file(_persist_file), model_hash(hash_bytes(model_id.data(), model_id.size(), 0)),
+		bytes(0), hits(0), misses(0)
+	{
+		if (!persist_file.empty()) load();
+	}
+
+	~result_cache_t() { save(); }
+
+	// writes the entries to persist_file (through a temporary file), false - can't be written
+	bool save()
+	{
+		if (persist_file.empty()) return true;
+		std::lock_guard<std::mutex> lock(mtx);
+		std::string const tmp = persist_file + ".tmp";
+		FILE *f = fopen(tmp.c_str(), "wb");
+		if (!f) return false;
+		file_header_t h;
+		memcpy(h.magic, "DKRC0001", 8);
+		h.count = lru.size();
+		bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+		for (auto i = lru.rbegin(); i != lru.rend() && ok; ++i) {
+			file_entry_t e = { i->first, (uint32_t)i->second.size(), 0 };
+			ok = fwrite(&e, sizeof(e), 1, f) == 1 &&
+				(e.count == 0 || fwrite(i->second.data(), sizeof(bbox_t), e.count, f) == e.count);
+		}
+		ok = (fclose(f) == 0) && ok;
+#ifdef _WIN32
+		ok = ok && MoveFileExA(tmp.c_str(), persist_file.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+		ok = ok && rename(tmp.c_str(), persist_file.c_str()) == 0;
+#endif
+		return ok;
+	}
+
+	// 64-bit hash, 8 bytes per step
+	static uint64_t hash_bytes(void const* data, size_t size, uint64_t seed)
+	{
+		unsigned char const* p = (unsigned char const*)data;
+		uint64_t h = seed ^ (size * 0x9E3779B97F4A7C15ULL);
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			uint64_t v;
+			memcpy(&v, p + i, 8);
+			h = mix(h, v);
+		}
+		uint64_t tail = 0;
+		if (i < size) memcpy(&tail, p + i, size - i);
+		h = mix(h, tail);
+		h ^= h >> 29;
+		return h;
+	}
+
+	// names, sizes and modification times of the files: rewritten weights don't hit the old results
+	static std::string file_model_id(std::vector<std::string> const& files)
+	{
+		std::string id;
+		for (auto const& f : files) {
+			struct stat st;
+			char buf[64];
+			if (stat(f.c_str(), &st) == 0) sprintf(buf, "|%llu|%lld|", (unsigned long long)st.st_size, (long long)st.st_mtime);
+			else sprintf(buf, "|-|");
+			id += f + buf;
+		}
+		return id;
+	}
+
+	// key of the input image at the threshold, NMS threshold and network size
+	uint64_t key(image_t img, float thresh, float nms, int net_w, int net_h) const
+	{
+		uint64_t h = hash_bytes(img.data, (size_t)img.w * img.h * img.c * sizeof(float), model_hash);
+		uint32_t thresh_bits, nms_bits;
+		memcpy(&thresh_bits, &thresh, 4);
+		memcpy(&nms_bits, &nms, 4);
+		h = mix(h, ((uint64_t)img.w << 32) | (uint32_t)img.h);
+		h = mix(h, ((uint64_t)img.c << 32) | thresh_bits);
+		h = mix(h, nms_bits);
+		return mix(h, ((uint64_t)net_w << 32) | (uint32_t)net_h);
+	}
+
+	bool get(uint64_t key, std::vector<bbox_t> &boxes)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		auto i = index.find(key);
+		if (i == index.end()) {
+			++misses;
+			return false;
+		}
+		lru.splice(lru.begin(), lru, i->second);
+		boxes = i->second->second;
+		++hits;
+		return true;
+	}
+
+	void put(uint64_t key, std::vector<bbox_t> const& boxes)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		insert(key, boxes);
+	}
+
+	// Detector::detect() through the cache
+	std::vector<bbox_t> detect(Detector &detector, image_t img, float thresh = 0.2)
+	{
+		uint64_t const k = key(img, thresh, detector.nms, detector.get_net_width(), detector.get_net_height());
+		std::vector<bbox_t> boxes;
+		if (get(k, boxes)) return boxes;
+		boxes = detector.detect(img, thresh);
+		put(k, boxes);
+		return boxes;
+	}
+
+	result_cache_stats_t get_stats()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		result_cache_stats_t s;
+		s.hits = hits;
+		s.misses = misses;
+		s.entries = lru.size();
+		s.bytes = bytes;
+		return s;
+	}
+};
+
+#endif	// _DARKNET_WRAPPER_RESULT_CACHE_HPP_
@@ -0,0 +1,318 @@
+#ifndef _DARKNET_WRAPPER_SHM_RING_HPP_
+#define _DARKNET_WRAPPER_SHM_RING_HPP_
+
+#ifdef __cplusplus
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <cstdint>
+#endif
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+#endif	// _WIN32
+
+#include "box_image.h"
+#include "detector.hpp"
+
+#ifndef _WIN32
+
+// Ring of fixed-size slots in POSIX shared memory ("/dev/shm/<name>") between two processes: one writer and
+// one reader. A decoder process writes frames straight into a slot (width, height, stride, pixel format,
+// timestamp in the slot header), the detector process reads them in place - Detector::detect_pixels() resizes
+// the slot pixels into the network input, and publishes the boxes through a second ring (SHM_FORMAT_BOXES).
+// Waiting is done on the sequence counters of the ring header with futex on Linux (polling elsewhere).
+//
+// Decoder process (the console "shm:cam0" is the detector process):
+//	shm_ring_t frames, results;
+//	frames.create("cam0_frames", 4, 1920 * 1080 * 3);
+//	results.open("cam0_results", 5000);
+//	for (uint64_t id = 0; decode_next_frame(); ++id) {
+//		if (shm_slot_t *s = frames.acquire(0)) {		// NULL - the detector is behind, the frame is dropped
+//			s->frame_id = id, s->timestamp_us = now_us();
+//			s->width = 1920, s->height = 1080, s->stride = 1920 * 3, s->format = PIXEL_BGR24;
+//			s->bytes = s->stride * s->height;
+//			copy_frame_pixels(s->data());
+//			frames.commit();
+//		}
+//		while (shm_read_boxes(results, result_id, boxes, 0)) use_boxes(result_id, boxes);
+//	}
+//	frames.finish();
+
+#define SHM_RING_MAGIC 0x474e5244	// "DRNG"
+#define SHM_FORMAT_BOXES 100		// slot payload: count * bbox_t
+
+struct shm_ring_header_t {
+	uint32_t magic;
+	uint32_t slot_count;
+	uint64_t slot_bytes;			// payload capacity of a slot
+	uint64_t slot_stride;			// slot header + payload, 64-byte aligned
+	std::atomic<uint32_t> write_seq;	// slots committed by the writer (futex word)
+	std::atomic<uint32_t> read_seq;		// slots released by the reader (futex word)
+	std::atomic<uint32_t> finished;		// the writer won't commit more slots
+	std::atomic<uint32_t> ready;		// the header is initialized
+};
+
+struct shm_slot_t {
+	uint64_t frame_id;
+	int64_t timestamp_us;
+	uint32_t width, height, stride;	// stride - bytes per row
+	uint32_t format;				// pixel_format_t or SHM_FORMAT_BOXES
+	uint32_t bytes;					// used payload
+	uint32_t count;					// boxes of SHM_FORMAT_BOXES
+	uint64_t reserved[4];
+	unsigned char *data() { return (unsigned char *)(this + 1); }
+};
+
+class shm_ring_t {
+	std::string name;
+	shm_ring_header_t *header;
+	size_t map_size;
+	bool owner;			// created the ring, unlinks it on close
+
+	static void futex_wait(std::atomic<uint32_t> *word, uint32_t expected, int timeout_ms)
+	{
+#ifdef __linux__
+		struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+		syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected, &ts, NULL, 0);
+#else
+		if (word->load() == expected) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+	}
+
+	static void futex_wake(std::atomic<uint32_t> *word)
+	{
+#ifdef __linux__
+		syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+	}
+
+	shm_slot_t *slot(uint32_t seq) const {
+		return (shm_slot_t *)((char *)header + sizeof_header() + (seq % header->slot_count) * header->slot_stride);
+	}
+	static size_t sizeof_header() { return (sizeof(shm_ring_header_t) + 63) / 64 * 64; }
+
+	// waits while *word == value, false - timeout
+	static bool wait_change(std::atomic<uint32_t> *word, uint32_t value, int timeout_ms)
+	{
+		auto const deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+		while (word->load(std::memory_order_acquire) == value) {
+			int const left = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (left <= 0) return false;
+			futex_wait(word, value, left);
+		}
+		return true;
+	}
+
+public:
+	shm_ring_t() : header(NULL), map_size(0), owner(false) {}
+	~shm_ring_t() { close(); }
+
+	// creates (or re-creates) the ring, the creator unlinks it on close
+	bool create(std::string const& ring_name, int slot_count, size_t slot_bytes)
+	{
+		close();
+		name = (ring_name[0] == '/') ? ring_name : "/" + ring_name;
+		shm_unlink(name.c_str());
+		int const fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0) return false;
+		size_t const slot_stride = (sizeof(shm_slot_t) + slot_bytes + 63) / 64 * 64;
+		map_size = sizeof_header() + slot_stride * slot_count;
+		void *ptr = (ftruncate(fd, map_size) == 0) ? mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		::close(fd);
+		if (ptr == MAP_FAILED) {
+			shm_unlink(name.c_str());
+			return false;
+		}
+		header = (shm_ring_header_t *)ptr;	// zero-filled by ftruncate
+		header->magic = SHM_RING_MAGIC;
+		header->slot_count = slot_count;
+		header->slot_bytes = slot_bytes;
+		header->slot_stride = slot_stride;
+		header->ready.store(1, std::memory_order_release);
+		owner = true;
+		return true;
+	}
+
+	// opens a ring of another process, waits up to timeout_ms until it's created
+	bool open(std::string const& ring_name, int timeout_ms = 0)
+	{
+		close();
+		name = (ring_name[0] == '/') ? ring_name : "/" + ring_name;
+		auto const deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+		for (;;) {
+			int const fd = shm_open(name.c_str(), O_RDWR, 0600);
+			struct stat st;
+			if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof_header()) {
+				void *ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				::close(fd);
+				shm_ring_header_t *h = (ptr == MAP_FAILED) ? NULL : (shm_ring_header_t *)ptr;
+				if (h && h->ready.load(std::memory_order_acquire) && h->magic == SHM_RING_MAGIC) {
+					// the header is written by the other process: slot() has to stay inside the mapping
+					bool const valid = h->slot_count > 0 && h->slot_bytes <= h->slot_stride &&
+						h->slot_bytes + sizeof(shm_slot_t) <= h->slot_stride &&
+						h->slot_stride <= ((uint64_t)st.st_size - sizeof_header()) / h->slot_count;
+					if (!valid) {
+						munmap(ptr, st.st_size);
+						return false;
+					}
+					header = h;
+					map_size = st.st_size;
+					return true;
+				}
+				if (h) munmap(ptr, st.st_size);
+			}
+			else if (fd >= 0) ::close(fd);
+			if (std::chrono::steady_clock::now() >= deadline) return false;
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+	}
+
+	void close()
+	{
+		if (!header) return;
+		munmap(header, map_size);
+		if (owner) shm_unlink(name.c_str());
+		header = NULL;
+		owner = false;
+	}
+
+	bool is_opened() const { return header != NULL; }
+	size_t slot_bytes() const { return header->slot_bytes; }
+	int slot_count() const { return header->slot_count; }
+	// committed slots which aren't released by the reader yet
+	int pending() const { return header->write_seq.load() - header->read_seq.load(); }
+
+	//
+	// writer
+	//
+	// free slot, NULL - timeout (0 - don't wait: a live source drops the frame)
+	shm_slot_t *acquire(int timeout_ms = 0)
+	{
+		for (;;) {
+			uint32_t const read_seq = header->read_seq.load(std::memory_order_acquire);
+			uint32_t const write_seq = header->write_seq.load(std::memory_order_relaxed);
+			if (write_seq - read_seq < header->slot_count) return slot(write_seq);
+			if (timeout_ms <= 0 || !wait_change(&header->read_seq, read_seq, timeout_ms)) return NULL;
+		}
+	}
+
+	// publishes the acquired slot to the reader
+	void commit()
+	{
+		header->write_seq.fetch_add(1, std::memory_order_release);
+		futex_wake(&header->write_seq);
+	}
+
+	// end of the stream: the reader gets NULL when the committed slots are read
+	void finish()
+	{
+		header->finished.store(1, std::memory_order_release);
+		futex_wake(&header->write_seq);
+	}
+
+	//
+	// reader
+	//
+	// the oldest committed slot, valid until release(); NULL - timeout or the writer has finished
+	shm_slot_t *wait_slot(int timeout_ms)
+	{
+		auto const deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+		for (;;) {
+			uint32_t const write_seq = header->write_seq.load(std::memory_order_acquire);
+			uint32_t const read_seq = header->read_seq.load(std::memory_order_relaxed);
+			if (write_seq != read_seq) return slot(read_seq);
+			if (header->finished.load(std::memory_order_acquire)) return NULL;
+			int const left = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (left <= 0) return NULL;
+			futex_wait(&header->write_seq, write_seq, std::min(left, 100));	// finish() is re-checked
+		}
+	}
+
+	// the slot can be overwritten by the writer
+	void release()
+	{
+		header->read_seq.fetch_add(1, std::memory_order_release);
+		futex_wake(&header->read_seq);
+	}
+
+	bool is_finished() const {
+		return header->finished.load(std::memory_order_acquire) && header->write_seq.load() == header->read_seq.load();
+	}
+};
+
+// results ring: boxes of the frame, false - no free slot within timeout_ms
+inline bool shm_write_boxes(shm_ring_t &ring, uint64_t frame_id, int64_t timestamp_us, std::vector<bbox_t> const& boxes,
+	int timeout_ms = 100)
+{
+	shm_slot_t *s = ring.acquire(timeout_ms);
+	if (!s) return false;
+	size_t const count = std::min(boxes.size(), ring.slot_bytes() / sizeof(bbox_t));
+	s->frame_id = frame_id;
+	s->timestamp_us = timestamp_us;
+	s->format = SHM_FORMAT_BOXES;
+	s->count = count;
+	s->bytes = count * sizeof(bbox_t);
+	if (count) memcpy(s->data(), boxes.data(), s->bytes);
+	ring.commit();
+	return true;
+}
+
+// false - timeout or the writer has finished; a slot which isn't SHM_FORMAT_BOXES gives no boxes
+inline bool shm_read_boxes(shm_ring_t &ring, uint64_t &frame_id, std::vector<bbox_t> &boxes, int timeout_ms)
+{
+	shm_slot_t *s = ring.wait_slot(timeout_ms);
+	if (!s) return false;
+	frame_id = s->frame_id;
+	size_t const count = (s->format == SHM_FORMAT_BOXES) ? std::min<size_t>(s->count, ring.slot_bytes() / sizeof(bbox_t)) : 0;
+	bbox_t const* p = (bbox_t const*)s->data();
+	boxes.assign(p, p + count);
+	ring.release();
+	return true;
+}
+
+// Detector process: detects the frames of the frames ring in place and publishes their boxes to the results ring
+// (a result is dropped if the results reader doesn't keep up). Returns the number of detected frames when
+// the frames writer finishes or stop is set.
+inline size_t shm_detect_loop(Detector &detector, shm_ring_t &frames, shm_ring_t &results, float thresh,
+	std::atomic<bool> const& stop)
+{
+	size_t detected = 0;
+	while (!stop) {
+		shm_slot_t *s = frames.wait_slot(100);
+		if (!s) {
+			if (frames.is_finished()) break;
+			continue;
+		}
+		// the slot header is written by the other process: a frame which doesn't fit the slot gets no boxes
+		uint64_t const channels = (s->format == PIXEL_GRAY8) ? 1 : (s->format == PIXEL_RGBA32 || s->format == PIXEL_BGRA32) ? 4 : 3;
+		bool const valid = s->format <= PIXEL_GRAY8 && s->width > 0 && s->height > 0 &&
+			s->stride >= s->width * channels && (uint64_t)s->stride * s->height <= frames.slot_bytes();
+		std::vector<bbox_t> boxes;
+		if (valid)
+			boxes = detector.detect_pixels(s->data(), s->width, s->height, s->stride, (pixel_format_t)s->format, thresh);
+		uint64_t const frame_id = s->frame_id;
+		int64_t const timestamp_us = s->timestamp_us;
+		frames.release();
+		shm_write_boxes(results, frame_id, timestamp_us, boxes);
+		++detected;
+	}
+	results.finish();
+	return detected;
+}
+
+#endif	// _WIN32
+
+#endif	// _DARKNET_WRAPPER_SHM_RING_HPP_
@@ -0,0 +1,149 @@
+#ifndef _DARKNET_WRAPPER_TILED_DETECT_HPP_
+#define _DARKNET_WRAPPER_TILED_DETECT_HPP_
+
+#ifdef __cplusplus
+#include <vector>
+#include <algorithm>
+#endif
+
+#ifdef OPENCV
+#include <opencv2/opencv.hpp>			// C++
+#endif	// OPENCV
+
+#include "box_image.h"
+#include "detector.hpp"
+
+#ifdef OPENCV
+
+// Tiled detection for frames which are much larger than the network input (4K cameras):
+// the frame is split into overlapping tiles (network size by default, so small objects keep their pixels),
+// optionally the whole downscaled frame is added as a global view for large objects.
+// All tiles go through Detector::detect_batch() - one forward pass if Detector::get_max_batch() >= number of tiles.
+// Boxes of neighbouring tiles are merged with tile-aware NMS: a box which touches an inner tile border
+// is cut by the tile, so it is compared by intersection over the smaller box and two cut parts of the same
+// object are joined.
+class tiled_detect_t {
+public:
+	int tile_width, tile_height;	// in frame pixels, 0 - network width / height
+	float overlap;					// part of the tile which overlaps with the next tile
+	bool global_view;				// add the whole frame as one more batch image
+	float ios_thresh;				// intersection over smaller box to merge cut boxes
+	int border_margin;				// box is cut if it is closer to an inner tile border (pixels)
+
+	tiled_detect_t(int _tile_width = 0, int _tile_height = 0, float _overlap = 0.2F, bool _global_view = true) :
+		tile_width(_tile_width), tile_height(_tile_height), overlap(_overlap), global_view(_global_view),
+		ios_thresh(0.6F), border_margin(4)
+	{}
+
+	// tile rects which cover the frame, the last tile in a row/column is aligned to the frame border
+	std::vector<cv::Rect> get_tiles(cv::Size frame_size, int net_w, int net_h) const
+	{
+		int const tw = std::min(frame_size.width, (tile_width > 0) ? tile_width : net_w);
+		int const th = std::min(frame_size.height, (tile_height > 0) ? tile_height : net_h);
+		std::vector<int> const x_vec = tile_starts(frame_size.width, tw), y_vec = tile_starts(frame_size.height, th);
+		std::vector<cv::Rect> tile_vec;
+		for (int y : y_vec)
+			for (int x : x_vec)
+				tile_vec.push_back(cv::Rect(x, y, tw, th));
+		return tile_vec;
+	}
+
+	std::vector<bbox_t> detect(Detector &detector, cv::Mat frame, float thresh = 0.2)
+	{
+		if (frame.data == NULL)
+			throw std::runtime_error("Image is empty");
+
+		std::vector<cv::Rect> tile_vec = get_tiles(frame.size(), detector.get_net_width(), detector.get_net_height());
+		bool const with_global = global_view && tile_vec.size() > 1;
+
+		std::vector<cv::Mat> mat_vec;
+		for (auto &r : tile_vec) mat_vec.push_back(frame(r));
+		if (with_global) mat_vec.push_back(frame);
+		auto result_vec = detector.detect_batch(mat_vec, thresh);
+
+		std::vector<tile_box_t> box_vec;
+		for (size_t i = 0; i < result_vec.size(); ++i) {
+			bool const is_global = (i == tile_vec.size());
+			cv::Rect const tile = is_global ? cv::Rect(cv::Point(0, 0), frame.size()) : tile_vec[i];
+			for (auto &b : result_vec[i]) {
+				tile_box_t tb;
+				tb.bbox = b;
+				tb.bbox.x += tile.x;
+				tb.bbox.y += tile.y;
+				tb.cut = !is_global && is_cut(tb.bbox, tile, frame.size());
+				box_vec.push_back(tb);
+			}
+		}
+		return merge(box_vec, (detector.nms > 0) ? detector.nms : 0.4F);
+	}
+
+private:
+	struct tile_box_t {
+		bbox_t bbox;
+		bool cut;	// touches an inner border of its tile
+	};
+
+	std::vector<int> tile_starts(int size, int tile) const
+	{
+		std::vector<int> start_vec(1, 0);
+		if (tile >= size) return start_vec;
+		int const step = std::max(1, (int)(tile * (1 - overlap)));
+		int const count = 1 + (size - tile + step - 1) / step;
+		start_vec.clear();
+		for (int i = 0; i < count; ++i)	// spread evenly, the last one ends at the border
+			start_vec.push_back((int)((long long)(size - tile) * i / (count - 1)));
+		return start_vec;
+	}
+
+	bool is_cut(bbox_t const& b, cv::Rect const& tile, cv::Size frame_size) const
+	{
+		int const x0 = b.x, y0 = b.y, x1 = b.x + b.w, y1 = b.y + b.h;
+		return (tile.x > 0 && x0 <= tile.x + border_margin) ||
+			(tile.y > 0 && y0 <= tile.y + border_margin) ||
+			(tile.br().x < frame_size.width && x1 >= tile.br().x - border_margin) ||
+			(tile.br().y < frame_size.height && y1 >= tile.br().y - border_margin);
+	}
+
+	std::vector<bbox_t> merge(std::vector<tile_box_t> &box_vec, float iou_thresh) const
+	{
+		// whole boxes first, then by prob
+		std::sort(box_vec.begin(), box_vec.end(), [](tile_box_t const& a, tile_box_t const& b) {
+			return (a.cut != b.cut) ? !a.cut : (a.bbox.prob > b.bbox.prob);
+		});
+
+		std::vector<tile_box_t> kept_vec;
+		for (auto &i : box_vec) {
+			cv::Rect const ri(i.bbox.x, i.bbox.y, i.bbox.w, i.bbox.h);
+			bool suppressed = false;
+			for (auto &k : kept_vec) {
+				if (k.bbox.obj_id != i.bbox.obj_id) continue;
+				cv::Rect const rk(k.bbox.x, k.bbox.y, k.bbox.w, k.bbox.h);
+				float const inter = (ri & rk).area();
+				if (inter <= 0) continue;
+				float const iou = inter / (ri.area() + rk.area() - inter);
+				float const ios = inter / std::max(1, std::min(ri.area(), rk.area()));
+				if (iou > iou_thresh) {
+					suppressed = true;
+				}
+				else if ((i.cut || k.cut) && ios > ios_thresh) {
+					if (i.cut && k.cut) {	// two parts of one object on both sides of a tile border
+						cv::Rect const u = ri | rk;
+						k.bbox.x = u.x, k.bbox.y = u.y, k.bbox.w = u.width, k.bbox.h = u.height;
+						k.bbox.prob = std::max(k.bbox.prob, i.bbox.prob);
+					}
+					suppressed = true;
+				}
+				if (suppressed) break;
+			}
+			if (!suppressed) kept_vec.push_back(i);
+		}
+
+		std::vector<bbox_t> result_vec;
+		for (auto &k : kept_vec) result_vec.push_back(k.bbox);
+		return result_vec;
+	}
+};
+
+#endif	// OPENCV
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef _DARKNET_WRAPPER_TRACK_ID_HPP_
+#define _DARKNET_WRAPPER_TRACK_ID_HPP_
+
+#ifdef __cplusplus
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#endif
+
+#include "box_image.h"
+
+// Track ids of one stream: a box gets the id of the nearest box of the same class from the last frames_story
+// frames (center distance < max_dist), new objects get the next id of their class.
+// Each stream keeps its own track_id_t, the detector model can be shared (Detector::tracking_id() uses its own).
+class track_id_t {
+	std::deque<std::vector<bbox_t>> prev_bbox_vec_deque;
+	std::vector<unsigned int> next_id;		// per class
+
+	unsigned int new_id(unsigned int obj_id) {
+		if (obj_id >= next_id.size()) next_id.resize(obj_id + 1, 1);
+		return next_id[obj_id]++;
+	}
+
+public:
+	std::vector<bbox_t> update(std::vector<bbox_t> cur_bbox_vec, bool const change_history = true,
+		int const frames_story = 10, int const max_dist = 150)
+	{
+		bool prev_track_id_present = false;
+		for (auto &i : prev_bbox_vec_deque)
+			if (i.size() > 0) prev_track_id_present = true;
+
+		if (!prev_track_id_present) {
+			for (size_t i = 0; i < cur_bbox_vec.size(); ++i)
+				cur_bbox_vec[i].track_id = new_id(cur_bbox_vec[i].obj_id);
+			prev_bbox_vec_deque.push_front(cur_bbox_vec);
+			if (prev_bbox_vec_deque.size() > frames_story) prev_bbox_vec_deque.pop_back();
+			return cur_bbox_vec;
+		}
+
+		std::vector<unsigned int> dist_vec(cur_bbox_vec.size(), std::numeric_limits<unsigned int>::max());
+
+		for (auto &prev_bbox_vec : prev_bbox_vec_deque) {
+			for (auto &i : prev_bbox_vec) {
+				int cur_index = -1;
+				for (size_t m = 0; m < cur_bbox_vec.size(); ++m) {
+					bbox_t const& k = cur_bbox_vec[m];
+					if (i.obj_id == k.obj_id) {
+						float center_x_diff = (float)(i.x + i.w/2) - (float)(k.x + k.w/2);
+						float center_y_diff = (float)(i.y + i.h/2) - (float)(k.y + k.h/2);
+						unsigned int cur_dist = sqrt(center_x_diff*center_x_diff + center_y_diff*center_y_diff);
+						if (cur_dist < max_dist && (k.track_id == 0 || dist_vec[m] > cur_dist)) {
+							dist_vec[m] = cur_dist;
+							cur_index = m;
+						}
+					}
+				}
+
+				bool track_id_absent = !std::any_of(cur_bbox_vec.begin(), cur_bbox_vec.end(),
+					[&i](bbox_t const& b) { return b.track_id == i.track_id && b.obj_id == i.obj_id; });
+
+				if (cur_index >= 0 && track_id_absent){
+					cur_bbox_vec[cur_index].track_id = i.track_id;
+					cur_bbox_vec[cur_index].w = (cur_bbox_vec[cur_index].w + i.w) / 2;
+					cur_bbox_vec[cur_index].h = (cur_bbox_vec[cur_index].h + i.h) / 2;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < cur_bbox_vec.size(); ++i)
+			if (cur_bbox_vec[i].track_id == 0)
+				cur_bbox_vec[i].track_id = new_id(cur_bbox_vec[i].obj_id);
+
+		if (change_history) {
+			prev_bbox_vec_deque.push_front(cur_bbox_vec);
+			if (prev_bbox_vec_deque.size() > frames_story) prev_bbox_vec_deque.pop_back();
+		}
+
+		return cur_bbox_vec;
+	}
+};
+
+#endif	// _DARKNET_WRAPPER_TRACK_ID_HPP_
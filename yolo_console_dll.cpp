@@ -4,6 +4,7 @@
 #include <vector>
 #include <queue>
 #include <fstream>
+#include <sstream>
 #include <thread>
 #include <atomic>
 #include <mutex>              // std::mutex, std::unique_lock
@@ -27,6 +28,14 @@
 #include "wrapper/detector.hpp"
 #include "wrapper/preview.hpp"
 #include "wrapper/track_flow_nogpu.hpp"
+#include "wrapper/detect_scheduler.hpp"
+#include "wrapper/motion_gate.hpp"
+#include "wrapper/detect_server.hpp"
+#include "wrapper/shm_ring.hpp"
+#include "wrapper/multi_stream.hpp"
+#include "wrapper/batch_list.hpp"
+#include "wrapper/tiled_detect.hpp"
+#include "wrapper/cascade_detect.hpp"
 
 #ifdef OPENCV
 #include "cv/with_cv.hpp"
@@ -78,7 +87,9 @@ int main(int argc, char *argv[])
 
 	float const thresh = (argc > 5) ? std::stof(argv[5]) : 0.20;
 
-	Detector detector(cfg_file, weights_file);
+	// one model for all modes, "serve:", "batch:" and "multi:" detect batches of up to max_batch images
+	int const max_batch = 8;
+	Detector detector(cfg_file, weights_file, 0, max_batch);
 
 	auto obj_names = objects_names_from_file(names_file);
 	std::string out_videofile = "result.avi";
@@ -93,6 +104,125 @@ int main(int argc, char *argv[])
 		std::cout << "input image or video filename: ";
 		if(filename.size() == 0) std::cin >> filename;
 		if (filename.size() == 0) break;
+
+		if (filename.substr(0, 6) == "serve:") {	// HTTP inference server on localhost: "serve:8090"
+			detect_server_t server(detector, atoi(filename.substr(6).c_str()), 2, max_batch, 5, obj_names);
+			if (!server.is_opened()) std::cout << "Can't open the port \n";
+			else {
+				std::cout << "POST images to http://localhost:" << filename.substr(6) << "/detect, GET /stats \n"
+					<< "enter s - stats, q - stop \n";
+				for (std::string cmd; std::cin >> cmd && cmd != "q";) std::cout << server.stats_json() << std::endl;
+			}
+			filename.clear();
+			continue;
+		}
+		// list of images -> "<list>.jsonl", "cached_batch:" - the results are kept in "<weights>.results" across runs
+		bool const batch_cached = filename.substr(0, 13) == "cached_batch:";
+		if (filename.substr(0, 6) == "batch:" || batch_cached) {
+			std::string const list_file = filename.substr(batch_cached ? 13 : 6);
+			std::unique_ptr<result_cache_t> result_cache;
+			if (batch_cached)
+				result_cache.reset(new result_cache_t(result_cache_t::file_model_id({ cfg_file, weights_file }),
+					256 * 1024 * 1024, weights_file + ".results"));
+			batch_list_t batch_list(detector, std::max(1u, std::thread::hardware_concurrency() / 2), obj_names, thresh,
+				result_cache.get());
+			batch_list_stats_t const st = batch_list.process(list_file, list_file + ".jsonl");
+			std::cout << "Images: " << st.images << " (" << st.failed << " failed, " << st.cached << " cached), "
+				<< st.throughput() << " img/sec \n"
+				<< "Utilization: decode " << st.decode_utilization() << ", infer " << st.infer_utilization()
+				<< ", write " << st.write_utilization() << " \n";
+			filename.clear();
+			continue;
+		}
+		// "cascade:<screen cfg>,<screen weights>,<image or list.txt>" - the screen model (yolov2-tiny) escalates
+		// uncertain boxes to the loaded model
+		if (filename.substr(0, 8) == "cascade:") {
+			std::vector<std::string> args;
+			std::istringstream ss(filename.substr(8));
+			for (std::string arg; getline(ss, arg, ',');) args.push_back(arg);
+			if (args.size() != 3) std::cout << "use cascade:<screen cfg>,<screen weights>,<image or list.txt> \n";
+			else try {
+				Detector screen_detector(args[0], args[1]);
+				cascade_detect_t cascade_detect(screen_detector, detector, thresh / 2, 0.7F, thresh);
+				std::vector<std::string> images(1, args[2]);
+				if (args[2].substr(args[2].find_last_of(".") + 1) == "txt") {
+					images.clear();
+					std::ifstream file(args[2]);
+					for (std::string line; file >> line;) images.push_back(line);
+				}
+				for (auto &image_file : images) {
+					image_t img = Detector::load_image(image_file);
+					std::vector<bbox_t> result_vec = cascade_detect.detect(img);
+					Detector::free_image(img);
+					std::cout << image_file << std::endl;
+					show_console_result(result_vec, obj_names);
+				}
+				cascade_stats_t const& st = cascade_detect.stats;
+				std::cout << "Cascade: frames = " << st.frames << ", escalated = " << st.escalation_rate()
+					<< " (" << st.regions << " regions), screen latency = " << st.screen_latency()
+					<< " sec, full latency = " << st.full_latency() << " sec \n";
+			}
+			catch (std::exception &e) { std::cerr << "exception: " << e.what() << "\n"; }
+			filename.clear();
+			continue;
+		}
+#ifndef _WIN32
+		if (filename.substr(0, 4) == "shm:") {	// frames of a decoder process: rings "<name>_frames", "<name>_results"
+			std::string const ring_name = filename.substr(4);
+			shm_ring_t frames, results;
+			std::atomic<bool> stop_shm(false);
+			if (!results.create(ring_name + "_results", 8, 1024 * sizeof(bbox_t)) || !frames.open(ring_name + "_frames", 60000))
+				std::cout << "Can't open the shared memory rings \n";
+			else
+				std::cout << "Detected frames: " << shm_detect_loop(detector, frames, results, thresh, stop_shm) << " \n";
+			filename.clear();
+			continue;
+		}
+#endif	// _WIN32
+#ifdef OPENCV
+		if (filename.substr(0, 6) == "multi:") {	// list of streams, a line: "source [target_fps] [priority] [offline]"
+			multi_stream_t multi_stream(detector, STREAM_POLICY_EDF, thresh);
+			std::ifstream file(filename.substr(6));
+			for (std::string line; getline(file, line);) {
+				std::istringstream ss(line);
+				std::string source, offline;
+				double target_fps = 10;
+				int priority = 1;
+				if (!(ss >> source)) continue;
+				ss >> target_fps >> priority >> offline;
+				if (multi_stream.add_stream(source, target_fps, priority, offline != "offline") < 0)
+					std::cout << "Can't open " << source << " \n";
+			}
+			multi_stream.start();
+			while (!multi_stream.is_finished()) {
+				std::this_thread::sleep_for(std::chrono::seconds(1));
+				for (auto &st : multi_stream.get_stats())
+					std::cout << st.source << ": fps = " << std::setprecision(3) << st.fps << " / " << st.target_fps
+						<< ", lag = " << st.lag << " sec, detected = " << st.detected << ", dropped = " << st.dropped << " \n";
+			}
+			multi_stream.stop();
+			filename.clear();
+			continue;
+		}
+		if (filename.substr(0, 6) == "tiled:") {	// large image (4K camera) by overlapping tiles of the network size
+			cv::Mat mat_img = cv::imread(filename.substr(6));
+			if (mat_img.empty()) std::cout << "File not found! \n";
+			else {
+				tiled_detect_t tiled_detect;
+				auto start = std::chrono::steady_clock::now();
+				std::vector<bbox_t> result_vec = tiled_detect.detect(detector, mat_img, thresh);
+				std::chrono::duration<double> spent = std::chrono::steady_clock::now() - start;
+				std::cout << " Tiles: " << tiled_detect.get_tiles(mat_img.size(), detector.get_net_width(),
+					detector.get_net_height()).size() << ", time: " << spent.count() << " sec \n";
+				draw_boxes(mat_img, result_vec, obj_names);
+				cv::imshow("window name", mat_img);
+				show_console_result(result_vec, obj_names);
+				cv::waitKey(0);
+			}
+			filename.clear();
+			continue;
+		}
+#endif	// OPENCV
 		
 		try {
 #ifdef OPENCV
@@ -113,10 +243,14 @@ int main(int argc, char *argv[])
 				std::shared_ptr<image_t> det_image;
 				std::vector<bbox_t> result_vec, thread_result_vec;
 				detector.nms = 0.02;	// comment it - if track_id is not required
-				std::atomic<bool> consumed, videowrite_ready;
+				std::atomic<bool> consumed, videowrite_ready, use_scheduler, use_motion_gate;
 				bool exit_flag = false;
 				consumed = true;
 				videowrite_ready = true;
+				use_scheduler = false;
+				use_motion_gate = false;
+				motion_gate_t motion_gate;	// skip static frames, detect only changed regions
+				double thread_detect_latency = 0;
 				std::atomic<int> fps_det_counter, fps_cap_counter;
 				fps_det_counter = 0;
 				fps_cap_counter = 0;
@@ -142,6 +276,9 @@ int main(int argc, char *argv[])
 
 				int const video_fps = cap.get(CV_CAP_PROP_FPS);
 				cv::Size const frame_size = cur_frame.size();
+				// detect every N-th frame, propagate boxes on the others
+				detect_scheduler_t scheduler((video_fps > 0) ? video_fps : 25);
+				std::vector<bbox_t> scheduler_prev_vec;	// boxes of the previous frame, the motion is measured per frame
 				cv::VideoWriter output_video;
 				if (save_output_videofile)
 					output_video.open(out_videofile, CV_FOURCC('D', 'I', 'V', 'X'), std::max(35, video_fps), frame_size, true);
@@ -169,13 +306,16 @@ int main(int argc, char *argv[])
 					++cur_time_extrapolate;
 
 					// swap result bouned-boxes and input-frame
-					if(consumed)
+					bool const frame_detected = consumed && (!use_scheduler || scheduler.need_detect());
+					if(frame_detected)
 					{
 						std::unique_lock<std::mutex> lock(mtx);
 						det_image = detector.mat_to_image_resize(cur_frame);
+						det_frame = (use_motion_gate) ? cur_frame.clone() : cv::Mat();
 						auto old_result_vec = detector.tracking_id(result_vec);
 						auto detected_result_vec = thread_result_vec;
 						result_vec = detected_result_vec;
+						scheduler.detected(detected_result_vec, thread_detect_latency);
 #ifdef TRACK_OPTFLOW
 						// track optical flow
 						if (track_optflow_queue.size() > 0) {
@@ -226,19 +366,25 @@ int main(int argc, char *argv[])
 					if (!t_detect.joinable()) {
 						t_detect = std::thread([&]() {
 							auto current_image = det_image;
+							cv::Mat current_frame = det_frame;
 							consumed = true;
 							while (current_image.use_count() > 0 && !exit_flag) {
-								auto result = detector.detect_resized(*current_image, frame_size.width, frame_size.height, 
-									thresh, false);	// true
+								auto const det_start = std::chrono::steady_clock::now();
+								auto result = (!current_frame.empty()) ? motion_gate.detect(detector, current_frame, thresh) :
+									detector.detect_resized(*current_image, frame_size.width, frame_size.height, thresh, false);	// true
+								std::chrono::duration<double> const det_spent = std::chrono::steady_clock::now() - det_start;
 								++fps_det_counter;
 								std::unique_lock<std::mutex> lock(mtx);
 								thread_result_vec = result;
+								thread_detect_latency = det_spent.count();
 								consumed = true;
 								cv_detected.notify_all();
-								if (detector.wait_stream) {
+								// with the scheduler the detector waits for the next frame which is chosen for detection
+								if (detector.wait_stream || use_scheduler) {
 									while (consumed && !exit_flag) cv_pre_tracked.wait(lock);
 								}
 								current_image = det_image;
+								current_frame = det_frame;
 							}
 						});
 					}
@@ -255,6 +401,7 @@ int main(int argc, char *argv[])
 						}
 
 						large_preview.set(cur_frame, result_vec);
+						auto const propagate_start = std::chrono::steady_clock::now();
 #ifdef TRACK_OPTFLOW
 						++passed_flow_frames;
 						track_optflow_queue.push(cur_frame.clone());
@@ -263,9 +410,25 @@ int main(int argc, char *argv[])
 						small_preview.draw(cur_frame, show_small_boxes);
 #endif						
 						auto result_vec_draw = result_vec;
+						if (use_scheduler) {
+							if (!frame_detected) {
+#ifndef TRACK_OPTFLOW
+								result_vec_draw = extrapolate_coords.predict(cur_time_extrapolate);
+#endif
+								std::chrono::duration<double> const propagate_spent = std::chrono::steady_clock::now() - propagate_start;
+								scheduler.propagated(scheduler_prev_vec, result_vec_draw, propagate_spent.count());
+							}
+							scheduler.frame_done(frame_detected);
+							scheduler_prev_vec = result_vec_draw;
+							std::string const scheduler_str = "N = " + std::to_string(scheduler.get_n()) +
+								"  detected: " + std::to_string(scheduler.detected_frames) +
+								"  propagated: " + std::to_string(scheduler.propagated_frames);
+							cv::putText(cur_frame, scheduler_str, cv::Point2f(10, 60), cv::FONT_HERSHEY_COMPLEX_SMALL, 1.0, cv::Scalar(50, 50, 0), 2);
+						}
 						if (extrapolate_flag) {
 							result_vec_draw = extrapolate_coords.predict(cur_time_extrapolate);
-							cv::putText(cur_frame, "extrapolate", cv::Point2f(10, 40), cv::FONT_HERSHEY_COMPLEX_SMALL, 1.0, cv::Scalar(50, 50, 0), 2);
+							std::string const extrapolate_str = (extrapolate_coords.use_kalman) ? "extrapolate - kalman" : "extrapolate";
+							cv::putText(cur_frame, extrapolate_str, cv::Point2f(10, 40), cv::FONT_HERSHEY_COMPLEX_SMALL, 1.0, cv::Scalar(50, 50, 0), 2);
 						}
 						draw_boxes(cur_frame, result_vec_draw, obj_names, current_det_fps, current_cap_fps);
 						//show_console_result(result_vec, obj_names);
@@ -277,6 +440,9 @@ int main(int argc, char *argv[])
 						if (key == 'f') show_small_boxes = !show_small_boxes;
 						if (key == 'p') while (true) if(cv::waitKey(100) == 'p') break;
 						if (key == 'e') extrapolate_flag = !extrapolate_flag;
+						if (key == 'k') extrapolate_coords.use_kalman = !extrapolate_coords.use_kalman;
+						if (key == 'n') use_scheduler = !use_scheduler, cv_pre_tracked.notify_all();
+						if (key == 'm') use_motion_gate = !use_motion_gate;
 						if (key == 27) { exit_flag = true; break; }
 
 						if (output_video.isOpened() && videowrite_ready) {
@@ -298,10 +464,20 @@ int main(int argc, char *argv[])
 #endif
 				}
 				exit_flag = true;
+				cv_pre_tracked.notify_all();
 				if (t_cap.joinable()) t_cap.join();
 				if (t_detect.joinable()) t_detect.join();
 				if (t_videowrite.joinable()) t_videowrite.join();
 				std::cout << "Video ended \n";
+				if (scheduler.detected_frames + scheduler.propagated_frames > 0)
+					std::cout << "Scheduler: detected frames = " << scheduler.detected_frames
+						<< ", propagated frames = " << scheduler.propagated_frames
+						<< ", detect latency = " << scheduler.get_detect_latency() << " sec \n";
+				motion_gate_stats_t const gate_stats = motion_gate.get_stats();
+				if (gate_stats.frames > 0)
+					std::cout << "Motion gate: frames = " << gate_stats.frames << ", static = " << gate_stats.static_frames
+						<< ", crop = " << gate_stats.crop_frames << " (" << gate_stats.crops << " crops), full = " 
+						<< gate_stats.full_frames << " \n";
 				break;
 			}
 			else if (file_ext == "txt") {	// list of image files
@@ -310,8 +486,7 @@ int main(int argc, char *argv[])
 				else 
 					for (std::string line; file >> line;) {
 						std::cout << line << std::endl;
-						cv::Mat mat_img = cv::imread(line);
-						std::vector<bbox_t> result_vec = detector.detect(mat_img);
+						std::vector<bbox_t> result_vec = detector.detect_reduced(line);	// decoded at reduced size
 						show_console_result(result_vec, obj_names);
 						//draw_boxes(mat_img, result_vec, obj_names);
 						//cv::imwrite("res_" + line, mat_img);
@@ -319,27 +494,30 @@ int main(int argc, char *argv[])
 				
 			}
 			else {	// image file
-				cv::Mat mat_img = cv::imread(filename);
-				
 				auto start = std::chrono::steady_clock::now();
-				std::vector<bbox_t> result_vec = detector.detect(mat_img);
+				int orig_w, orig_h;
+				// decoded once at reduced size, the same pixels are detected and shown
+				cv::Mat mat_img = Detector::imread_reduced(filename, detector.get_net_width(), detector.get_net_height(),
+					orig_w, orig_h);
+				if (mat_img.empty())
+					throw std::runtime_error("file not found");
+				std::vector<bbox_t> result_vec = detector.detect_pixels(mat_img.data, mat_img.cols, mat_img.rows,
+					(int)mat_img.step, PIXEL_BGR24);
 				auto end = std::chrono::steady_clock::now();
 				std::chrono::duration<double> spent = end - start;
 				std::cout << " Time: " << spent.count() << " sec \n";
 
 				//result_vec = detector.tracking_id(result_vec);	// comment it - if track_id is not required
 				draw_boxes(mat_img, result_vec, obj_names);
-				if(!mat_img.empty())
 				cv::imshow("window name", mat_img);
+				// boxes in the pixels of the original image
+				float const wk = (float)orig_w / mat_img.cols, hk = (float)orig_h / mat_img.rows;
+				for (auto &i : result_vec) i.x *= wk, i.w *= wk, i.y *= hk, i.h *= hk;
 				show_console_result(result_vec, obj_names);
 				cv::waitKey(0);
 			}
 #else
-			//std::vector<bbox_t> result_vec = detector.detect(filename);
-
-			auto img = detector.load_image(filename);
-			std::vector<bbox_t> result_vec = detector.detect(img);
-			detector.free_image(img);
+			std::vector<bbox_t> result_vec = detector.detect_reduced(filename);
 			show_console_result(result_vec, obj_names);
 #endif			
 		}